@@ -7,14 +7,20 @@ void displayHelp()
 {
     printf("List of commands:\n");
     printf("  ls       - List files and directories\n");
-    printf("  cd       - Change directory\n");
+    printf("  cd       - Change directory (absolute or relative path)\n");
     printf("  mkdir    - Make directory\n");
     printf("  rmdir    - Remove directory\n");
-    printf("  put      - Put file into the space\n");
+    printf("  put      - Put file into the space (put -r <dir> imports a directory tree)\n");
     printf("  cat      - Show content\n");
-    printf("  get      - Get file from the space\n");
+    printf("  get      - Get file from the space (get -r [-u] <path> <host dir> exports a tree, -u skips unchanged files)\n");
     printf("  rm       - Remove file\n");
+    printf("  cp       - cp [--reflink] <src> <dst> copies a file or directory (--reflink shares its data blocks)\n");
+    printf("  mv       - mv <src> <dst> renames or moves a file or directory\n");
+    printf("  snapshot - snapshot <name> freezes the tree as read-only /.snapshots/<name>, copying directories only once they change\n");
     printf("  status   - Show status of space\n");
+    printf("  defrag   - Compact free space and files (run repeatedly)\n");
+    printf("  scrub    - Verify the checksums of all blocks and list damaged files\n");
+    printf("  sync     - Checkpoint: write the journaled changes into the image\n");
     printf("  help     - Show help\n");
     printf("  exit     - Exit and store img\n");
 }
@@ -45,7 +51,13 @@ void handleCommand(char *command, FileSystem *fs)
     {
         char name[MAX_NAME_LENGTH];
         scanf("%s", name);
-        put(fs, name);
+        if (strcmp(name, "-r") == 0)
+        {
+            scanf("%s", name);
+            putTree(fs, name);
+        }
+        else
+            put(fs, name);
     }
     else if (strcmp(command, "cat") == 0)
     {
@@ -57,7 +69,22 @@ void handleCommand(char *command, FileSystem *fs)
     {
         char name[MAX_NAME_LENGTH];
         scanf("%s", name);
-        get(fs, name);
+        if (strcmp(name, "-r") == 0)
+        {
+            // get -r [-u] <path> <host dir>
+            char hostdir[MAX_PATH_LENGTH];
+            int skip_current = 0;
+            scanf("%s", name);
+            if (strcmp(name, "-u") == 0)
+            {
+                skip_current = 1;
+                scanf("%s", name);
+            }
+            scanf("%s", hostdir);
+            getTree(fs, name, hostdir, skip_current);
+        }
+        else
+            get(fs, name);
     }
     else if (strcmp(command, "rm") == 0)
     {
@@ -65,6 +92,34 @@ void handleCommand(char *command, FileSystem *fs)
         scanf("%s", name);
         rm(fs, name);
     }
+    else if (strcmp(command, "cp") == 0)
+    {
+        // cp [--reflink] <src> <dst>
+        char source[MAX_PATH_LENGTH];
+        char destination[MAX_PATH_LENGTH];
+        int reflink = 0;
+        scanf("%s", source);
+        if (strcmp(source, "--reflink") == 0)
+        {
+            reflink = 1;
+            scanf("%s", source);
+        }
+        scanf("%s", destination);
+        cp(fs, source, destination, reflink);
+    }
+    else if (strcmp(command, "mv") == 0)
+    {
+        char source[MAX_PATH_LENGTH];
+        char destination[MAX_PATH_LENGTH];
+        scanf("%s %s", source, destination);
+        mv(fs, source, destination);
+    }
+    else if (strcmp(command, "snapshot") == 0)
+    {
+        char name[MAX_NAME_LENGTH];
+        scanf("%s", name);
+        snapshot(fs, name);
+    }
     else if (strcmp(command, "touch") == 0)
     {
         char name[MAX_NAME_LENGTH];
@@ -73,6 +128,22 @@ void handleCommand(char *command, FileSystem *fs)
     }
     else if (strcmp(command, "status") == 0)
         status(fs);
+    else if (strcmp(command, "defrag") == 0)
+        defrag(fs);
+    else if (strcmp(command, "scrub") == 0)
+        scrub(fs);
+    else if (strcmp(command, "sync") == 0)
+    {
+        if (!fs->image_attached)
+        {
+            char pwd[7];
+            printf("Enter 6-digit password to save: ");
+            scanf("%6s", pwd);
+            saveFileSystem(fs, pwd);
+        }
+        else
+            syncFileSystem(fs);
+    }
     else if (strcmp(command, "help") == 0)
         displayHelp();
     else if (strcmp(command, "exit") == 0)
@@ -81,6 +152,7 @@ void handleCommand(char *command, FileSystem *fs)
         printf("Enter 6-digit password to save: ");
         scanf("%6s", pwd);
         saveFileSystem(fs, pwd);
+        freeFileSystem(fs);
         exit(0);
     }
     else
@@ -126,6 +198,10 @@ int main()
         if (scanf("%s", cmd) == EOF)
             break;
         handleCommand(cmd, fs);
+        reclaimStep(fs, RECLAIM_INODES_PER_CALL);
+        // everything the command changed becomes durable with one fsync
+        journalCommit(fs);
     }
+    freeFileSystem(fs);
     return 0;
 }
\ No newline at end of file
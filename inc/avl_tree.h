@@ -0,0 +1,48 @@
+#ifndef AVL_TREE_H
+#define AVL_TREE_H
+
+#include <stddef.h>
+
+// Intrusive AVL tree. A record embeds one AvlNode per tree it sits in
+// and the tree orders nodes with a comparison callback; AVL_ENTRY() gets
+// the record back from a node. Start-keyed trees share the floor and
+// ceiling searches below; other searches (best fit) walk the tree themselves.
+// Updates are O(log n) and allocate nothing.
+
+typedef struct AvlNode
+{
+    struct AvlNode *left;
+    struct AvlNode *right;
+    int height;
+} AvlNode;
+
+#define AVL_ENTRY(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+// <0, 0 or >0 as `a` orders before, with or after `b`.
+typedef int (*AvlCompare)(const AvlNode *a, const AvlNode *b);
+
+// Link `node` into the tree at `root`, after any equal nodes. Returns the new root.
+AvlNode *avlInsert(AvlNode *root, AvlNode *node, AvlCompare compare);
+
+// Unlink `node`, which is in the tree and compares equal to no other
+// node. Returns the new root.
+AvlNode *avlRemove(AvlNode *root, AvlNode *node, AvlCompare compare);
+
+// Trees of block runs ordered by their first block use this node: the
+// record embeds an AvlStartNode, sets `start` and links `node` with
+// avlCompareStart.
+typedef struct AvlStartNode
+{
+    AvlNode node;
+    size_t start;
+} AvlStartNode;
+
+int avlCompareStart(const AvlNode *a, const AvlNode *b);
+
+// Last node starting at or before `start`, or NULL.
+AvlStartNode *avlStartFloor(const AvlNode *root, size_t start);
+
+// First node starting at or after `start`, or NULL.
+AvlStartNode *avlStartCeil(const AvlNode *root, size_t start);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef BLOCK_ALLOC_H
+#define BLOCK_ALLOC_H
+
+#include "fs_types.h"
+
+// Reserve `count` data blocks using as few extents as possible.
+// On success the blocks are marked used and *extents is a malloc'd array
+// of *extent_count entries; returns 0. Returns -1 if space is insufficient.
+int allocateBlocks(FileSystem *fs, size_t count, Extent **extents, size_t *extent_count);
+
+// Mark exactly these extents used, e.g. when replaying the journal; blocks
+// already in use gain a reference (see dedup.h). Returns -1, claiming
+// nothing, if an extent lies outside the partition or out of memory.
+int claimExtents(FileSystem *fs, const Extent *extents, size_t extent_count);
+
+// Drop a reference to each block of an extent list; blocks nobody else
+// references go back to the free pool.
+void freeExtents(FileSystem *fs, const Extent *extents, size_t extent_count);
+
+#endif
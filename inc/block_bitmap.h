@@ -0,0 +1,31 @@
+#ifndef BLOCK_BITMAP_H
+#define BLOCK_BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One bit per data block, 1 = used. Bits past the last block are kept at 0
+// and are masked out by the search routines.
+#define BITMAP_WORD_BITS 64
+
+size_t bitmapWordCount(size_t bits);
+uint64_t *bitmapCreate(size_t bits);
+
+int bitmapTest(const uint64_t *map, size_t bit);
+void bitmapSetRange(uint64_t *map, size_t start, size_t count);
+void bitmapClearRange(uint64_t *map, size_t start, size_t count);
+size_t bitmapCountSet(const uint64_t *map, size_t bits);
+
+// Index of the first clear/set bit at or after `from`, or `bits` if none.
+size_t bitmapNextClear(const uint64_t *map, size_t bits, size_t from);
+size_t bitmapNextSet(const uint64_t *map, size_t bits, size_t from);
+
+// Maximal run of clear bits starting at or after `from`.
+// Returns 0 when there is no clear bit left.
+int bitmapNextFreeRun(const uint64_t *map, size_t bits, size_t from, size_t *start, size_t *length);
+
+// Find the first run of `count` clear bits in [0, bits).
+// Returns 1 and stores the run start in *start, or 0 if no such run exists.
+int bitmapFindFreeRun(const uint64_t *map, size_t bits, size_t count, size_t *start);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fs_types.h"
+
+// CRC32C (Castagnoli) of the data blocks and of the image metadata, with
+// the SSE4.2 / ARMv8 crc32 instructions where the CPU has them and a
+// table otherwise.
+//
+// fs->block_crc holds one checksum per block. It is set when a dirty block
+// is stored into the image (see dirty.h) and saved with the metadata, so
+// it describes what the image holds: dirty blocks are newer than their
+// checksum and are not verified. Reads verify the clean blocks of a file
+// before handing it out; scrub verifies every block in use.
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+// Recompute the checksums of blocks [start, start + count).
+void checksumUpdate(FileSystem *fs, size_t start, size_t count);
+
+// Number of clean blocks of `file` that no longer match their checksum.
+size_t checksumVerifyFile(const FileSystem *fs, const Inode *file);
+
+#endif
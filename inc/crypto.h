@@ -0,0 +1,36 @@
+#ifndef CRYPTO_H
+#define CRYPTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Self-contained primitives for the image encryption (see image_crypt.h):
+// SHA-256, HMAC-SHA256 and PBKDF2 to turn the password into keys, and the
+// ChaCha20-Poly1305 AEAD of RFC 8439 for the data. ChaCha20 runs four
+// blocks at a time with SSE2 on x86-64, eight with AVX2 where the CPU has
+// it; Poly1305 uses 64-bit limbs where the compiler has a 128-bit product.
+
+#define SHA256_SIZE 32
+#define AEAD_KEY_SIZE 32
+#define AEAD_NONCE_SIZE 12
+#define AEAD_TAG_SIZE 16
+
+void sha256(const void *data, size_t length, uint8_t digest[SHA256_SIZE]);
+void hmacSha256(const void *key, size_t key_length, const void *data, size_t length, uint8_t mac[SHA256_SIZE]);
+void pbkdf2Sha256(const void *password, size_t password_length, const void *salt, size_t salt_length,
+                  uint32_t iterations, uint8_t *out, size_t out_length);
+
+// Encrypt `length` bytes in place and compute the tag over `aad` and the
+// ciphertext.
+void aeadSeal(const uint8_t key[AEAD_KEY_SIZE], const uint8_t nonce[AEAD_NONCE_SIZE],
+              const void *aad, size_t aad_length, void *data, size_t length, uint8_t tag[AEAD_TAG_SIZE]);
+
+// Check the tag and decrypt in place; returns -1, leaving `data` as it
+// was, if the tag does not match.
+int aeadOpen(const uint8_t key[AEAD_KEY_SIZE], const uint8_t nonce[AEAD_NONCE_SIZE],
+             const void *aad, size_t aad_length, void *data, size_t length, const uint8_t tag[AEAD_TAG_SIZE]);
+
+// Fill `out` from the system's random source.
+void randomBytes(void *out, size_t length);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include "fs_types.h"
+
+// Blocks shared by several files, and the fingerprints that find them.
+//
+// A block in use has one reference unless the reference table says more.
+// The table holds runs of consecutive blocks with the same number of
+// extra references in a balanced tree by start block, so sharing a whole
+// extent (a clone, see clone.c) costs one run, and a file system without
+// sharing has an empty table that freeExtents() (see block_alloc.h) skips.
+// Freeing a shared block drops a reference instead of clearing its
+// block_bitmap bit. The table is not saved: loading counts the references
+// of the inode tree again.
+//
+// put and put -r fingerprint each block they store with a 64-bit hash and
+// look it up in the fingerprint table; a block whose contents already sit
+// in another block in use (compared byte for byte, so a hash collision
+// only costs a missed match) is given back and the file points at the
+// other one. The table starts empty on load and is filled from the blocks
+// in use the first time it is needed. Build with -DFS_NO_DEDUP to store
+// every block as written; shared blocks of an image are still honoured.
+
+int dedupInit(FileSystem *fs);
+void dedupDestroy(FileSystem *fs);
+
+// Count the references the inode tree holds to each block, e.g. after a
+// load. Returns -1 if out of memory.
+int dedupCountReferences(FileSystem *fs);
+
+// 1 if any block of [start, start + count) has more than one reference.
+int dedupShared(const FileSystem *fs, size_t start, size_t count);
+
+// One more reference to each in-use block of [start, start + count); -1,
+// adding none, if out of memory.
+int dedupAddReferences(FileSystem *fs, size_t start, size_t count);
+
+// Length of the run of blocks from `start` (up to `end`) with a single
+// reference; 0 if the block at `start` is shared.
+size_t dedupUnsharedRun(const FileSystem *fs, size_t start, size_t end);
+// Drop one reference from the shared blocks from `start` (up to `end`)
+// that have as many references; returns how many blocks that covered.
+size_t dedupDropShared(FileSystem *fs, size_t start, size_t end);
+
+// Fill the fingerprint table from the blocks in use, unless it already
+// covers them. Called before new blocks are written.
+void dedupPrepare(FileSystem *fs);
+
+// 1 if new blocks are deduplicated: inline dedup is built in and the
+// fingerprint table is ready.
+int dedupActive(const FileSystem *fs);
+
+// Fingerprints of the file's blocks in logical order, one per block.
+// Only reads the blocks, so workers may run it on disjoint files.
+void dedupFingerprintFile(const FileSystem *fs, const Inode *file, uint64_t *prints);
+
+// Point the newly written blocks of `file` at blocks already holding the
+// same contents and free its copies. `prints` comes from
+// dedupFingerprintFile(), or NULL to compute it here. Call before the
+// file's extents are journaled. Returns the number of blocks freed.
+size_t dedupFile(FileSystem *fs, Inode *file, const uint64_t *prints);
+
+// Blocks [src, src + count) were copied to dst (defrag).
+void dedupMoved(FileSystem *fs, size_t src, size_t dst, size_t count);
+
+// Blocks [start, start + count) lost their last reference and are about to
+// be freed: drop their fingerprints. Reads the blocks, so call it first.
+void dedupForget(FileSystem *fs, size_t start, size_t count);
+
+// Extra references over all blocks, and the fingerprint table's entries
+// and bytes.
+void dedupStats(const FileSystem *fs, size_t *shared_references, size_t *entries, size_t *bytes);
+
+#endif
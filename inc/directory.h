@@ -0,0 +1,34 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include "fs_types.h"
+
+// Directories holding at least DIR_INDEX_THRESHOLD items get an
+// open-addressing hash index on their first lookup; smaller directories
+// are searched linearly. Once built, the index follows every add/remove.
+#define DIR_INDEX_THRESHOLD 32
+
+uint32_t nameHash(const char *name);
+
+// Item of `dir` called `name`, or NULL.
+Inode *dirLookup(Inode *dir, const char *name);
+
+// Make room for `extra` more items with at most one reallocation, so bulk
+// inserts (loading, batch imports) size the array once.
+int dirReserve(Inode *dir, size_t extra);
+
+// Append `item` to `dir`; the item array doubles when full. Returns -1 if
+// it cannot grow.
+int dirAddItem(Inode *dir, Inode *item);
+
+// Unlink `item` from `dir` in O(1) by moving the last item into its slot,
+// so directory order is not preserved. Returns -1 if it is not there.
+int dirRemoveItem(Inode *dir, Inode *item);
+
+// Free the item array and index of `dir` (its items are not touched).
+void dirClearItems(Inode *dir);
+
+// Free the hash index of `dir`, if any.
+void dirDropIndex(Inode *dir);
+
+#endif
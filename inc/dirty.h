@@ -0,0 +1,39 @@
+#ifndef DIRTY_H
+#define DIRTY_H
+
+#include "fs_types.h"
+
+// What changed since the image was last written, so a sync only writes
+// that: data blocks whose contents changed, words of block_bitmap whose
+// bits changed, and whether the inode tree must be serialized again.
+// Contents of freed blocks do not matter, so freeing only dirties the
+// bitmap. Without the tracking bitmaps (out of memory) everything counts
+// as dirty.
+
+int dirtyInit(FileSystem *fs);
+void dirtyDestroy(FileSystem *fs);
+
+// Blocks [start, start + count) were written. Not thread safe: parallel
+// writers mark their blocks before they start.
+void dirtyMarkData(FileSystem *fs, size_t start, size_t count);
+
+// block_bitmap bits [start, start + count) changed.
+void dirtyMarkBitmap(FileSystem *fs, size_t start, size_t count);
+
+// An inode was added, removed, renamed or got new extents, or block
+// checksums changed: the metadata must be written again.
+void dirtyMarkTree(FileSystem *fs);
+
+size_t dirtyBlockCount(const FileSystem *fs);
+
+// 1 if block_bitmap, the inode tree or, through dirty data blocks, the
+// block checksums changed.
+int dirtyMetaPending(const FileSystem *fs);
+
+// The data blocks are on disk; the metadata may not be.
+void dirtyClearData(FileSystem *fs);
+
+// Everything is on disk.
+void dirtyClear(FileSystem *fs);
+
+#endif
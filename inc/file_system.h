@@ -5,16 +5,25 @@
 
 // Core Lifecycle
 FileSystem *createFileSystem(size_t size);
-// void freeFileSystem(FileSyste。m *fs); // 建議新增：釋放所有資源
+void freeFileSystem(FileSystem *fs); // 釋放所有資源 (inode 與名稱以整塊 chunk 釋放)
 
 // File Operations
 void my_mkdir(FileSystem *fs, const char *dirname);
 void my_rmdir(FileSystem *fs, const char *dirname);
 void put(FileSystem *fs, const char *filename);
+void putTree(FileSystem *fs, const char *hostdir); // put -r: import a host directory tree in parallel
 void get(FileSystem *fs, const char *filename);
+// get -r: export a subtree into hostdir in parallel; skip_current skips host files with the same size and mtime
+void getTree(FileSystem *fs, const char *path, const char *hostdir, int skip_current);
 void cat(FileSystem *fs, const char *filename);
 void rm(FileSystem *fs, const char *filename);
 void touch(FileSystem *fs, const char *fileName);
+// Copy a file or subtree; with reflink the copy shares the original's blocks instead of copying them
+void cp(FileSystem *fs, const char *source, const char *destination, int reflink);
+// Rename or move a file or subtree by relinking its inode; no data is copied
+void mv(FileSystem *fs, const char *source, const char *destination);
+// Freeze the tree as /.snapshots/<name> by copy-on-write, see snapshot.h
+void snapshot(FileSystem *fs, const char *name);
 
 // Navigation & Info
 void ls(FileSystem *fs);
@@ -22,8 +31,21 @@ void cd(FileSystem *fs, const char *path);
 void status(FileSystem *fs);
 void printCurrentPath(Inode *current);
 
+// Maintenance
+// Move at most max_blocks blocks towards a compact layout; returns 1 while work remains
+int defragment(FileSystem *fs, size_t max_blocks, size_t *moved);
+void defrag(FileSystem *fs);
+// Verify every block in the image against its checksum in parallel and report the damaged files
+void scrub(FileSystem *fs);
+// Free at most max_inodes inodes of directories removed by rmdir; returns 1 while work remains
+int reclaimStep(FileSystem *fs, size_t max_inodes);
+
 // Persistence (I/O)
 void saveFileSystem(FileSystem *fs, const char *password);
 void loadFileSystem(FileSystem **fs, const char *inputPassword);
+// Write what changed since the last save or load into that image; -1 if there is none yet
+int syncFileSystem(FileSystem *fs);
+// Make the operations since the last commit durable with one fsync of the journal
+int journalCommit(FileSystem *fs);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,41 @@
+#ifndef FREE_EXTENT_H
+#define FREE_EXTENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Index of the free runs in the data region, kept beside block_bitmap.
+// Each run sits in two AVL trees: by start block (neighbour merging) and
+// by (length, start) (best-fit lookup). All updates are O(log n).
+typedef struct FreeExtentIndex FreeExtentIndex;
+
+#define FREE_HISTOGRAM_BUCKETS 32
+
+FreeExtentIndex *freeIndexCreate(void);
+void freeIndexDestroy(FreeExtentIndex *index);
+
+// Rebuild from a block bitmap (1 = used).
+int freeIndexBuild(FreeExtentIndex *index, const uint64_t *bitmap, size_t bits);
+
+// Return [start, start + length) to the pool, merging with adjacent runs.
+int freeIndexInsert(FreeExtentIndex *index, size_t start, size_t length);
+
+// Remove [start, start + length), which must lie inside one free run.
+int freeIndexTakeRange(FreeExtentIndex *index, size_t start, size_t length);
+
+// Smallest run holding `count` blocks; the first `count` blocks are taken.
+int freeIndexTakeBestFit(FreeExtentIndex *index, size_t count, size_t *start);
+
+// Smallest run holding `count` blocks, without taking it.
+int freeIndexBestFit(const FreeExtentIndex *index, size_t count, size_t *start, size_t *length);
+
+// Largest run, or 0 if the pool is empty.
+int freeIndexLargest(const FreeExtentIndex *index, size_t *start, size_t *length);
+
+size_t freeIndexRunCount(const FreeExtentIndex *index);
+size_t freeIndexFreeBlocks(const FreeExtentIndex *index);
+
+// buckets[i] counts runs of length [2^i, 2^(i+1))
+void freeIndexHistogram(const FreeExtentIndex *index, size_t buckets[FREE_HISTOGRAM_BUCKETS]);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef FS_ARENA_H
+#define FS_ARENA_H
+
+#include <stddef.h>
+
+// Fixed-size object slab: objects are carved out of large chunks and
+// recycled through a free list. slabDestroy releases every chunk at once.
+typedef struct Slab Slab;
+
+Slab *slabCreate(size_t object_size, size_t objects_per_chunk);
+void *slabAlloc(Slab *slab); // zero-filled
+void slabFree(Slab *slab, void *object);
+void slabDestroy(Slab *slab);
+size_t slabReservedBytes(const Slab *slab);
+
+// String arena: names are bump-allocated from large chunks and freed names
+// are reused through per-size-class free lists. Strings too long for the
+// largest class fall back to malloc.
+typedef struct NamePool NamePool;
+
+NamePool *namePoolCreate(void);
+char *namePoolDup(NamePool *pool, const char *name);
+void namePoolRelease(NamePool *pool, char *name);
+void namePoolDestroy(NamePool *pool);
+size_t namePoolReservedBytes(const NamePool *pool);
+
+#endif
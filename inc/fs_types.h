@@ -3,9 +3,13 @@
 
 // for size_t
 #include <stddef.h>
+#include <stdint.h>
 
 #define BLOCK_SIZE 1024
 #define INODE_PER_PARTITION 1000
+#define DEFRAG_BLOCKS_PER_CALL 4096
+#define RECLAIM_INODES_PER_CALL 4096
+#define NANOSECONDS_PER_SECOND 1000000000LL
 
 #define MAX_COMMAND_LENGTH 256
 #define MAX_PATH_LENGTH 256
@@ -17,16 +21,38 @@
 #define COLOR_WHITE "\033[0;37m"
 #define COLUMN_WIDTH 10
 
+// A run of consecutive data blocks owned by one file
+typedef struct Extent
+{
+    size_t start;
+    size_t length;
+} Extent;
+
+typedef struct DirIndex DirIndex;
+typedef struct DentryCache DentryCache;
+typedef struct Journal Journal;
+typedef struct ImageCrypt ImageCrypt;
+
 typedef struct Inode
 {
+    size_t ino;          // slot in FileSystem::inodes
     char *name;
+    uint32_t name_hash;  // nameHash(name), see directory.h
     int is_directory;
     size_t file_size;
-    int start_block;
-    size_t block_count;
+    int64_t mtime_ns;    // nanoseconds since the epoch when the contents were written
+    Extent *extents;     // file data in logical order
+    size_t extent_count;
+    size_t block_count;  // total blocks over all extents
     struct Inode *parent;
     struct Inode **directory_items;
     size_t directory_item_count;
+    size_t directory_item_capacity; // grows geometrically, see directory.h
+    size_t dir_slot;     // position in parent->directory_items
+    DirIndex *index;     // name lookup table for large directories, or NULL
+    struct Inode *share_source; // a snapshot directory not copied yet reads the items of this one, see snapshot.h
+    struct Inode *sharers;      // directories whose share_source is this one
+    struct Inode *next_sharer;  // in share_source->sharers
 } Inode;
 
 typedef struct FileSystem
@@ -35,12 +61,30 @@ typedef struct FileSystem
     size_t block_count;
     size_t block_used;
     char *data_blocks;
-    int *block_bitmap;
+    int data_mapped;        // data_blocks maps the image file, see image_format.h
+    uint64_t *block_bitmap; // 1 bit per block, see block_bitmap.h
+    uint32_t *block_crc;    // CRC32C per block as stored in the image, see checksum.h
+    struct FreeExtentIndex *free_extents; // free runs by address and size, see free_extent.h
     size_t inode_count;
     size_t inode_used;
-    Inode **inodes;
+    Inode **inodes;       // indexed by Inode::ino
+    size_t *free_inodes;  // stack of unused inode numbers
+    size_t free_inode_count;
+    struct Slab *inode_slab;  // storage for Inode records, see fs_arena.h
+    struct NamePool *names;   // storage for Inode names
     Inode *root;
     Inode *current_directory;
+    DentryCache *dcache;  // resolved path prefixes, see path.h
+    uint64_t *dirty_blocks;       // changes since the image was written, see dirty.h
+    uint64_t *dirty_bitmap_words;
+    int tree_dirty;
+    int image_attached;   // the image holds this file system and can be patched in place
+    ImageCrypt *crypt;    // keys of the image, NULL until it is saved, see image_crypt.h
+    Journal *journal;     // metadata log since the image was written, see journal.h
+    struct DedupTable *dedup; // shared blocks and content fingerprints, see dedup.h
+    Inode **reclaim_stack;    // removed subtrees not yet freed, see reclaim.h
+    size_t reclaim_depth;
+    size_t reclaim_capacity;
 } FileSystem;
 
 #endif
\ No newline at end of file
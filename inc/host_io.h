@@ -0,0 +1,31 @@
+#ifndef HOST_IO_H
+#define HOST_IO_H
+
+#include <sys/types.h>
+#include "fs_types.h"
+
+// Transfers between data_blocks and host files.
+
+// malloc'd "dir/name".
+char *hostPathJoin(const char *dir, const char *name);
+
+// Create a host directory; an existing directory counts as success.
+int hostMakeDir(const char *path);
+
+// Read up to `bytes` into `dst` with read() calls of at most 1 GiB,
+// stopping early only at end of input. Returns the byte count or -1.
+ssize_t readFull(int fd, char *dst, size_t bytes);
+
+// Fill the blocks already allocated to `file` with its file_size bytes from
+// `fd`, zeroing the slack of the last block. Touches no shared allocator
+// state, so workers may fill different files at once. Returns -1 on a read
+// error or if the input ends early.
+int readFileData(FileSystem *fs, const Inode *file, int fd);
+
+// Write the first file_size bytes of `file` to `fd` with one writev() per
+// IOV_MAX extents, retrying short writes. Binary safe. Returns 0, -1 on a
+// write error, or -2 without writing anything if a block of the file
+// fails its checksum (see checksum.h).
+int writeFileData(const FileSystem *fs, const Inode *file, int fd);
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef IMAGE_CRYPT_H
+#define IMAGE_CRYPT_H
+
+#include <stdint.h>
+#include "crypto.h"
+#include "fs_types.h"
+#include "image_format.h"
+
+// Keys of the image and the seals of its encrypted blocks.
+//
+// The password is stretched with PBKDF2-SHA256 over a random salt; the
+// result only ever serves to derive a data key, a key for the header MAC
+// and the key_check that tells a wrong password apart. Each data block is
+// encrypted with ChaCha20-Poly1305 on its own, so any block can be
+// decrypted (and checked) without its neighbours, and the parallel save
+// and load paths split the data region freely. The nonce of a block is
+// its number and the write id it was last written with; its BlockSeal
+// (write id and tag) sits in the seal region of the image and is written
+// in place next to the block, so every block on disk carries what opens
+// it. Metadata sections and journal groups use the numbers above
+// CRYPT_MAX_BLOCKS instead.
+//
+// A write id is the session in the high half and a counter in the low
+// one. Loading raises the session and writes it to the header before
+// anything else is written, so no nonce repeats under one key.
+//
+// Images are encrypted unless built with -DFS_PLAIN_IMAGE. Plain images
+// keep the password check and header MAC but store the data in the clear,
+// so loading can map it instead of reading and decrypting it. Saving
+// seals a plain image unless the build is plain too; an encrypted image
+// stays encrypted either way.
+#ifdef FS_PLAIN_IMAGE
+#define IMAGE_ENCRYPT 0
+#else
+#define IMAGE_ENCRYPT 1
+#endif
+
+#ifndef FS_KDF_ITERATIONS
+#define FS_KDF_ITERATIONS 100000
+#endif
+#define CRYPT_MAX_BLOCKS 0xFFFFFFF0u
+#define CRYPT_META_INDEX(section) (CRYPT_MAX_BLOCKS + (uint32_t)(section))
+#define CRYPT_JOURNAL_INDEX 0xFFFFFFFFu
+
+typedef struct BlockSeal
+{
+    uint64_t write_id;
+    uint8_t tag[AEAD_TAG_SIZE];
+} BlockSeal;
+
+struct ImageCrypt
+{
+    int encrypted;      // IMAGE_FLAG_ENCRYPTED
+    uint32_t iterations;
+    uint8_t salt[IMAGE_SALT_SIZE];
+    uint8_t key_check[IMAGE_CHECK_SIZE];
+    uint8_t data_key[AEAD_KEY_SIZE];
+    uint8_t auth_key[SHA256_SIZE];
+    uint64_t session;
+    uint32_t writes;    // write ids handed out this session
+    BlockSeal *seals;   // one per block if encrypted, else NULL
+};
+
+// Fresh keys for `password` under a new salt, for an image that is
+// `encrypted` or not; NULL if out of memory or the partition has too
+// many blocks to number.
+ImageCrypt *cryptCreate(const char *password, size_t block_count, int encrypted);
+
+// The keys of an existing image; NULL if `password` is wrong.
+ImageCrypt *cryptUnlock(const ImageHeader *header, const char *password);
+
+void cryptDestroy(ImageCrypt *crypt);
+
+// 1 if `password` derives the keys of `crypt`.
+int cryptMatches(const ImageCrypt *crypt, const char *password);
+
+// A write id not used before under these keys.
+uint64_t cryptNextWrite(ImageCrypt *crypt);
+
+// Fill in the key fields, then header_mac; everything else must be set.
+void cryptSignHeader(const ImageCrypt *crypt, ImageHeader *header);
+// 0 if header_mac matches.
+int cryptCheckHeader(const ImageCrypt *crypt, const ImageHeader *header);
+
+// Encrypt or decrypt `length` bytes in place as item `index` (a block
+// number, CRYPT_META_INDEX() or CRYPT_JOURNAL_INDEX) written with
+// `write_id`. cryptOpen() returns -1, leaving `data` alone, if the tag
+// does not match.
+void cryptSeal(const ImageCrypt *crypt, uint32_t index, uint64_t write_id, void *data, size_t length, uint8_t tag[AEAD_TAG_SIZE]);
+int cryptOpen(const ImageCrypt *crypt, uint32_t index, uint64_t write_id, void *data, size_t length, const uint8_t tag[AEAD_TAG_SIZE]);
+
+// Copy blocks [start, start + count) of data_blocks into `out` encrypted
+// with `write_id`, recording their seals. Thread safe for disjoint ranges.
+void cryptSealBlocks(FileSystem *fs, size_t start, size_t count, uint64_t write_id, char *out);
+// Decrypt blocks [start, start + count) of data_blocks in place; returns
+// how many failed their seal (and were left as they were).
+size_t cryptOpenBlocks(FileSystem *fs, size_t start, size_t count);
+
+#endif
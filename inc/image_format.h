@@ -0,0 +1,121 @@
+#ifndef IMAGE_FORMAT_H
+#define IMAGE_FORMAT_H
+
+#include <stdint.h>
+#include "fs_types.h"
+
+// Layout of data/filesystem.dump:
+//
+//   0                   ImageHeader
+//   IMAGE_DATA_OFFSET   data region, block_count * BLOCK_SIZE bytes
+//   seal_offset         BlockSeal per block (image_crypt.h), encrypted
+//                       images only
+//   meta_offset         block bitmap words, block checksums (uint32_t
+//                       CRC32C per block), then the inode table
+//
+// The data region starts on a boundary that is a multiple of every common
+// page size, so an unencrypted one can be mmap()ed as data_blocks
+// directly; loading only parses the metadata behind it, and saving
+// flushes the mapped pages and rewrites the metadata. A rewrite never
+// overwrites the copy the header points at: it alternates between the
+// first aligned offset behind the data (and seals) and the one behind
+// the current copy. `generation` counts checkpoints and ties the journal
+// (journal.h) to the one it continues. The header carries a CRC32C of
+// itself and of each metadata section, so a damaged image is refused
+// instead of trusted.
+//
+// No password is stored: it is stretched with the salt into the keys of
+// image_crypt.h, and key_check tells whether the result is right. Once
+// it is, header_mac authenticates the header. With IMAGE_FLAG_ENCRYPTED,
+// every data block and each metadata section is encrypted and
+// authenticated on its own.
+
+#define IMAGE_PATH "data/filesystem.dump"
+#define IMAGE_MAGIC "FSIMAGE"
+#define IMAGE_VERSION 5
+#define IMAGE_DATA_OFFSET 65536
+#define IMAGE_META_ALIGN 4096
+#define IMAGE_META_SECTIONS 3 // bitmap, block checksums, inode table
+#define IMAGE_SALT_SIZE 16
+#define IMAGE_CHECK_SIZE 16
+#define IMAGE_FLAG_ENCRYPTED 1
+
+typedef struct ImageHeader
+{
+    char magic[8];
+    uint64_t version;
+    uint64_t partition_size;
+    uint64_t block_count;
+    uint64_t block_used;
+    uint64_t inode_count;
+    uint64_t inode_used;
+    uint64_t data_offset;
+    uint64_t meta_offset;
+    uint64_t meta_length;
+    uint64_t generation;
+    uint64_t seal_offset;   // 0 without IMAGE_FLAG_ENCRYPTED
+    uint64_t meta_write_id; // nonce of the metadata sections
+    uint64_t session;       // raised by every load, see image_crypt.h
+    uint32_t flags;         // IMAGE_FLAG_*
+    uint32_t kdf_iterations;
+    uint8_t salt[IMAGE_SALT_SIZE];
+    uint8_t key_check[IMAGE_CHECK_SIZE];
+    uint32_t meta_crc[IMAGE_META_SECTIONS]; // CRC32C of the bitmap, the block checksums and the inode table
+    uint8_t meta_tag[IMAGE_META_SECTIONS][16];
+    uint8_t header_mac[16]; // HMAC-SHA256 of the header up to this field
+    uint32_t header_crc;    // CRC32C of the header up to this field
+} ImageHeader;
+
+// The inode table stores the tree flat:
+//
+//   InodeTableHeader
+//   InodeRecord[record_count]            root first, parents before children
+//   uint64_t[extent_count][2]            (start, length), by record
+//   names                                each NUL-terminated
+//
+// Loading is one read of the whole table and a single pass that links
+// each record to the already created inode of its parent record; a
+// second pass links shared directories (see snapshot.h) to their sources.
+
+#define INODE_TABLE_MAGIC "FSINODE"
+#define INODE_TABLE_VERSION 3
+#define INODE_RECORD_DIRECTORY 1
+#define INODE_RECORD_SHARED 2
+#define INODE_RECORD_NO_PARENT UINT64_MAX
+
+typedef struct InodeTableHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size; // sizeof(InodeRecord) of the writer; larger records are read by prefix
+    uint64_t record_count;
+    uint64_t extent_count;
+    uint64_t name_bytes;
+} InodeTableHeader;
+
+typedef struct InodeRecord
+{
+    uint64_t ino;
+    uint64_t parent;       // record index, INODE_RECORD_NO_PARENT for the root
+    uint64_t file_size;
+    int64_t mtime_ns;
+    uint64_t extent_first; // index into the extent table
+    uint64_t extent_count;
+    uint64_t item_count;   // records whose parent is this one
+    uint64_t name_offset;  // into the names
+    uint32_t name_length;  // without the terminator
+    uint32_t flags;        // INODE_RECORD_*
+    uint64_t share_source; // ino of the directory read by an INODE_RECORD_SHARED one
+} InodeRecord;
+
+// Release data_blocks, whether it is a mapping of the image or heap memory.
+void imageReleaseData(FileSystem *fs);
+
+// Write the dirty data blocks into the image and wait for them; returns
+// the number written or -1.
+long imageFlushData(FileSystem *fs);
+
+// Write a checkpoint of the attached image and restart the journal.
+int imageCheckpoint(FileSystem *fs);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef INODE_TABLE_H
+#define INODE_TABLE_H
+
+#include "fs_types.h"
+
+// fs->inodes[ino] holds the inode numbered `ino` (Inode::ino); unused
+// numbers are kept on a stack so allocating and freeing are O(1).
+int inodeTableInit(FileSystem *fs, size_t inode_count);
+
+// Release every inode, the slab and name arena, and the table itself.
+void inodeTableDestroy(FileSystem *fs);
+
+// Raw storage for loaders that assign numbers themselves.
+Inode *inodeRecordAlloc(FileSystem *fs);
+char *inodeNameDup(FileSystem *fs, const char *name);
+
+// Refill the free stack from the empty slots of fs->inodes, e.g. after a load.
+void inodeTableRebuildFreeList(FileSystem *fs);
+
+// Allocate a number and an empty inode for `name`. Returns NULL when the
+// table is full or memory runs out.
+Inode *newInode(FileSystem *fs, const char *name, int is_directory, Inode *parent);
+
+// Give the number back and free the inode with its name, extents and item array.
+void releaseInode(FileSystem *fs, Inode *inode);
+
+// Relink `inode` as `name` in `parent`; its blocks and subtree stay where
+// they are. The caller checks that the name is free and that `parent` is
+// not inside `inode`. Returns -1, leaving it in place, if out of memory.
+int moveInode(FileSystem *fs, Inode *inode, Inode *parent, const char *name);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include "fs_types.h"
+
+// Write-ahead log of metadata operations, next to the image:
+//
+//   JournalHeader, then groups of records each closed by a commit record
+//
+// Operations append records to an in-memory group; journalCommit() (see
+// file_system.h) makes the group durable with one fsync, after flushing
+// the data blocks it refers to into the image. Records name inodes by
+// number, and block bitmap changes follow from the extents they carry.
+// Loading replays the committed groups of the log whose generation
+// matches the image; a torn last group is ignored. The image itself is
+// only rewritten at a checkpoint: on sync, exit, or once the log grows
+// past JOURNAL_CHECKPOINT_BYTES.
+//
+// With an encrypted image each group is sealed as a whole (see
+// image_crypt.h), and its commit record carries what opens it.
+//
+// Blocks freed by the open group are still in use as far as the disk is
+// concerned, so allocating one of them commits the group first.
+
+#define JOURNAL_PATH "data/filesystem.journal"
+#define JOURNAL_MAGIC "FSJOURN"
+#ifndef JOURNAL_CHECKPOINT_BYTES
+#define JOURNAL_CHECKPOINT_BYTES (4 << 20)
+#endif
+
+typedef struct JournalHeader
+{
+    char magic[8];
+    uint64_t generation; // ImageHeader::generation of the checkpoint this log continues
+} JournalHeader;
+
+// Start an empty log for the checkpoint `generation`, replacing any old one.
+int journalOpen(FileSystem *fs, uint64_t generation);
+void journalClose(FileSystem *fs);
+
+// Apply the committed groups of a log that continues checkpoint
+// `generation`. Returns the number of groups applied.
+size_t journalReplay(FileSystem *fs, uint64_t generation);
+
+// `inode` was linked into its parent.
+void journalLogCreate(FileSystem *fs, const Inode *inode);
+// `file` got new contents or its blocks moved.
+void journalLogData(FileSystem *fs, const Inode *file);
+// `inode` was relinked under its current parent and name.
+void journalLogMove(FileSystem *fs, const Inode *inode);
+// `inode` (and everything below it) is about to be unlinked.
+void journalLogRemove(FileSystem *fs, const Inode *inode);
+// `dir` was linked to its share_source, or unlinked (see snapshot.h).
+void journalLogShare(FileSystem *fs, const Inode *dir);
+
+// Blocks [start, start + count) were freed.
+void journalNoteFree(FileSystem *fs, size_t start, size_t count);
+// `extents` are about to be written; commit first if the open group freed any of them.
+void journalBeforeReuse(FileSystem *fs, const Extent *extents, size_t extent_count);
+
+// Bytes committed since the last checkpoint, and commits (fsyncs) so far.
+void journalStats(const FileSystem *fs, uint64_t *bytes, uint64_t *commits);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include "fs_types.h"
+
+// Paths are absolute ("/a/b") or relative to the current directory
+// ("a/b", "../x/y"); "." and ".." are understood in every position.
+//
+// Directory prefixes resolved on the way are remembered in a dentry cache
+// keyed by (base directory, prefix text). Only existing directories are
+// cached, so creating entries never makes the cache stale; removing or
+// moving a directory must call dcacheInvalidate().
+
+// Inode named by `path`, or NULL if any component is missing.
+Inode *resolvePath(FileSystem *fs, const char *path);
+
+// Directory that would hold the last component of `path`, which is copied
+// to `leaf`. Returns NULL if the parent does not exist or the last
+// component is empty, "." or "..".
+Inode *resolveParent(FileSystem *fs, const char *path, char leaf[MAX_NAME_LENGTH]);
+
+// Directory that receives an entry copied or moved to `path`: `path`
+// itself if it is a directory (the entry keeps `name`, copied to `leaf`),
+// otherwise as for resolveParent().
+Inode *resolveDestination(FileSystem *fs, const char *path, const char *name, char leaf[MAX_NAME_LENGTH]);
+
+// snapshot keeps the tree in /SNAPSHOT_DIR/<name> (see clone.c)
+#define SNAPSHOT_DIR ".snapshots"
+
+// 1 if the entry `name` of `dir` (or `dir` itself if `name` is NULL) is
+// /SNAPSHOT_DIR or lies inside it. Snapshots are read-only and only the
+// snapshot command adds them, so commands must not create, remove or
+// rename such entries; rmdir alone may remove a whole snapshot.
+int inSnapshots(const FileSystem *fs, const Inode *dir, const char *name);
+
+// 1 if `ancestor` is `inode` or one of its parents.
+int isAncestor(const Inode *ancestor, const Inode *inode);
+
+// Forget every cached prefix (O(1)).
+void dcacheInvalidate(FileSystem *fs);
+void dcacheDestroy(FileSystem *fs);
+void dcacheStats(const FileSystem *fs, size_t *hits, size_t *misses);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include "fs_types.h"
+
+// rmdir unlinks a subtree and hands it to the reclaimer instead of freeing
+// it in place. reclaimStep() (see file_system.h) then releases it a bounded
+// number of inodes at a time, using an explicit stack instead of recursion
+// and freeing the blocks of each batch as merged ranges. Until then the
+// inodes and blocks stay allocated and show up as pending in `status`.
+// A directory that snapshots still share hands its items to one of them
+// instead of releasing them (see snapshotAdopt() in snapshot.h).
+
+// Queue the already unlinked subtree rooted at `dir`. O(1) amortized;
+// returns -1 if the queue cannot grow.
+int reclaimDetach(FileSystem *fs, Inode *dir);
+
+// Inodes and blocks still held by queued subtrees (walks them).
+void reclaimPending(const FileSystem *fs, size_t *inodes, size_t *blocks);
+
+// Finish all queued work, e.g. before saving or when space runs out.
+void reclaimAll(FileSystem *fs);
+
+// Free the queue itself; queued inodes go away with the inode table.
+void reclaimDestroy(FileSystem *fs);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "fs_types.h"
+
+// snapshot <name> (see file_system.h) freezes the tree by copy-on-write.
+// /SNAPSHOT_DIR/<name> gets a copy of each file in the root and, for each
+// directory, a shared directory: an inode with no items of its own whose
+// share_source is the original. Taking one therefore costs one inode per
+// root entry, however large the tree is, and no data is copied; file
+// copies share their blocks (see dedup.h).
+//
+// A directory with sharers stays as it was when they were made. Before
+// one of its items is added, removed or renamed, snapshotUnshare() copies
+// the path down to it: each sharer, from the top, gets copies of the
+// source's files and shared directories for its subdirectories of its
+// own. A first write under a path so costs inodes in proportion to the
+// entries along it, and later writes there cost nothing. Navigating into
+// a snapshot copies the directories it passes the same way, so a path in
+// a snapshot always leads to inodes of the snapshot.
+//
+// A source that is removed is not copied: the first of its sharers takes
+// its items and the rest read from that one instead (snapshotAdopt()).
+//
+// Copies and shares are journaled like any other creation.
+
+// Give every snapshot directory sharing `dir` or one of its parents its
+// own items, so `dir` may change. Returns -1, with a message, if inodes
+// or memory run out.
+int snapshotUnshare(FileSystem *fs, Inode *dir);
+
+// Give `dir`, if it is a shared directory, items of its own, e.g. before
+// looking up a name in it. Returns -1, with a message, if inodes or
+// memory run out.
+int snapshotOpen(FileSystem *fs, Inode *dir);
+
+// The directory whose items `dir` has: its source while it is shared.
+const Inode *snapshotItems(const Inode *dir);
+
+// Link the shared directory `dir` to `source`, or unlink it if `source`
+// is NULL.
+void snapshotShare(Inode *dir, Inode *source);
+
+// `dir` has been removed from the tree: hand its items to its first
+// sharer, if any, and point the others at that one. O(items); `dir` is
+// left empty.
+void snapshotAdopt(FileSystem *fs, Inode *dir);
+
+#endif
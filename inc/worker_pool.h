@@ -0,0 +1,18 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define POOL_MAX_WORKERS 16
+
+// Run job(context, i) for every i in [0, job_count) on up to one thread per
+// CPU (at most POOL_MAX_WORKERS), the calling thread included. Jobs are
+// claimed with an atomic counter; returns once all of them are done and
+// reports the number of threads used.
+size_t runParallel(size_t job_count, void (*job)(void *context, size_t i), void *context);
+
+// Wall-clock seconds since `since` (taken with clock_gettime(CLOCK_MONOTONIC)).
+double secondsSince(const struct timespec *since);
+
+#endif
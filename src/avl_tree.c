@@ -0,0 +1,145 @@
+#include "avl_tree.h"
+
+static int height(const AvlNode *node)
+{
+    return node ? node->height : 0;
+}
+
+static void updateHeight(AvlNode *node)
+{
+    int l = height(node->left);
+    int r = height(node->right);
+    node->height = (l > r ? l : r) + 1;
+}
+
+static AvlNode *rotateRight(AvlNode *node)
+{
+    AvlNode *pivot = node->left;
+    node->left = pivot->right;
+    pivot->right = node;
+    updateHeight(node);
+    updateHeight(pivot);
+    return pivot;
+}
+
+static AvlNode *rotateLeft(AvlNode *node)
+{
+    AvlNode *pivot = node->right;
+    node->right = pivot->left;
+    pivot->left = node;
+    updateHeight(node);
+    updateHeight(pivot);
+    return pivot;
+}
+
+static AvlNode *rebalance(AvlNode *node)
+{
+    updateHeight(node);
+    int balance = height(node->left) - height(node->right);
+    if (balance > 1)
+    {
+        if (height(node->left->left) < height(node->left->right))
+            node->left = rotateLeft(node->left);
+        return rotateRight(node);
+    }
+    if (balance < -1)
+    {
+        if (height(node->right->right) < height(node->right->left))
+            node->right = rotateRight(node->right);
+        return rotateLeft(node);
+    }
+    return node;
+}
+
+AvlNode *avlInsert(AvlNode *root, AvlNode *node, AvlCompare compare)
+{
+    if (!root)
+    {
+        node->left = node->right = NULL;
+        node->height = 1;
+        return node;
+    }
+    if (compare(node, root) < 0)
+        root->left = avlInsert(root->left, node, compare);
+    else
+        root->right = avlInsert(root->right, node, compare);
+    return rebalance(root);
+}
+
+static AvlNode *removeMin(AvlNode *root, AvlNode **min)
+{
+    if (!root->left)
+    {
+        *min = root;
+        return root->right;
+    }
+    root->left = removeMin(root->left, min);
+    return rebalance(root);
+}
+
+AvlNode *avlRemove(AvlNode *root, AvlNode *node, AvlCompare compare)
+{
+    if (!root)
+        return NULL;
+    int cmp = compare(node, root);
+    if (cmp < 0)
+        root->left = avlRemove(root->left, node, compare);
+    else if (cmp > 0)
+        root->right = avlRemove(root->right, node, compare);
+    else
+    {
+        AvlNode *l = root->left;
+        AvlNode *r = root->right;
+        if (!l)
+            return r;
+        if (!r)
+            return l;
+        AvlNode *successor = NULL;
+        r = removeMin(r, &successor);
+        successor->left = l;
+        successor->right = r;
+        return rebalance(successor);
+    }
+    return rebalance(root);
+}
+
+#define START_NODE(ptr) AVL_ENTRY(ptr, AvlStartNode, node)
+
+int avlCompareStart(const AvlNode *a, const AvlNode *b)
+{
+    size_t x = START_NODE(a)->start;
+    size_t y = START_NODE(b)->start;
+    return x < y ? -1 : (x > y);
+}
+
+AvlStartNode *avlStartFloor(const AvlNode *root, size_t start)
+{
+    AvlStartNode *best = NULL;
+    while (root)
+    {
+        if (START_NODE(root)->start <= start)
+        {
+            best = START_NODE(root);
+            root = root->right;
+        }
+        else
+            root = root->left;
+    }
+    return best;
+}
+
+AvlStartNode *avlStartCeil(const AvlNode *root, size_t start)
+{
+    AvlStartNode *best = NULL;
+    while (root)
+    {
+        if (START_NODE(root)->start >= start)
+        {
+            best = START_NODE(root);
+            root = root->left;
+        }
+        else
+            root = root->right;
+    }
+    return best;
+}
@@ -0,0 +1,241 @@
+#include <stdlib.h>
+#include "block_alloc.h"
+#include "block_bitmap.h"
+#include "free_extent.h"
+#include "reclaim.h"
+#include "dirty.h"
+#include "journal.h"
+#include "dedup.h"
+
+// Build with -DFS_BITMAP_ALLOCATOR to choose runs by scanning block_bitmap
+// instead of asking the free-extent index. Both keep the index in sync.
+
+static int compareStart(const void *a, const void *b)
+{
+    const Extent *x = (const Extent *)a;
+    const Extent *y = (const Extent *)b;
+    return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+static int pushRun(Extent **runs, size_t *run_count, size_t *run_capacity, size_t start, size_t length)
+{
+    if (*run_count == *run_capacity)
+    {
+        size_t capacity = *run_capacity ? *run_capacity * 2 : 8;
+        Extent *grown = (Extent *)realloc(*runs, capacity * sizeof(Extent));
+        if (!grown)
+            return -1;
+        *runs = grown;
+        *run_capacity = capacity;
+    }
+    (*runs)[*run_count].start = start;
+    (*runs)[*run_count].length = length;
+    (*run_count)++;
+    return 0;
+}
+
+#ifdef FS_BITMAP_ALLOCATOR
+static int compareLengthDesc(const void *a, const void *b)
+{
+    const Extent *x = (const Extent *)a;
+    const Extent *y = (const Extent *)b;
+    if (x->length != y->length)
+        return x->length < y->length ? 1 : -1;
+    return compareStart(a, b);
+}
+
+// choose runs with bitmap scans, then carve them out of the index
+static int pickRuns(FileSystem *fs, size_t count, Extent **extents, size_t *extent_count)
+{
+    Extent *runs = NULL;
+    size_t run_count = 0;
+    size_t run_capacity = 0;
+    size_t start = 0;
+
+    if (bitmapFindFreeRun(fs->block_bitmap, fs->block_count, count, &start))
+    {
+        if (pushRun(&runs, &run_count, &run_capacity, start, count) != 0)
+            return -1;
+    }
+    else
+    {
+        size_t pos = 0;
+        size_t run_length;
+        while (bitmapNextFreeRun(fs->block_bitmap, fs->block_count, pos, &start, &run_length))
+        {
+            if (pushRun(&runs, &run_count, &run_capacity, start, run_length) != 0)
+            {
+                free(runs);
+                return -1;
+            }
+            pos = start + run_length;
+        }
+
+        qsort(runs, run_count, sizeof(Extent), compareLengthDesc);
+        size_t used = 0;
+        size_t remaining = count;
+        while (runs[used].length < remaining)
+        {
+            remaining -= runs[used].length;
+            used++;
+        }
+        // the tail goes into the smallest run that still holds it
+        size_t best = used;
+        while (best + 1 < run_count && runs[best + 1].length >= remaining)
+            best++;
+        runs[used].start = runs[best].start;
+        runs[used].length = remaining;
+        run_count = used + 1;
+    }
+
+    for (size_t i = 0; i < run_count; i++)
+        freeIndexTakeRange(fs->free_extents, runs[i].start, runs[i].length);
+    *extents = runs;
+    *extent_count = run_count;
+    return 0;
+}
+#else
+// best fit for the whole request; otherwise largest runs first and the
+// tail in the smallest run that still holds it
+static int pickRuns(FileSystem *fs, size_t count, Extent **extents, size_t *extent_count)
+{
+    Extent *runs = NULL;
+    size_t run_count = 0;
+    size_t run_capacity = 0;
+    size_t remaining = count;
+
+    while (remaining > 0)
+    {
+        size_t start, length;
+        if (freeIndexTakeBestFit(fs->free_extents, remaining, &start))
+            length = remaining;
+        else
+        {
+            freeIndexLargest(fs->free_extents, &start, &length);
+            freeIndexTakeRange(fs->free_extents, start, length);
+        }
+
+        if (pushRun(&runs, &run_count, &run_capacity, start, length) != 0)
+        {
+            freeIndexInsert(fs->free_extents, start, length);
+            for (size_t i = 0; i < run_count; i++)
+                freeIndexInsert(fs->free_extents, runs[i].start, runs[i].length);
+            free(runs);
+            return -1;
+        }
+        remaining -= length;
+    }
+
+    *extents = runs;
+    *extent_count = run_count;
+    return 0;
+}
+#endif
+
+int allocateBlocks(FileSystem *fs, size_t count, Extent **extents, size_t *extent_count)
+{
+    *extents = NULL;
+    *extent_count = 0;
+    if (count == 0)
+        return 0;
+    if (freeIndexFreeBlocks(fs->free_extents) < count && fs->reclaim_depth > 0)
+        reclaimAll(fs);
+    if (freeIndexFreeBlocks(fs->free_extents) < count)
+        return -1;
+
+    Extent *runs = NULL;
+    size_t run_count = 0;
+    if (pickRuns(fs, count, &runs, &run_count) != 0)
+        return -1;
+
+    // keep the pieces in disk order so reads move forward
+    qsort(runs, run_count, sizeof(Extent), compareStart);
+    Extent *shrunk = (Extent *)realloc(runs, run_count * sizeof(Extent));
+    if (shrunk)
+        runs = shrunk;
+
+    // the caller writes these blocks next
+    journalBeforeReuse(fs, runs, run_count);
+    for (size_t i = 0; i < run_count; i++)
+    {
+        bitmapSetRange(fs->block_bitmap, runs[i].start, runs[i].length);
+        dirtyMarkBitmap(fs, runs[i].start, runs[i].length);
+        fs->block_used += runs[i].length;
+    }
+    *extents = runs;
+    *extent_count = run_count;
+    return 0;
+}
+
+int claimExtents(FileSystem *fs, const Extent *extents, size_t extent_count)
+{
+    for (size_t i = 0; i < extent_count; i++)
+    {
+        size_t end = extents[i].start + extents[i].length;
+        if (extents[i].length == 0 || end > fs->block_count || end < extents[i].start)
+            return -1;
+    }
+    for (size_t i = 0; i < extent_count; i++)
+    {
+        // free runs are taken, runs in use gain a reference
+        size_t start = extents[i].start;
+        size_t end = start + extents[i].length;
+        size_t b = start;
+        while (b < end)
+        {
+            size_t used = bitmapNextSet(fs->block_bitmap, end, b);
+            if (used > b)
+            {
+                freeIndexTakeRange(fs->free_extents, b, used - b);
+                bitmapSetRange(fs->block_bitmap, b, used - b);
+                dirtyMarkBitmap(fs, b, used - b);
+                fs->block_used += used - b;
+                b = used;
+                continue;
+            }
+            size_t stop = bitmapNextClear(fs->block_bitmap, end, b);
+            if (dedupAddReferences(fs, b, stop - b) != 0)
+            {
+                // undo this claim
+                Extent claimed = {start, b - start};
+                freeExtents(fs, extents, i);
+                if (claimed.length > 0)
+                    freeExtents(fs, &claimed, 1);
+                return -1;
+            }
+            b = stop;
+        }
+    }
+    return 0;
+}
+
+static void freeRun(FileSystem *fs, size_t start, size_t length)
+{
+    dedupForget(fs, start, length);
+    bitmapClearRange(fs->block_bitmap, start, length);
+    dirtyMarkBitmap(fs, start, length);
+    freeIndexInsert(fs->free_extents, start, length);
+    journalNoteFree(fs, start, length);
+    fs->block_used -= length;
+}
+
+void freeExtents(FileSystem *fs, const Extent *extents, size_t extent_count)
+{
+    for (size_t i = 0; i < extent_count; i++)
+    {
+        // shared runs only lose this reference
+        size_t end = extents[i].start + extents[i].length;
+        size_t b = extents[i].start;
+        while (b < end)
+        {
+            size_t single = dedupUnsharedRun(fs, b, end);
+            if (single > 0)
+            {
+                freeRun(fs, b, single);
+                b += single;
+            }
+            else
+                b += dedupDropShared(fs, b, end);
+        }
+    }
+}
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include "block_bitmap.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BITMAP_HAVE_AVX2 1
+#endif
+
+#define WORD_ALL_USED (~(uint64_t)0)
+
+size_t bitmapWordCount(size_t bits)
+{
+    return (bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+uint64_t *bitmapCreate(size_t bits)
+{
+    return (uint64_t *)calloc(bitmapWordCount(bits), sizeof(uint64_t));
+}
+
+int bitmapTest(const uint64_t *map, size_t bit)
+{
+    return (map[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+// mask covering bits [lo, lo + n) of one word, 1 <= n, lo + n <= 64
+static uint64_t rangeMask(size_t lo, size_t n)
+{
+    uint64_t bits = (n == BITMAP_WORD_BITS) ? WORD_ALL_USED : (((uint64_t)1 << n) - 1);
+    return bits << lo;
+}
+
+void bitmapSetRange(uint64_t *map, size_t start, size_t count)
+{
+    while (count > 0)
+    {
+        size_t lo = start % BITMAP_WORD_BITS;
+        size_t n = BITMAP_WORD_BITS - lo;
+        if (n > count)
+            n = count;
+        map[start / BITMAP_WORD_BITS] |= rangeMask(lo, n);
+        start += n;
+        count -= n;
+    }
+}
+
+void bitmapClearRange(uint64_t *map, size_t start, size_t count)
+{
+    while (count > 0)
+    {
+        size_t lo = start % BITMAP_WORD_BITS;
+        size_t n = BITMAP_WORD_BITS - lo;
+        if (n > count)
+            n = count;
+        map[start / BITMAP_WORD_BITS] &= ~rangeMask(lo, n);
+        start += n;
+        count -= n;
+    }
+}
+
+size_t bitmapCountSet(const uint64_t *map, size_t bits)
+{
+    size_t words = bitmapWordCount(bits);
+    size_t total = 0;
+    for (size_t w = 0; w < words; w++)
+        total += (size_t)__builtin_popcountll(map[w]);
+    return total;
+}
+
+static size_t skipFullWordsScalar(const uint64_t *map, size_t w, size_t words)
+{
+    while (w < words && map[w] == WORD_ALL_USED)
+        w++;
+    return w;
+}
+
+#ifdef BITMAP_HAVE_AVX2
+// checks 256 blocks per iteration while the partition is densely packed
+__attribute__((target("avx2"))) static size_t skipFullWordsAvx2(const uint64_t *map, size_t w, size_t words)
+{
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    while (w + 4 <= words)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(map + w));
+        if (!_mm256_testc_si256(v, ones))
+            break;
+        w += 4;
+    }
+    return skipFullWordsScalar(map, w, words);
+}
+#endif
+
+// return the index of the first word in [w, words) that has a free bit
+static size_t skipFullWords(const uint64_t *map, size_t w, size_t words)
+{
+#ifdef BITMAP_HAVE_AVX2
+    static int has_avx2 = -1;
+    if (has_avx2 < 0)
+        has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2)
+        return skipFullWordsAvx2(map, w, words);
+#endif
+    return skipFullWordsScalar(map, w, words);
+}
+
+size_t bitmapNextClear(const uint64_t *map, size_t bits, size_t from)
+{
+    size_t words = bitmapWordCount(bits);
+    size_t w = from / BITMAP_WORD_BITS;
+    if (from >= bits)
+        return bits;
+
+    // treat the bits below `from` as used
+    uint64_t used = map[w] | ((((uint64_t)1) << (from % BITMAP_WORD_BITS)) - 1);
+    if (used == WORD_ALL_USED)
+    {
+        w = skipFullWords(map, w + 1, words);
+        if (w >= words)
+            return bits;
+        used = map[w];
+    }
+    size_t pos = w * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(~used);
+    return pos < bits ? pos : bits;
+}
+
+size_t bitmapNextSet(const uint64_t *map, size_t bits, size_t from)
+{
+    size_t words = bitmapWordCount(bits);
+    size_t w = from / BITMAP_WORD_BITS;
+    if (from >= bits)
+        return bits;
+
+    uint64_t used = map[w] & ~((((uint64_t)1) << (from % BITMAP_WORD_BITS)) - 1);
+    while (used == 0)
+    {
+        if (++w >= words)
+            return bits;
+        used = map[w];
+    }
+    size_t pos = w * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(used);
+    return pos < bits ? pos : bits;
+}
+
+int bitmapNextFreeRun(const uint64_t *map, size_t bits, size_t from, size_t *start, size_t *length)
+{
+    size_t first = bitmapNextClear(map, bits, from);
+    if (first >= bits)
+        return 0;
+    *start = first;
+    *length = bitmapNextSet(map, bits, first) - first;
+    return 1;
+}
+
+int bitmapFindFreeRun(const uint64_t *map, size_t bits, size_t count, size_t *start)
+{
+    if (count == 0)
+    {
+        *start = 0;
+        return 1;
+    }
+
+#ifdef FS_LINEAR_BITMAP_SCAN
+    // reference implementation: one block per step
+    size_t consecutive = 0;
+    for (size_t i = 0; i < bits; i++)
+    {
+        if (bitmapTest(map, i))
+        {
+            consecutive = 0;
+            continue;
+        }
+        if (++consecutive == count)
+        {
+            *start = i + 1 - count;
+            return 1;
+        }
+    }
+    return 0;
+#else
+    size_t words = bitmapWordCount(bits);
+    size_t run = 0;
+    size_t run_start = 0;
+
+    for (size_t w = 0; w < words; w++)
+    {
+        uint64_t used = map[w];
+        // blocks past the end of the partition count as used
+        if (w == words - 1 && bits % BITMAP_WORD_BITS)
+            used |= WORD_ALL_USED << (bits % BITMAP_WORD_BITS);
+
+        if (used == WORD_ALL_USED)
+        {
+            run = 0;
+            w = skipFullWords(map, w + 1, words) - 1;
+            continue;
+        }
+        if (used == 0)
+        {
+            if (run == 0)
+                run_start = w * BITMAP_WORD_BITS;
+            run += BITMAP_WORD_BITS;
+            if (run >= count)
+            {
+                *start = run_start;
+                return 1;
+            }
+            continue;
+        }
+
+        // mixed word: hop between used and free stretches with ctz
+        size_t pos = 0;
+        while (pos < BITMAP_WORD_BITS)
+        {
+            uint64_t rest = used >> pos;
+            if (rest & 1)
+            {
+                // ~rest always has a set bit because the shift fills with zeros
+                pos += (size_t)__builtin_ctzll(~rest);
+                run = 0;
+            }
+            else
+            {
+                size_t n = rest ? (size_t)__builtin_ctzll(rest) : BITMAP_WORD_BITS - pos;
+                if (run == 0)
+                    run_start = w * BITMAP_WORD_BITS + pos;
+                run += n;
+                if (run >= count)
+                {
+                    *start = run_start;
+                    return 1;
+                }
+                pos += n;
+            }
+        }
+    }
+    return 0;
+#endif
+}
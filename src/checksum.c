@@ -0,0 +1,268 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "file_system.h"
+#include "block_bitmap.h"
+#include "checksum.h"
+#include "reclaim.h"
+#include "worker_pool.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CRC32C_X86
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32C_ARM
+#include <arm_acle.h>
+#endif
+
+// scrub hands out the blocks in use in jobs of at most this many blocks
+#ifndef SCRUB_CHUNK_BLOCKS
+#define SCRUB_CHUNK_BLOCKS 8192
+#endif
+
+#define CRC32C_POLY 0x82F63B78u // reflected Castagnoli polynomial
+
+static uint32_t crc_table[8][256]; // slicing-by-8
+static int crc_hardware;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crcInit(void)
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        for (int k = 1; k < 8; k++)
+            crc_table[k][n] = (crc_table[k - 1][n] >> 8) ^ crc_table[0][crc_table[k - 1][n] & 0xff];
+    }
+#if defined(CRC32C_X86)
+    crc_hardware = __builtin_cpu_supports("sse4.2");
+#elif defined(CRC32C_ARM)
+    crc_hardware = 1;
+#endif
+}
+
+static uint32_t crcTable(uint32_t crc, const unsigned char *p, size_t length)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff] ^
+              crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff] ^
+              crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff] ^
+              crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+        p += 8;
+        length -= 8;
+    }
+#endif
+    while (length--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(CRC32C_X86)
+__attribute__((target("sse4.2")))
+static uint32_t crcHardware(uint32_t crc, const unsigned char *p, size_t length)
+{
+#ifdef __x86_64__
+    uint64_t wide = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)wide;
+#endif
+    while (length--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#elif defined(CRC32C_ARM)
+static uint32_t crcHardware(uint32_t crc, const unsigned char *p, size_t length)
+{
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+        p += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&crc_once, crcInit);
+    crc = ~crc;
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+    if (crc_hardware)
+        return ~crcHardware(crc, (const unsigned char *)data, length);
+#endif
+    return ~crcTable(crc, (const unsigned char *)data, length);
+}
+
+void checksumUpdate(FileSystem *fs, size_t start, size_t count)
+{
+    if (!fs->block_crc)
+        return;
+    for (size_t b = start; b < start + count; b++)
+        fs->block_crc[b] = crc32c(0, fs->data_blocks + b * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+// 0 if block `b` is clean and its contents no longer match its checksum.
+static int blockIntact(const FileSystem *fs, size_t b)
+{
+    return bitmapTest(fs->dirty_blocks, b) ||
+           crc32c(0, fs->data_blocks + b * BLOCK_SIZE, BLOCK_SIZE) == fs->block_crc[b];
+}
+
+size_t checksumVerifyFile(const FileSystem *fs, const Inode *file)
+{
+    // without tracking every block counts as dirty
+    if (!fs->block_crc || !fs->dirty_blocks)
+        return 0;
+    size_t bad = 0;
+    for (size_t e = 0; e < file->extent_count; e++)
+    {
+        const Extent *extent = &file->extents[e];
+        for (size_t b = extent->start; b < extent->start + extent->length; b++)
+            bad += !blockIntact(fs, b);
+    }
+    return bad;
+}
+
+typedef struct ScrubChunk
+{
+    size_t start;
+    size_t count;
+} ScrubChunk;
+
+typedef struct ScrubPlan
+{
+    const FileSystem *fs;
+    ScrubChunk *chunks;
+    size_t chunk_count;
+    uint64_t *bad; // 1 bit per block, set by the workers
+    size_t bad_count;
+    size_t checked;
+} ScrubPlan;
+
+static void scrubJob(void *context, size_t i)
+{
+    ScrubPlan *plan = (ScrubPlan *)context;
+    const FileSystem *fs = plan->fs;
+    ScrubChunk chunk = plan->chunks[i];
+    size_t bad = 0, checked = 0;
+    for (size_t b = chunk.start; b < chunk.start + chunk.count; b++)
+    {
+        if (bitmapTest(fs->dirty_blocks, b))
+            continue;
+        checked++;
+        if (!blockIntact(fs, b))
+        {
+            __atomic_fetch_or(&plan->bad[b / BITMAP_WORD_BITS], 1ull << (b % BITMAP_WORD_BITS), __ATOMIC_RELAXED);
+            bad++;
+        }
+    }
+    __atomic_fetch_add(&plan->bad_count, bad, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&plan->checked, checked, __ATOMIC_RELAXED);
+}
+
+void scrub(FileSystem *fs)
+{
+    if (!fs->image_attached || !fs->dirty_blocks || !fs->block_crc)
+    {
+        printf("Nothing to scrub: the file system has not been saved yet.\n");
+        return;
+    }
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    // every registered inode is linked once removed subtrees are gone
+    reclaimAll(fs);
+
+    ScrubPlan plan = {fs, NULL, 0, bitmapCreate(fs->block_count), 0, 0};
+    size_t capacity = 0;
+    size_t start, length;
+    for (size_t pos = 0; plan.bad && pos < fs->block_count; pos = start + length)
+    {
+        start = bitmapNextSet(fs->block_bitmap, fs->block_count, pos);
+        if (start >= fs->block_count)
+            break;
+        length = bitmapNextClear(fs->block_bitmap, fs->block_count, start) - start;
+        for (size_t s = start; s < start + length; s += SCRUB_CHUNK_BLOCKS)
+        {
+            if (plan.chunk_count == capacity)
+            {
+                size_t grown_capacity = capacity ? capacity * 2 : 16;
+                ScrubChunk *grown = (ScrubChunk *)realloc(plan.chunks, grown_capacity * sizeof(ScrubChunk));
+                if (!grown)
+                {
+                    free(plan.bad);
+                    plan.bad = NULL;
+                    break;
+                }
+                plan.chunks = grown;
+                capacity = grown_capacity;
+            }
+            size_t count = start + length - s < SCRUB_CHUNK_BLOCKS ? start + length - s : SCRUB_CHUNK_BLOCKS;
+            plan.chunks[plan.chunk_count++] = (ScrubChunk){s, count};
+        }
+    }
+    if (!plan.bad)
+    {
+        free(plan.chunks);
+        printf("Not enough memory to scrub.\n");
+        return;
+    }
+
+    size_t threads = runParallel(plan.chunk_count, scrubJob, &plan);
+    free(plan.chunks);
+
+    // report per file
+    size_t bad_files = 0;
+    for (size_t ino = 0; plan.bad_count > 0 && ino < fs->inode_count; ino++)
+    {
+        const Inode *file = fs->inodes[ino];
+        if (!file || file->is_directory)
+            continue;
+        size_t bad = 0;
+        for (size_t e = 0; e < file->extent_count; e++)
+        {
+            for (size_t b = file->extents[e].start; b < file->extents[e].start + file->extents[e].length; b++)
+                bad += bitmapTest(plan.bad, b);
+        }
+        if (bad > 0)
+        {
+            printf("Corrupt: ");
+            printCurrentPath(file->parent);
+            printf("%s (%zu of %zu blocks)\n", file->name, bad, file->block_count);
+            bad_files++;
+        }
+    }
+    free(plan.bad);
+
+    double seconds = secondsSince(&started);
+    printf("Scrubbed %zu blocks in %.3f s with %zu threads: %.1f MB/s, %zu corrupt blocks in %zu files\n",
+           plan.checked, seconds, threads, plan.checked * (double)BLOCK_SIZE / seconds / (1024.0 * 1024.0),
+           plan.bad_count, bad_files);
+    if (fs->block_used > plan.checked)
+        printf("%zu blocks not yet in the image were skipped; sync first to cover them.\n", fs->block_used - plan.checked);
+}
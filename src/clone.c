@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "file_system.h"
+#include "block_alloc.h"
+#include "checksum.h"
+#include "dedup.h"
+#include "directory.h"
+#include "dirty.h"
+#include "inode_table.h"
+#include "journal.h"
+#include "path.h"
+#include "reclaim.h"
+#include "snapshot.h"
+#include "worker_pool.h"
+
+// cp copies a file or subtree inside the partition. With --reflink only
+// the inodes are copied: a clone's extents name the blocks of the
+// original, and each extent gains a reference (see dedup.h). Files are
+// only ever replaced as a whole (put, rm), never written in place, so a
+// shared block is never modified and nothing has to be copied later; a
+// block is freed once the last file naming it goes. Snapshots share
+// directories too, and copy them only as they change (see snapshot.h).
+//
+// A plain cp gives every file blocks of its own. They are allocated while
+// the tree is built and filled afterwards by copying the data area from
+// one range to another on the worker pool, in runs of at most
+// COPY_CHUNK_BLOCKS; no block goes through a buffer or the host.
+
+#define COPY_CHUNK_BLOCKS 8192
+
+enum
+{
+    CLONE_NO_MEMORY = 1,
+    CLONE_NO_SPACE,
+    CLONE_CORRUPT
+};
+
+typedef struct ClonePair
+{
+    const Inode *from;
+    Inode *to;
+} ClonePair;
+
+// Blocks [from, from + count) go to [to, to + count).
+typedef struct CopyRun
+{
+    size_t from;
+    size_t to;
+    size_t count;
+} CopyRun;
+
+typedef struct Cloner
+{
+    FileSystem *fs;
+    int share;        // reference the original blocks instead of copying them
+    CopyRun *runs;    // copies still to do
+    size_t run_count;
+    size_t run_capacity;
+    int error;        // CLONE_* once something failed
+} Cloner;
+
+// Inodes in the subtree at `root`, and their blocks if `blocks` is not NULL.
+static size_t countTree(const Inode *root, size_t *blocks)
+{
+    size_t count = 0;
+    size_t depth = 0, capacity = 16;
+    if (blocks)
+        *blocks = 0;
+    const Inode **stack = (const Inode **)malloc(capacity * sizeof(Inode *));
+    if (!stack)
+        return SIZE_MAX;
+    stack[depth++] = root;
+    while (depth > 0)
+    {
+        const Inode *inode = stack[--depth];
+        count++;
+        if (blocks)
+            *blocks += inode->block_count;
+        if (!inode->is_directory)
+            continue;
+        const Inode *items = snapshotItems(inode);
+        if (depth + items->directory_item_count > capacity)
+        {
+            while (depth + items->directory_item_count > capacity)
+                capacity *= 2;
+            const Inode **grown = (const Inode **)realloc(stack, capacity * sizeof(Inode *));
+            if (!grown)
+            {
+                free(stack);
+                return SIZE_MAX;
+            }
+            stack = grown;
+        }
+        for (size_t i = 0; i < items->directory_item_count; i++)
+            stack[depth++] = items->directory_items[i];
+    }
+    free(stack);
+    return count;
+}
+
+static int addRun(Cloner *cloner, size_t from, size_t to, size_t count)
+{
+    if (cloner->run_count == cloner->run_capacity)
+    {
+        size_t capacity = cloner->run_capacity ? cloner->run_capacity * 2 : 64;
+        CopyRun *grown = (CopyRun *)realloc(cloner->runs, capacity * sizeof(CopyRun));
+        if (!grown)
+            return -1;
+        cloner->runs = grown;
+        cloner->run_capacity = capacity;
+    }
+    cloner->runs[cloner->run_count++] = (CopyRun){from, to, count};
+    return 0;
+}
+
+// Extents for `copy` naming the blocks of `from`, each with one more reference.
+static int shareBlocks(Cloner *cloner, Inode *copy, const Inode *from)
+{
+    Extent *extents = (Extent *)malloc(from->extent_count * sizeof(Extent));
+    if (!extents)
+        return CLONE_NO_MEMORY;
+    memcpy(extents, from->extents, from->extent_count * sizeof(Extent));
+    for (size_t e = 0; e < from->extent_count; e++)
+    {
+        if (dedupAddReferences(cloner->fs, extents[e].start, extents[e].length) != 0)
+        {
+            // the original still holds these, so they only lose the references
+            freeExtents(cloner->fs, extents, e);
+            free(extents);
+            return CLONE_NO_MEMORY;
+        }
+    }
+    copy->extents = extents;
+    copy->extent_count = from->extent_count;
+    return 0;
+}
+
+// New blocks for `copy`, with the runs that fill them from `from`.
+static int copyBlocks(Cloner *cloner, Inode *copy, const Inode *from)
+{
+    FileSystem *fs = cloner->fs;
+    if (checksumVerifyFile(fs, from) > 0)
+        return CLONE_CORRUPT;
+    Extent *extents;
+    size_t extent_count;
+    if (allocateBlocks(fs, from->block_count, &extents, &extent_count) != 0)
+        return CLONE_NO_SPACE;
+
+    // walk both extent lists at once; a run ends wherever either does
+    size_t first_run = cloner->run_count;
+    size_t f = 0, t = 0, f_done = 0, t_done = 0;
+    while (f < from->extent_count && t < extent_count)
+    {
+        size_t count = from->extents[f].length - f_done;
+        if (count > extents[t].length - t_done)
+            count = extents[t].length - t_done;
+        if (count > COPY_CHUNK_BLOCKS)
+            count = COPY_CHUNK_BLOCKS;
+        if (addRun(cloner, from->extents[f].start + f_done, extents[t].start + t_done, count) != 0)
+        {
+            cloner->run_count = first_run;
+            freeExtents(fs, extents, extent_count);
+            free(extents);
+            return CLONE_NO_MEMORY;
+        }
+        f_done += count;
+        t_done += count;
+        if (f_done == from->extents[f].length)
+        {
+            f++;
+            f_done = 0;
+        }
+        if (t_done == extents[t].length)
+        {
+            t++;
+            t_done = 0;
+        }
+    }
+    copy->extents = extents;
+    copy->extent_count = extent_count;
+    return 0;
+}
+
+// A copy of `from` called `name` under `parent` (not linked yet); NULL,
+// with cloner->error set, if that failed.
+static Inode *cloneInode(Cloner *cloner, const Inode *from, const char *name, Inode *parent)
+{
+    Inode *copy = newInode(cloner->fs, name, from->is_directory, parent);
+    if (!copy)
+    {
+        cloner->error = CLONE_NO_MEMORY;
+        return NULL;
+    }
+    copy->mtime_ns = from->mtime_ns;
+    copy->file_size = from->file_size;
+    if (from->extent_count == 0)
+        return copy;
+
+    int error = cloner->share ? shareBlocks(cloner, copy, from) : copyBlocks(cloner, copy, from);
+    if (error)
+    {
+        cloner->error = error;
+        releaseInode(cloner->fs, copy);
+        return NULL;
+    }
+    copy->block_count = from->block_count;
+    return copy;
+}
+
+static void copyJob(void *context, size_t i)
+{
+    const Cloner *cloner = (const Cloner *)context;
+    const CopyRun *run = &cloner->runs[i];
+    char *data = cloner->fs->data_blocks;
+    memcpy(data + run->to * BLOCK_SIZE, data + run->from * BLOCK_SIZE, run->count * BLOCK_SIZE);
+}
+
+// Journal the new subtree, parents before their items.
+static void logTree(FileSystem *fs, Inode *root)
+{
+    Inode *inode = root;
+    size_t next = 0; // item of `inode` to visit next
+    journalLogCreate(fs, root);
+    if (!root->is_directory)
+    {
+        journalLogData(fs, root);
+        return;
+    }
+    // walk with the parent pointers: no stack to allocate
+    for (;;)
+    {
+        if (next < inode->directory_item_count)
+        {
+            Inode *item = inode->directory_items[next++];
+            journalLogCreate(fs, item);
+            if (!item->is_directory)
+            {
+                journalLogData(fs, item);
+                continue;
+            }
+            inode = item;
+            next = 0;
+            continue;
+        }
+        if (inode == root)
+            break;
+        next = inode->dir_slot + 1;
+        inode = inode->parent;
+    }
+}
+
+// Copy the subtree at `from` as `name` in `parent`. Returns the linked and
+// journaled copy, or NULL with nothing changed and cloner->error set.
+static Inode *cloneTree(Cloner *cloner, const Inode *from, const char *name, Inode *parent)
+{
+    FileSystem *fs = cloner->fs;
+    Inode *root = cloneInode(cloner, from, name, parent);
+    if (!root)
+        return NULL;
+
+    size_t depth = 0, capacity = 16;
+    ClonePair *stack = (ClonePair *)malloc(capacity * sizeof(ClonePair));
+    if (!stack)
+        cloner->error = CLONE_NO_MEMORY;
+    else if (from->is_directory)
+        stack[depth++] = (ClonePair){from, root};
+    while (!cloner->error && depth > 0)
+    {
+        ClonePair pair = stack[--depth];
+        const Inode *items = snapshotItems(pair.from);
+        if (dirReserve(pair.to, items->directory_item_count) != 0)
+            cloner->error = CLONE_NO_MEMORY;
+        for (size_t i = 0; !cloner->error && i < items->directory_item_count; i++)
+        {
+            const Inode *item = items->directory_items[i];
+            Inode *copy = cloneInode(cloner, item, item->name, pair.to);
+            if (!copy)
+                break;
+            if (dirAddItem(pair.to, copy) != 0)
+            {
+                cloner->error = CLONE_NO_MEMORY;
+                freeExtents(fs, copy->extents, copy->extent_count);
+                releaseInode(fs, copy);
+                break;
+            }
+            if (!item->is_directory)
+                continue;
+            if (depth == capacity)
+            {
+                capacity *= 2;
+                ClonePair *grown = (ClonePair *)realloc(stack, capacity * sizeof(ClonePair));
+                if (!grown)
+                {
+                    cloner->error = CLONE_NO_MEMORY;
+                    break;
+                }
+                stack = grown;
+            }
+            stack[depth++] = (ClonePair){item, copy};
+        }
+    }
+    free(stack);
+
+    if (!cloner->error && dirAddItem(parent, root) == 0)
+    {
+        // fill the new blocks, then mark them for the next commit: a commit
+        // forced by an allocation above must not store them unfilled
+        runParallel(cloner->run_count, copyJob, cloner);
+        for (size_t i = 0; i < cloner->run_count; i++)
+            dirtyMarkData(fs, cloner->runs[i].to, cloner->runs[i].count);
+        logTree(fs, root);
+        return root;
+    }
+    if (!cloner->error)
+        cloner->error = CLONE_NO_MEMORY;
+    // hand the partial copy to the reclaimer, which frees or drops its blocks
+    if (!root->is_directory)
+    {
+        freeExtents(fs, root->extents, root->extent_count);
+        releaseInode(fs, root);
+    }
+    else if (reclaimDetach(fs, root) == 0)
+        reclaimAll(fs);
+    return NULL;
+}
+
+// Room for `count` more inodes, finishing queued removals if that helps.
+static int haveInodes(FileSystem *fs, size_t count)
+{
+    if (count > fs->free_inode_count && fs->reclaim_depth > 0)
+        reclaimAll(fs);
+    return count <= fs->free_inode_count;
+}
+
+void cp(FileSystem *fs, const char *source, const char *destination, int reflink)
+{
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    Inode *from = resolvePath(fs, source);
+    if (!from)
+    {
+        printf("File or directory '%s' not found.\n", source);
+        return;
+    }
+
+    // into an existing directory under the same name, or as the named path
+    char name[MAX_NAME_LENGTH];
+    Inode *parent = resolveDestination(fs, destination, from->name, name);
+    if (!parent)
+    {
+        printf("Invalid path '%s'.\n", destination);
+        return;
+    }
+    if (dirLookup(parent, name))
+    {
+        printf("File or directory with name '%s' already exists.\n", name);
+        return;
+    }
+    if (inSnapshots(fs, parent, name))
+    {
+        printf("Cannot copy into '%s': snapshots are read-only.\n", destination);
+        return;
+    }
+    if (from->is_directory && isAncestor(from, parent))
+    {
+        printf("Cannot copy '%s' into itself.\n", source);
+        return;
+    }
+    if (snapshotUnshare(fs, parent) != 0)
+        return;
+
+    size_t blocks;
+    size_t inodes = countTree(from, &blocks);
+    if (!haveInodes(fs, inodes))
+    {
+        printf("Not enough inodes to copy '%s'.\n", source);
+        return;
+    }
+    if (!reflink && blocks > fs->block_count - fs->block_used && fs->reclaim_depth > 0)
+        reclaimAll(fs);
+    if (!reflink && blocks > fs->block_count - fs->block_used)
+    {
+        printf("Not enough space to copy '%s'.\n", source);
+        return;
+    }
+
+    Cloner cloner = {fs, reflink, NULL, 0, 0, 0};
+    Inode *copy = cloneTree(&cloner, from, name, parent);
+    free(cloner.runs);
+    if (!copy)
+    {
+        if (cloner.error == CLONE_CORRUPT)
+            printf("Cannot copy '%s': a file is corrupt (a block failed its checksum).\n", source);
+        else if (cloner.error == CLONE_NO_SPACE)
+            printf("Not enough space to copy '%s'.\n", source);
+        else
+            printf("Not enough memory to copy '%s'.\n", source);
+        return;
+    }
+    if (reflink)
+        printf("Cloned '%s' into '%s' (%zu inodes) in %.3f s; its data blocks are shared.\n",
+               source, destination, inodes, secondsSince(&started));
+    else
+        printf("Copied '%s' into '%s' (%zu inodes, %zu blocks) in %.3f s.\n",
+               source, destination, inodes, blocks, secondsSince(&started));
+}
@@ -0,0 +1,749 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "crypto.h"
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define CHACHA_HAVE_SSE2 1
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CHACHA_HAVE_AVX2 1 // chosen at run time, see chachaXor()
+#endif
+#endif
+
+// ---- SHA-256 (FIPS 180-4) ----
+
+typedef struct Sha256
+{
+    uint32_t state[8];
+    uint64_t length; // bytes hashed so far
+    uint8_t buffer[64];
+    size_t used;
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROR32(v, n) (((v) >> (n)) | ((v) << (32 - (n))))
+#define ROL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static uint32_t load32Be(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store32Be(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t load32Le(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void store32Le(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void sha256Compress(uint32_t state[8], const uint8_t block[64])
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = load32Be(block + 4 * i);
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static void sha256Init(Sha256 *ctx)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void sha256Update(Sha256 *ctx, const void *data, size_t length)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    ctx->length += length;
+    if (ctx->used > 0)
+    {
+        size_t take = 64 - ctx->used < length ? 64 - ctx->used : length;
+        memcpy(ctx->buffer + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        length -= take;
+        if (ctx->used < 64)
+            return;
+        sha256Compress(ctx->state, ctx->buffer);
+        ctx->used = 0;
+    }
+    for (; length >= 64; p += 64, length -= 64)
+        sha256Compress(ctx->state, p);
+    memcpy(ctx->buffer, p, length);
+    ctx->used = length;
+}
+
+static void sha256Final(Sha256 *ctx, uint8_t digest[SHA256_SIZE])
+{
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad[72] = {0x80};
+    size_t pad_length = (ctx->used < 56 ? 56 : 120) - ctx->used;
+    for (int i = 0; i < 8; i++)
+        pad[pad_length + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256Update(ctx, pad, pad_length + 8);
+    for (int i = 0; i < 8; i++)
+        store32Be(digest + 4 * i, ctx->state[i]);
+}
+
+void sha256(const void *data, size_t length, uint8_t digest[SHA256_SIZE])
+{
+    Sha256 ctx;
+    sha256Init(&ctx);
+    sha256Update(&ctx, data, length);
+    sha256Final(&ctx, digest);
+}
+
+// ---- HMAC-SHA256 (RFC 2104) and PBKDF2 (RFC 8018) ----
+
+typedef struct HmacSha256
+{
+    Sha256 inner;
+    Sha256 outer;
+} HmacSha256;
+
+static void hmacInit(HmacSha256 *ctx, const void *key, size_t key_length)
+{
+    uint8_t block[64] = {0};
+    if (key_length > sizeof(block))
+        sha256(key, key_length, block);
+    else
+        memcpy(block, key, key_length);
+
+    uint8_t pad[64];
+    for (int i = 0; i < 64; i++)
+        pad[i] = block[i] ^ 0x36;
+    sha256Init(&ctx->inner);
+    sha256Update(&ctx->inner, pad, sizeof(pad));
+    for (int i = 0; i < 64; i++)
+        pad[i] = block[i] ^ 0x5c;
+    sha256Init(&ctx->outer);
+    sha256Update(&ctx->outer, pad, sizeof(pad));
+}
+
+// `ctx` stays usable as the keyed starting point for further messages
+static void hmacFinish(const HmacSha256 *ctx, const void *data, size_t length, uint8_t mac[SHA256_SIZE])
+{
+    Sha256 inner = ctx->inner;
+    Sha256 outer = ctx->outer;
+    uint8_t digest[SHA256_SIZE];
+    sha256Update(&inner, data, length);
+    sha256Final(&inner, digest);
+    sha256Update(&outer, digest, sizeof(digest));
+    sha256Final(&outer, mac);
+}
+
+void hmacSha256(const void *key, size_t key_length, const void *data, size_t length, uint8_t mac[SHA256_SIZE])
+{
+    HmacSha256 ctx;
+    hmacInit(&ctx, key, key_length);
+    hmacFinish(&ctx, data, length, mac);
+}
+
+void pbkdf2Sha256(const void *password, size_t password_length, const void *salt, size_t salt_length,
+                  uint32_t iterations, uint8_t *out, size_t out_length)
+{
+    HmacSha256 keyed;
+    hmacInit(&keyed, password, password_length);
+    for (uint32_t index = 1; out_length > 0; index++)
+    {
+        // U1 = HMAC(P, S || INT(i)), Ui = HMAC(P, Ui-1), T = U1 ^ ... ^ Uc
+        HmacSha256 first = keyed;
+        uint8_t counter[4];
+        store32Be(counter, index);
+        sha256Update(&first.inner, salt, salt_length);
+        uint8_t u[SHA256_SIZE], t[SHA256_SIZE];
+        hmacFinish(&first, counter, sizeof(counter), u);
+        memcpy(t, u, sizeof(t));
+        for (uint32_t i = 1; i < iterations; i++)
+        {
+            hmacFinish(&keyed, u, sizeof(u), u);
+            for (int j = 0; j < SHA256_SIZE; j++)
+                t[j] ^= u[j];
+        }
+        size_t take = out_length < sizeof(t) ? out_length : sizeof(t);
+        memcpy(out, t, take);
+        out += take;
+        out_length -= take;
+    }
+}
+
+// ---- ChaCha20 (RFC 8439 section 2.4) ----
+
+#define CHACHA_QUARTER(a, b, c, d)           \
+    a += b, d ^= a, d = ROL32(d, 16),        \
+    c += d, b ^= c, b = ROL32(b, 12),        \
+    a += b, d ^= a, d = ROL32(d, 8),         \
+    c += d, b ^= c, b = ROL32(b, 7)
+
+static void chachaSetup(uint32_t state[16], const uint8_t key[AEAD_KEY_SIZE], uint32_t counter,
+                        const uint8_t nonce[AEAD_NONCE_SIZE])
+{
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++)
+        state[4 + i] = load32Le(key + 4 * i);
+    state[12] = counter;
+    for (int i = 0; i < 3; i++)
+        state[13 + i] = load32Le(nonce + 4 * i);
+}
+
+static void chachaBlock(const uint32_t state[16], uint8_t out[64])
+{
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+    for (int round = 0; round < 10; round++)
+    {
+        CHACHA_QUARTER(x[0], x[4], x[8], x[12]);
+        CHACHA_QUARTER(x[1], x[5], x[9], x[13]);
+        CHACHA_QUARTER(x[2], x[6], x[10], x[14]);
+        CHACHA_QUARTER(x[3], x[7], x[11], x[15]);
+        CHACHA_QUARTER(x[0], x[5], x[10], x[15]);
+        CHACHA_QUARTER(x[1], x[6], x[11], x[12]);
+        CHACHA_QUARTER(x[2], x[7], x[8], x[13]);
+        CHACHA_QUARTER(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+        store32Le(out + 4 * i, x[i] + state[i]);
+}
+
+#ifdef CHACHA_HAVE_SSE2
+#define ROL128(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define CHACHA_QUARTER4(a, b, c, d)                                                  \
+    a = _mm_add_epi32(a, b), d = _mm_xor_si128(d, a), d = ROL128(d, 16),           \
+    c = _mm_add_epi32(c, d), b = _mm_xor_si128(b, c), b = ROL128(b, 12),           \
+    a = _mm_add_epi32(a, b), d = _mm_xor_si128(d, a), d = ROL128(d, 8),            \
+    c = _mm_add_epi32(c, d), b = _mm_xor_si128(b, c), b = ROL128(b, 7)
+
+// XOR 256 bytes with the keystream of counters state[12] .. state[12] + 3,
+// one block per 32-bit lane.
+static void chachaXor4(const uint32_t state[16], uint8_t *data)
+{
+    __m128i x[16], start[16];
+    for (int i = 0; i < 16; i++)
+        start[i] = _mm_set1_epi32((int)state[i]);
+    start[12] = _mm_add_epi32(start[12], _mm_set_epi32(3, 2, 1, 0));
+    memcpy(x, start, sizeof(x));
+    for (int round = 0; round < 10; round++)
+    {
+        CHACHA_QUARTER4(x[0], x[4], x[8], x[12]);
+        CHACHA_QUARTER4(x[1], x[5], x[9], x[13]);
+        CHACHA_QUARTER4(x[2], x[6], x[10], x[14]);
+        CHACHA_QUARTER4(x[3], x[7], x[11], x[15]);
+        CHACHA_QUARTER4(x[0], x[5], x[10], x[15]);
+        CHACHA_QUARTER4(x[1], x[6], x[11], x[12]);
+        CHACHA_QUARTER4(x[2], x[7], x[8], x[13]);
+        CHACHA_QUARTER4(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+        x[i] = _mm_add_epi32(x[i], start[i]);
+
+    // lane j of x[4g .. 4g+3] is words 4g .. 4g+3 of block j
+    for (int g = 0; g < 4; g++)
+    {
+        __m128i t0 = _mm_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+        __m128i t1 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m128i t2 = _mm_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+        __m128i t3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m128i rows[4] = {_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+                           _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)};
+        for (int j = 0; j < 4; j++)
+        {
+            __m128i *p = (__m128i *)(data + 64 * j + 16 * g);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), rows[j]));
+        }
+    }
+}
+#endif
+
+#ifdef CHACHA_HAVE_AVX2
+#define ROL256(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define CHACHA_QUARTER8(a, b, c, d)                                                           \
+    a = _mm256_add_epi32(a, b), d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16),     \
+    c = _mm256_add_epi32(c, d), b = _mm256_xor_si256(b, c), b = ROL256(b, 12),              \
+    a = _mm256_add_epi32(a, b), d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8),      \
+    c = _mm256_add_epi32(c, d), b = _mm256_xor_si256(b, c), b = ROL256(b, 7)
+
+// chachaXor4() for 512 bytes, eight blocks per register.
+__attribute__((target("avx2")))
+static void chachaXor8(const uint32_t state[16], uint8_t *data)
+{
+    const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                          13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                                         14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    __m256i x[16], start[16];
+    for (int i = 0; i < 16; i++)
+        start[i] = _mm256_set1_epi32((int)state[i]);
+    start[12] = _mm256_add_epi32(start[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    memcpy(x, start, sizeof(x));
+    for (int round = 0; round < 10; round++)
+    {
+        CHACHA_QUARTER8(x[0], x[4], x[8], x[12]);
+        CHACHA_QUARTER8(x[1], x[5], x[9], x[13]);
+        CHACHA_QUARTER8(x[2], x[6], x[10], x[14]);
+        CHACHA_QUARTER8(x[3], x[7], x[11], x[15]);
+        CHACHA_QUARTER8(x[0], x[5], x[10], x[15]);
+        CHACHA_QUARTER8(x[1], x[6], x[11], x[12]);
+        CHACHA_QUARTER8(x[2], x[7], x[8], x[13]);
+        CHACHA_QUARTER8(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+        x[i] = _mm256_add_epi32(x[i], start[i]);
+
+    // as in chachaXor4(), per 128-bit half: blocks 0-3 low, 4-7 high
+    for (int g = 0; g < 4; g++)
+    {
+        __m256i t0 = _mm256_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+        __m256i t1 = _mm256_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m256i t2 = _mm256_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+        __m256i t3 = _mm256_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m256i rows[4] = {_mm256_unpacklo_epi64(t0, t1), _mm256_unpackhi_epi64(t0, t1),
+                           _mm256_unpacklo_epi64(t2, t3), _mm256_unpackhi_epi64(t2, t3)};
+        for (int j = 0; j < 4; j++)
+        {
+            __m128i *low = (__m128i *)(data + 64 * j + 16 * g);
+            __m128i *high = (__m128i *)(data + 64 * (j + 4) + 16 * g);
+            _mm_storeu_si128(low, _mm_xor_si128(_mm_loadu_si128(low), _mm256_castsi256_si128(rows[j])));
+            _mm_storeu_si128(high, _mm_xor_si128(_mm_loadu_si128(high), _mm256_extracti128_si256(rows[j], 1)));
+        }
+    }
+}
+#endif
+
+// XOR `length` bytes with the keystream starting at block state[12].
+static void chachaXor(uint32_t state[16], uint8_t *data, size_t length)
+{
+#ifdef CHACHA_HAVE_AVX2
+    if (length >= 512 && __builtin_cpu_supports("avx2"))
+    {
+        for (; length >= 512; data += 512, length -= 512)
+        {
+            chachaXor8(state, data);
+            state[12] += 8;
+        }
+    }
+#endif
+#ifdef CHACHA_HAVE_SSE2
+    for (; length >= 256; data += 256, length -= 256)
+    {
+        chachaXor4(state, data);
+        state[12] += 4;
+    }
+#endif
+    uint8_t stream[64];
+    while (length > 0)
+    {
+        chachaBlock(state, stream);
+        state[12]++;
+        size_t take = length < sizeof(stream) ? length : sizeof(stream);
+        for (size_t i = 0; i < take; i++)
+            data[i] ^= stream[i];
+        data += take;
+        length -= take;
+    }
+}
+
+// ---- Poly1305 (RFC 8439 section 2.5) ----
+
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 u128;
+
+// 44/44/42-bit limbs
+typedef struct Poly1305
+{
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+} Poly1305;
+
+static uint64_t load64Le(const uint8_t *p)
+{
+    return (uint64_t)load32Le(p) | (uint64_t)load32Le(p + 4) << 32;
+}
+
+static void polyInit(Poly1305 *ctx, const uint8_t key[32])
+{
+    uint64_t t0 = load64Le(key);
+    uint64_t t1 = load64Le(key + 8);
+    ctx->r[0] = t0 & 0xffc0fffffff;
+    ctx->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+    ctx->r[2] = (t1 >> 24) & 0x00ffffffc0f;
+    ctx->h[0] = ctx->h[1] = ctx->h[2] = 0;
+    ctx->pad[0] = load64Le(key + 16);
+    ctx->pad[1] = load64Le(key + 24);
+}
+
+// Absorb whole 16-byte blocks; `hibit` is 1 << 40 for full blocks.
+static void polyBlocks(Poly1305 *ctx, const uint8_t *m, size_t length, uint64_t hibit)
+{
+    const uint64_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2];
+    const uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+    for (; length >= 16; m += 16, length -= 16)
+    {
+        uint64_t t0 = load64Le(m);
+        uint64_t t1 = load64Le(m + 8);
+        h0 += t0 & 0xfffffffffff;
+        h1 += ((t0 >> 44) | (t1 << 20)) & 0xfffffffffff;
+        h2 += ((t1 >> 24) & 0x3ffffffffff) | hibit;
+
+        u128 d0 = (u128)h0 * r0 + (u128)h1 * s2 + (u128)h2 * s1;
+        u128 d1 = (u128)h0 * r1 + (u128)h1 * r0 + (u128)h2 * s2;
+        u128 d2 = (u128)h0 * r2 + (u128)h1 * r1 + (u128)h2 * r0;
+
+        uint64_t c = (uint64_t)(d0 >> 44);
+        h0 = (uint64_t)d0 & 0xfffffffffff;
+        d1 += c;
+        c = (uint64_t)(d1 >> 44);
+        h1 = (uint64_t)d1 & 0xfffffffffff;
+        d2 += c;
+        c = (uint64_t)(d2 >> 42);
+        h2 = (uint64_t)d2 & 0x3ffffffffff;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= 0xfffffffffff;
+        h1 += c;
+    }
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
+}
+
+static void polyFinish(Poly1305 *ctx, uint8_t tag[AEAD_TAG_SIZE])
+{
+    uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+    uint64_t c = h1 >> 44;
+    h1 &= 0xfffffffffff;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= 0x3ffffffffff;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= 0xfffffffffff;
+    h1 += c;
+    c = h1 >> 44;
+    h1 &= 0xfffffffffff;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= 0x3ffffffffff;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= 0xfffffffffff;
+    h1 += c;
+
+    // h - p, selected if h >= p
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44;
+    g0 &= 0xfffffffffff;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44;
+    g1 &= 0xfffffffffff;
+    uint64_t g2 = h2 + c - ((uint64_t)1 << 42);
+    uint64_t mask = (g2 >> 63) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+
+    // h + pad mod 2^128
+    uint64_t t0 = ctx->pad[0], t1 = ctx->pad[1];
+    h0 += t0 & 0xfffffffffff;
+    c = h0 >> 44;
+    h0 &= 0xfffffffffff;
+    h1 += (((t0 >> 44) | (t1 << 20)) & 0xfffffffffff) + c;
+    c = h1 >> 44;
+    h1 &= 0xfffffffffff;
+    h2 += ((t1 >> 24) & 0x3ffffffffff) + c;
+
+    uint64_t out0 = h0 | (h1 << 44);
+    uint64_t out1 = (h1 >> 20) | (h2 << 24);
+    store32Le(tag, (uint32_t)out0);
+    store32Le(tag + 4, (uint32_t)(out0 >> 32));
+    store32Le(tag + 8, (uint32_t)out1);
+    store32Le(tag + 12, (uint32_t)(out1 >> 32));
+}
+#else
+// 26-bit limbs
+typedef struct Poly1305
+{
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+} Poly1305;
+
+static void polyInit(Poly1305 *ctx, const uint8_t key[32])
+{
+    ctx->r[0] = load32Le(key) & 0x3ffffff;
+    ctx->r[1] = (load32Le(key + 3) >> 2) & 0x3ffff03;
+    ctx->r[2] = (load32Le(key + 6) >> 4) & 0x3ffc0ff;
+    ctx->r[3] = (load32Le(key + 9) >> 6) & 0x3f03fff;
+    ctx->r[4] = (load32Le(key + 12) >> 8) & 0x00fffff;
+    memset(ctx->h, 0, sizeof(ctx->h));
+    for (int i = 0; i < 4; i++)
+        ctx->pad[i] = load32Le(key + 16 + 4 * i);
+}
+
+// Absorb whole 16-byte blocks; `hibit` is 1 << 24 for full blocks.
+static void polyBlocks(Poly1305 *ctx, const uint8_t *m, size_t length, uint32_t hibit)
+{
+    const uint32_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2], r3 = ctx->r[3], r4 = ctx->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2], h3 = ctx->h[3], h4 = ctx->h[4];
+    for (; length >= 16; m += 16, length -= 16)
+    {
+        h0 += load32Le(m) & 0x3ffffff;
+        h1 += (load32Le(m + 3) >> 2) & 0x3ffffff;
+        h2 += (load32Le(m + 6) >> 4) & 0x3ffffff;
+        h3 += (load32Le(m + 9) >> 6) & 0x3ffffff;
+        h4 += (load32Le(m + 12) >> 8) | hibit;
+
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        uint32_t c = (uint32_t)(d0 >> 26);
+        h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c;
+        c = (uint32_t)(d1 >> 26);
+        h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c;
+        c = (uint32_t)(d2 >> 26);
+        h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c;
+        c = (uint32_t)(d3 >> 26);
+        h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c;
+        c = (uint32_t)(d4 >> 26);
+        h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5;
+        c = h0 >> 26;
+        h0 &= 0x3ffffff;
+        h1 += c;
+    }
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
+    ctx->h[3] = h3;
+    ctx->h[4] = h4;
+}
+
+static void polyFinish(Poly1305 *ctx, uint8_t tag[AEAD_TAG_SIZE])
+{
+    uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2], h3 = ctx->h[3], h4 = ctx->h[4];
+    uint32_t c = h1 >> 26;
+    h1 &= 0x3ffffff;
+    h2 += c;
+    c = h2 >> 26;
+    h2 &= 0x3ffffff;
+    h3 += c;
+    c = h3 >> 26;
+    h3 &= 0x3ffffff;
+    h4 += c;
+    c = h4 >> 26;
+    h4 &= 0x3ffffff;
+    h0 += c * 5;
+    c = h0 >> 26;
+    h0 &= 0x3ffffff;
+    h1 += c;
+
+    // h - p, selected if h >= p
+    uint32_t g0 = h0 + 5;
+    c = g0 >> 26;
+    g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c;
+    c = g1 >> 26;
+    g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c;
+    c = g2 >> 26;
+    g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c;
+    c = g3 >> 26;
+    g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1u << 26);
+    uint32_t mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    // h + pad mod 2^128
+    uint32_t w0 = h0 | (h1 << 26);
+    uint32_t w1 = (h1 >> 6) | (h2 << 20);
+    uint32_t w2 = (h2 >> 12) | (h3 << 14);
+    uint32_t w3 = (h3 >> 18) | (h4 << 8);
+    uint64_t f = (uint64_t)w0 + ctx->pad[0];
+    store32Le(tag, (uint32_t)f);
+    f = (uint64_t)w1 + ctx->pad[1] + (f >> 32);
+    store32Le(tag + 4, (uint32_t)f);
+    f = (uint64_t)w2 + ctx->pad[2] + (f >> 32);
+    store32Le(tag + 8, (uint32_t)f);
+    f = (uint64_t)w3 + ctx->pad[3] + (f >> 32);
+    store32Le(tag + 12, (uint32_t)f);
+}
+#endif
+
+#ifdef __SIZEOF_INT128__
+#define POLY_HIBIT ((uint64_t)1 << 40)
+#else
+#define POLY_HIBIT (1u << 24)
+#endif
+
+// Absorb `length` bytes zero padded to a multiple of 16.
+static void polyPadded(Poly1305 *ctx, const uint8_t *m, size_t length)
+{
+    size_t whole = length / 16 * 16;
+    polyBlocks(ctx, m, whole, POLY_HIBIT);
+    if (length > whole)
+    {
+        uint8_t last[16] = {0};
+        memcpy(last, m + whole, length - whole);
+        polyBlocks(ctx, last, sizeof(last), POLY_HIBIT);
+    }
+}
+
+// ---- AEAD (RFC 8439 section 2.8) ----
+
+static void aeadTag(const uint8_t poly_key[32], const void *aad, size_t aad_length,
+                    const uint8_t *ciphertext, size_t length, uint8_t tag[AEAD_TAG_SIZE])
+{
+    Poly1305 poly;
+    polyInit(&poly, poly_key);
+    polyPadded(&poly, (const uint8_t *)aad, aad_length);
+    polyPadded(&poly, ciphertext, length);
+    uint8_t lengths[16];
+    store32Le(lengths, (uint32_t)aad_length);
+    store32Le(lengths + 4, (uint32_t)((uint64_t)aad_length >> 32));
+    store32Le(lengths + 8, (uint32_t)length);
+    store32Le(lengths + 12, (uint32_t)((uint64_t)length >> 32));
+    polyBlocks(&poly, lengths, sizeof(lengths), POLY_HIBIT);
+    polyFinish(&poly, tag);
+}
+
+// The one-time Poly1305 key is the start of keystream block 0; the data
+// is encrypted from block 1 on.
+static void aeadPolyKey(uint32_t state[16], uint8_t poly_key[32])
+{
+    uint8_t block[64];
+    chachaBlock(state, block);
+    memcpy(poly_key, block, 32);
+    state[12] = 1;
+}
+
+void aeadSeal(const uint8_t key[AEAD_KEY_SIZE], const uint8_t nonce[AEAD_NONCE_SIZE],
+              const void *aad, size_t aad_length, void *data, size_t length, uint8_t tag[AEAD_TAG_SIZE])
+{
+    uint32_t state[16];
+    uint8_t poly_key[32];
+    chachaSetup(state, key, 0, nonce);
+    aeadPolyKey(state, poly_key);
+    chachaXor(state, (uint8_t *)data, length);
+    aeadTag(poly_key, aad, aad_length, (const uint8_t *)data, length, tag);
+}
+
+int aeadOpen(const uint8_t key[AEAD_KEY_SIZE], const uint8_t nonce[AEAD_NONCE_SIZE],
+             const void *aad, size_t aad_length, void *data, size_t length, const uint8_t tag[AEAD_TAG_SIZE])
+{
+    uint32_t state[16];
+    uint8_t poly_key[32];
+    uint8_t expected[AEAD_TAG_SIZE];
+    chachaSetup(state, key, 0, nonce);
+    aeadPolyKey(state, poly_key);
+    aeadTag(poly_key, aad, aad_length, (const uint8_t *)data, length, expected);
+
+    uint8_t diff = 0;
+    for (int i = 0; i < AEAD_TAG_SIZE; i++)
+        diff |= expected[i] ^ tag[i];
+    if (diff)
+        return -1;
+    chachaXor(state, (uint8_t *)data, length);
+    return 0;
+}
+
+void randomBytes(void *out, size_t length)
+{
+    FILE *source = fopen("/dev/urandom", "rb");
+    size_t got = source ? fread(out, 1, length, source) : 0;
+    if (source)
+        fclose(source);
+    if (got == length)
+        return;
+
+    // no random device: hash whatever varies between runs
+    struct
+    {
+        struct timespec now;
+        clock_t cpu;
+        const void *where;
+        size_t counter;
+    } seed;
+    uint8_t digest[SHA256_SIZE];
+    for (size_t done = 0; done < length; done += sizeof(digest))
+    {
+        clock_gettime(CLOCK_REALTIME, &seed.now);
+        seed.cpu = clock();
+        seed.where = &seed;
+        seed.counter = done;
+        sha256(&seed, sizeof(seed), digest);
+        memcpy((uint8_t *)out + done, digest, length - done < sizeof(digest) ? length - done : sizeof(digest));
+    }
+}
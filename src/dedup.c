@@ -0,0 +1,681 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+#include "avl_tree.h"
+#include "block_alloc.h"
+#include "block_bitmap.h"
+#include "worker_pool.h"
+
+#ifndef FS_NO_DEDUP
+#define DEDUP_INLINE 1
+#else
+#define DEDUP_INLINE 0
+#endif
+
+#if BLOCK_SIZE % 32 != 0
+#error "fingerprints read blocks in 32-byte stripes"
+#endif
+
+// the fingerprint table is filled in jobs of this many blocks
+#define DEDUP_INDEX_CHUNK_BLOCKS 8192
+#define MAP_MIN_CAPACITY 64
+#define MAP_EMPTY UINT64_MAX
+
+// Open addressing with linear probing. A block's entry is removed when the
+// block is freed (backward shift, no tombstones), so the table only names
+// blocks in use.
+typedef struct MapEntry
+{
+    uint64_t key;
+    uint64_t value;
+} MapEntry;
+
+typedef struct BlockMap
+{
+    MapEntry *entries;
+    size_t capacity; // a power of two, or 0
+    size_t count;
+} BlockMap;
+
+// Blocks [start, start + length) all have `extra` references beyond the
+// first. Runs do not overlap, and neighbours with as many references are
+// joined, so a cloned extent stays one run.
+typedef struct SharedRun
+{
+    AvlStartNode by_start;
+    size_t length;
+    size_t extra;
+    struct SharedRun *next; // next spare node while unlinked
+} SharedRun;
+
+#define START_RUN(ptr) AVL_ENTRY(ptr, SharedRun, by_start.node)
+
+typedef struct DedupTable
+{
+    AvlNode *runs;       // SharedRun::by_start
+    size_t run_count;
+    SharedRun *spare;    // nodes reserved for splits
+    size_t spare_count;
+    size_t shared;       // extra references over all blocks
+    BlockMap prints;     // fingerprint -> a block in use with those contents
+    int indexed;         // prints covers every block in use
+} DedupTable;
+
+// ---- fingerprints: the XXH64 construction over one block ----
+
+#define PRIME1 0x9E3779B185EBCA87ull
+#define PRIME2 0xC2B2AE3D27D4EB4Full
+#define PRIME3 0x165667B19E3779F9ull
+#define PRIME4 0x85EBCA77C2B2AE63ull
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t mixRound(uint64_t acc, uint64_t input)
+{
+    return rotl(acc + input * PRIME2, 31) * PRIME1;
+}
+
+static uint64_t mergeRound(uint64_t hash, uint64_t lane)
+{
+    return (hash ^ mixRound(0, lane)) * PRIME1 + PRIME4;
+}
+
+// Only kept in memory, so byte order does not matter.
+static uint64_t fingerprint(const char *block)
+{
+    uint64_t v1 = PRIME1 + PRIME2, v2 = PRIME2, v3 = 0, v4 = 0 - PRIME1;
+    for (size_t i = 0; i < BLOCK_SIZE; i += 32)
+    {
+        uint64_t lane[4];
+        memcpy(lane, block + i, sizeof(lane));
+        v1 = mixRound(v1, lane[0]);
+        v2 = mixRound(v2, lane[1]);
+        v3 = mixRound(v3, lane[2]);
+        v4 = mixRound(v4, lane[3]);
+    }
+    uint64_t hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    hash = mergeRound(hash, v1);
+    hash = mergeRound(hash, v2);
+    hash = mergeRound(hash, v3);
+    hash = mergeRound(hash, v4);
+    hash += BLOCK_SIZE;
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash == MAP_EMPTY ? hash - 1 : hash; // MAP_EMPTY marks free slots
+}
+
+// ---- BlockMap ----
+
+static size_t mapSlot(const BlockMap *map, uint64_t key)
+{
+    // keys are XXH64 fingerprints, already well mixed
+    return (size_t)key & (map->capacity - 1);
+}
+
+// slot holding `key`, or the empty slot where it would go
+static size_t mapProbe(const BlockMap *map, uint64_t key)
+{
+    size_t slot = mapSlot(map, key);
+    while (map->entries[slot].key != MAP_EMPTY && map->entries[slot].key != key)
+        slot = (slot + 1) & (map->capacity - 1);
+    return slot;
+}
+
+static MapEntry *mapFind(const BlockMap *map, uint64_t key)
+{
+    if (map->count == 0)
+        return NULL;
+    MapEntry *entry = &map->entries[mapProbe(map, key)];
+    return entry->key == MAP_EMPTY ? NULL : entry;
+}
+
+// Empty `slot` and move later entries of its probe chain back, so every
+// key stays reachable from its home slot.
+static void mapRemove(BlockMap *map, size_t slot)
+{
+    size_t mask = map->capacity - 1;
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; map->entries[next].key != MAP_EMPTY; next = (next + 1) & mask)
+    {
+        // an entry may fill the hole if the hole lies between its home and it
+        size_t home = mapSlot(map, map->entries[next].key);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            map->entries[hole] = map->entries[next];
+            hole = next;
+        }
+    }
+    map->entries[hole].key = MAP_EMPTY;
+    map->count--;
+}
+
+// Move the entries into a table of `capacity` slots, leaving out those
+// whose value is a block clear in `in_use` (if given).
+static int mapRehash(BlockMap *map, size_t capacity, const uint64_t *in_use)
+{
+    MapEntry *entries = (MapEntry *)malloc(capacity * sizeof(MapEntry));
+    if (!entries)
+        return -1;
+    for (size_t i = 0; i < capacity; i++)
+        entries[i].key = MAP_EMPTY;
+
+    BlockMap grown = {entries, capacity, 0};
+    for (size_t i = 0; i < map->capacity; i++)
+    {
+        const MapEntry *entry = &map->entries[i];
+        if (entry->key == MAP_EMPTY || (in_use && !bitmapTest(in_use, (size_t)entry->value)))
+            continue;
+        grown.entries[mapProbe(&grown, entry->key)] = *entry;
+        grown.count++;
+    }
+    free(map->entries);
+    *map = grown;
+    return 0;
+}
+
+// Room for `count` entries at a load of at most 3/4. Entries of blocks no
+// longer in use are dropped first, should any be left.
+static int mapReserve(BlockMap *map, size_t count, const uint64_t *in_use)
+{
+    if (count <= map->capacity / 4 * 3)
+        return 0;
+    size_t live = count;
+    if (in_use)
+    {
+        live -= map->count;
+        for (size_t i = 0; i < map->capacity; i++)
+            live += map->entries[i].key != MAP_EMPTY && bitmapTest(in_use, (size_t)map->entries[i].value);
+    }
+    size_t capacity = MAP_MIN_CAPACITY;
+    while (capacity / 4 * 3 < live * 2)
+        capacity *= 2;
+    return mapRehash(map, capacity, in_use);
+}
+
+static int mapPut(BlockMap *map, uint64_t key, uint64_t value, const uint64_t *in_use)
+{
+    if (mapReserve(map, map->count + 1, in_use) != 0)
+        return -1;
+    MapEntry *entry = &map->entries[mapProbe(map, key)];
+    if (entry->key == MAP_EMPTY)
+        map->count++;
+    entry->key = key;
+    entry->value = value;
+    return 0;
+}
+
+// ---- references: an AVL tree of shared runs by start block ----
+
+// keep at most this many freed nodes for the next split
+#define SPARE_RUNS_MAX 64
+
+static SharedRun *startRun(AvlStartNode *node)
+{
+    return node ? AVL_ENTRY(node, SharedRun, by_start) : NULL;
+}
+
+// last run starting at or before `block`
+static SharedRun *floorRun(const AvlNode *root, size_t block)
+{
+    return startRun(avlStartFloor(root, block));
+}
+
+// first run starting at or after `block`
+static SharedRun *ceilRun(const AvlNode *root, size_t block)
+{
+    return startRun(avlStartCeil(root, block));
+}
+
+// the run holding `block`, if any
+static SharedRun *findRun(const DedupTable *table, size_t block)
+{
+    SharedRun *run = floorRun(table->runs, block);
+    return run && block < run->by_start.start + run->length ? run : NULL;
+}
+
+// Make sure `count` nodes are on the spare list.
+static int reserveRuns(DedupTable *table, size_t count)
+{
+    while (table->spare_count < count)
+    {
+        SharedRun *run = (SharedRun *)malloc(sizeof(SharedRun));
+        if (!run)
+            return -1;
+        run->next = table->spare;
+        table->spare = run;
+        table->spare_count++;
+    }
+    return 0;
+}
+
+// Link a reserved node holding [start, start + length) with `extra` references.
+static void addRun(DedupTable *table, size_t start, size_t length, size_t extra)
+{
+    SharedRun *run = table->spare;
+    table->spare = run->next;
+    table->spare_count--;
+    run->by_start.start = start;
+    run->length = length;
+    run->extra = extra;
+    table->runs = avlInsert(table->runs, &run->by_start.node, avlCompareStart);
+    table->run_count++;
+}
+
+static void dropRun(DedupTable *table, SharedRun *run)
+{
+    table->runs = avlRemove(table->runs, &run->by_start.node, avlCompareStart);
+    table->run_count--;
+    if (table->spare_count < SPARE_RUNS_MAX)
+    {
+        run->next = table->spare;
+        table->spare = run;
+        table->spare_count++;
+    }
+    else
+        free(run);
+}
+
+// Split the run holding `block` so that one starts there; needs a spare node.
+static void splitAt(DedupTable *table, size_t block)
+{
+    SharedRun *run = findRun(table, block);
+    if (!run || run->by_start.start == block)
+        return;
+    size_t end = run->by_start.start + run->length;
+    run->length = block - run->by_start.start;
+    addRun(table, block, end - block, run->extra);
+}
+
+// Join the runs meeting at `block` if they have as many references.
+static void mergeAt(DedupTable *table, size_t block)
+{
+    SharedRun *right = findRun(table, block);
+    SharedRun *left = block > 0 ? findRun(table, block - 1) : NULL;
+    if (!left || !right || left == right || left->extra != right->extra)
+        return;
+    left->length += right->length;
+    dropRun(table, right);
+}
+
+static void freeRuns(AvlNode *node)
+{
+    while (node)
+    {
+        freeRuns(node->left);
+        AvlNode *right = node->right;
+        free(START_RUN(node));
+        node = right;
+    }
+}
+
+int dedupInit(FileSystem *fs)
+{
+    fs->dedup = (DedupTable *)calloc(1, sizeof(DedupTable));
+    return fs->dedup ? 0 : -1;
+}
+
+void dedupDestroy(FileSystem *fs)
+{
+    DedupTable *table = fs->dedup;
+    if (!table)
+        return;
+    freeRuns(table->runs);
+    while (table->spare)
+    {
+        SharedRun *next = table->spare->next;
+        free(table->spare);
+        table->spare = next;
+    }
+    free(table->prints.entries);
+    free(table);
+    fs->dedup = NULL;
+}
+
+int dedupAddReferences(FileSystem *fs, size_t start, size_t count)
+{
+    DedupTable *table = fs->dedup;
+    if (!table)
+        return -1;
+    size_t end = start + count;
+
+    // two splits, plus a new run for each gap between the runs inside
+    size_t inside = 0;
+    for (SharedRun *run = ceilRun(table->runs, start); run && run->by_start.start < end; run = ceilRun(table->runs, run->by_start.start + 1))
+        inside++;
+    if (reserveRuns(table, inside + 3) != 0)
+        return -1;
+
+    splitAt(table, start);
+    splitAt(table, end);
+    size_t pos = start;
+    while (pos < end)
+    {
+        SharedRun *run = ceilRun(table->runs, pos);
+        size_t gap_end = run && run->by_start.start < end ? run->by_start.start : end;
+        if (gap_end > pos)
+        {
+            addRun(table, pos, gap_end - pos, 1);
+            pos = gap_end;
+            continue;
+        }
+        run->extra++;
+        pos = run->by_start.start + run->length;
+    }
+    table->shared += count;
+    // only the ends can now match their neighbours
+    mergeAt(table, start);
+    mergeAt(table, end);
+    return 0;
+}
+
+size_t dedupUnsharedRun(const FileSystem *fs, size_t start, size_t end)
+{
+    const DedupTable *table = fs->dedup;
+    if (!table || !table->runs)
+        return end - start;
+    if (findRun(table, start))
+        return 0;
+    SharedRun *next = ceilRun(table->runs, start);
+    return (next && next->by_start.start < end ? next->by_start.start : end) - start;
+}
+
+size_t dedupDropShared(FileSystem *fs, size_t start, size_t end)
+{
+    DedupTable *table = fs->dedup;
+    SharedRun *run = findRun(table, start);
+    size_t run_end = run->by_start.start + run->length;
+    size_t stop = run_end < end ? run_end : end;
+    // out of memory the blocks keep this reference: leaked, never freed early
+    if (reserveRuns(table, (run->by_start.start < start) + (stop < run_end)) != 0)
+        return stop - start;
+
+    splitAt(table, start);
+    splitAt(table, stop);
+    run = findRun(table, start);
+    if (--run->extra == 0)
+        dropRun(table, run);
+    table->shared -= stop - start;
+    mergeAt(table, start);
+    mergeAt(table, stop);
+    return stop - start;
+}
+
+int dedupShared(const FileSystem *fs, size_t start, size_t count)
+{
+    return dedupUnsharedRun(fs, start, start + count) < count;
+}
+
+int dedupCountReferences(FileSystem *fs)
+{
+    DedupTable *table = fs->dedup;
+    uint64_t *seen = bitmapCreate(fs->block_count);
+    if (!table || !seen)
+    {
+        free(seen);
+        return -1;
+    }
+    freeRuns(table->runs);
+    table->runs = NULL;
+    table->run_count = 0;
+    table->shared = 0;
+
+    // blocks seen before gain a reference, run by run
+    for (size_t ino = 0; ino < fs->inode_count; ino++)
+    {
+        const Inode *file = fs->inodes[ino];
+        if (!file || file->is_directory)
+            continue;
+        for (size_t e = 0; e < file->extent_count; e++)
+        {
+            size_t end = file->extents[e].start + file->extents[e].length;
+            size_t b = file->extents[e].start;
+            while (b < end)
+            {
+                size_t first_seen = bitmapNextSet(seen, end, b);
+                if (first_seen > b)
+                {
+                    bitmapSetRange(seen, b, first_seen - b);
+                    b = first_seen;
+                    continue;
+                }
+                size_t stop = bitmapNextClear(seen, end, b);
+                if (dedupAddReferences(fs, b, stop - b) != 0)
+                {
+                    free(seen);
+                    return -1;
+                }
+                b = stop;
+            }
+        }
+    }
+    free(seen);
+    return 0;
+}
+
+// ---- fingerprint table ----
+
+typedef struct IndexPlan
+{
+    const FileSystem *fs;
+    uint64_t *prints; // per block; only the blocks in use are filled in
+} IndexPlan;
+
+static void indexJob(void *context, size_t i)
+{
+    IndexPlan *plan = (IndexPlan *)context;
+    const FileSystem *fs = plan->fs;
+    size_t start = i * DEDUP_INDEX_CHUNK_BLOCKS;
+    size_t end = start + DEDUP_INDEX_CHUNK_BLOCKS < fs->block_count ? start + DEDUP_INDEX_CHUNK_BLOCKS : fs->block_count;
+    for (size_t b = bitmapNextSet(fs->block_bitmap, end, start); b < end; b = bitmapNextSet(fs->block_bitmap, end, b + 1))
+        plan->prints[b] = fingerprint(fs->data_blocks + b * BLOCK_SIZE);
+}
+
+void dedupPrepare(FileSystem *fs)
+{
+    DedupTable *table = fs->dedup;
+    if (!DEDUP_INLINE || !table || table->indexed)
+        return;
+
+    // hash the blocks in use on the worker pool, then insert them here
+    IndexPlan plan = {fs, NULL};
+    if (fs->block_used > 0)
+    {
+        plan.prints = (uint64_t *)malloc(fs->block_count * sizeof(uint64_t));
+        if (!plan.prints || mapReserve(&table->prints, fs->block_used, NULL) != 0)
+        {
+            free(plan.prints);
+            return;
+        }
+        runParallel((fs->block_count + DEDUP_INDEX_CHUNK_BLOCKS - 1) / DEDUP_INDEX_CHUNK_BLOCKS, indexJob, &plan);
+    }
+    for (size_t b = bitmapNextSet(fs->block_bitmap, fs->block_count, 0); b < fs->block_count;
+         b = bitmapNextSet(fs->block_bitmap, fs->block_count, b + 1))
+    {
+        // the first copy stays the one found
+        if (!mapFind(&table->prints, plan.prints[b]))
+            mapPut(&table->prints, plan.prints[b], b, NULL);
+    }
+    free(plan.prints);
+    table->indexed = 1;
+}
+
+int dedupActive(const FileSystem *fs)
+{
+    return DEDUP_INLINE && fs->dedup && fs->dedup->indexed;
+}
+
+void dedupFingerprintFile(const FileSystem *fs, const Inode *file, uint64_t *prints)
+{
+    size_t n = 0;
+    for (size_t e = 0; e < file->extent_count; e++)
+    {
+        const char *block = fs->data_blocks + file->extents[e].start * BLOCK_SIZE;
+        for (size_t i = 0; i < file->extents[e].length; i++, block += BLOCK_SIZE)
+            prints[n++] = fingerprint(block);
+    }
+}
+
+// the in-use block the table has for `print` if it holds the same bytes as `block`
+static int findCopy(FileSystem *fs, uint64_t print, size_t block, size_t *copy)
+{
+    MapEntry *entry = mapFind(&fs->dedup->prints, print);
+    if (entry)
+    {
+        size_t other = (size_t)entry->value;
+        if (other != block && bitmapTest(fs->block_bitmap, other) &&
+            memcmp(fs->data_blocks + other * BLOCK_SIZE, fs->data_blocks + block * BLOCK_SIZE, BLOCK_SIZE) == 0)
+        {
+            *copy = other;
+            return 1;
+        }
+        // a collision: the new block takes the entry
+        entry->value = block;
+        return 0;
+    }
+    mapPut(&fs->dedup->prints, print, block, fs->block_bitmap);
+    return 0;
+}
+
+// append block `b` to the runs in `out`
+static void pushBlock(Extent *out, size_t *count, size_t b)
+{
+    if (*count > 0 && out[*count - 1].start + out[*count - 1].length == b)
+        out[*count - 1].length++;
+    else
+        out[(*count)++] = (Extent){b, 1};
+}
+
+size_t dedupFile(FileSystem *fs, Inode *file, const uint64_t *prints)
+{
+    if (!dedupActive(fs) || file->block_count == 0)
+        return 0;
+
+    uint64_t *own = NULL;
+    if (!prints)
+    {
+        own = (uint64_t *)malloc(file->block_count * sizeof(uint64_t));
+        if (!own)
+            return 0;
+        dedupFingerprintFile(fs, file, own);
+        prints = own;
+    }
+
+    // where each logical block ends up
+    size_t *target = (size_t *)malloc(file->block_count * sizeof(size_t));
+    size_t n = 0, copies = 0;
+    for (size_t e = 0; target && e < file->extent_count; e++)
+    {
+        for (size_t b = file->extents[e].start; b < file->extents[e].start + file->extents[e].length; b++, n++)
+        {
+            target[n] = b;
+            copies += findCopy(fs, prints[n], b, &target[n]);
+        }
+    }
+    free(own);
+    if (!target || copies == 0)
+    {
+        free(target);
+        return 0;
+    }
+
+    // take the references; out of memory, the rest of the file keeps its blocks
+    int full = 0;
+    n = 0;
+    for (size_t e = 0; e < file->extent_count; e++)
+    {
+        for (size_t b = file->extents[e].start; b < file->extents[e].start + file->extents[e].length; b++, n++)
+        {
+            if (target[n] != b && (full || dedupAddReferences(fs, target[n], 1) != 0))
+            {
+                full = 1;
+                target[n] = b;
+            }
+        }
+    }
+
+    size_t run_count = 1, dropped_count = 0;
+    copies = 0;
+    n = 0;
+    for (size_t e = 0; e < file->extent_count; e++)
+    {
+        for (size_t b = file->extents[e].start; b < file->extents[e].start + file->extents[e].length; b++, n++)
+        {
+            copies += target[n] != b;
+            run_count += n > 0 && target[n] != target[n - 1] + 1;
+        }
+    }
+    Extent *runs = (Extent *)malloc(run_count * sizeof(Extent));
+    Extent *dropped = copies ? (Extent *)malloc(copies * sizeof(Extent)) : NULL;
+
+    n = 0;
+    run_count = 0;
+    for (size_t e = 0; e < file->extent_count; e++)
+    {
+        for (size_t b = file->extents[e].start; b < file->extents[e].start + file->extents[e].length; b++, n++)
+        {
+            if (!runs || !dropped)
+            {
+                // give the references back
+                if (target[n] != b)
+                    dedupDropShared(fs, target[n], target[n] + 1);
+                continue;
+            }
+            if (target[n] != b)
+                pushBlock(dropped, &dropped_count, b);
+            pushBlock(runs, &run_count, target[n]);
+        }
+    }
+    free(target);
+    if (!runs || !dropped)
+    {
+        free(runs);
+        free(dropped);
+        return 0;
+    }
+    freeExtents(fs, dropped, dropped_count);
+    free(dropped);
+    free(file->extents);
+    file->extents = runs;
+    file->extent_count = run_count;
+    return copies;
+}
+
+void dedupMoved(FileSystem *fs, size_t src, size_t dst, size_t count)
+{
+    DedupTable *table = fs->dedup;
+    if (!table || !table->indexed)
+        return;
+    for (size_t i = 0; i < count; i++)
+    {
+        MapEntry *entry = mapFind(&table->prints, fingerprint(fs->data_blocks + (dst + i) * BLOCK_SIZE));
+        if (entry && entry->value == src + i)
+            entry->value = dst + i;
+    }
+}
+
+void dedupForget(FileSystem *fs, size_t start, size_t count)
+{
+    DedupTable *table = fs->dedup;
+    if (!table || !table->indexed)
+        return;
+    for (size_t b = start; b < start + count && table->prints.count > 0; b++)
+    {
+        size_t slot = mapProbe(&table->prints, fingerprint(fs->data_blocks + b * BLOCK_SIZE));
+        if (table->prints.entries[slot].key != MAP_EMPTY && table->prints.entries[slot].value == b)
+            mapRemove(&table->prints, slot);
+    }
+}
+
+void dedupStats(const FileSystem *fs, size_t *shared_references, size_t *entries, size_t *bytes)
+{
+    const DedupTable *table = fs->dedup;
+    *shared_references = table ? table->shared : 0;
+    *entries = table ? table->prints.count : 0;
+    *bytes = table ? table->prints.capacity * sizeof(MapEntry) : 0;
+}
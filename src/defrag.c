@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "file_system.h"
+#include "block_bitmap.h"
+#include "free_extent.h"
+#include "dirty.h"
+#include "journal.h"
+#include "dedup.h"
+
+// Each call moves at most `max_blocks` blocks, using three kinds of step:
+//  1. pull:     a file whose first extent is followed by enough free space
+//               gets its next blocks copied in behind it
+//  2. slide:    the piece right after the lowest free gap moves down into it,
+//               so free space collects at the end of the partition
+//  3. relocate: with no gaps left, a fragmented file starts moving into the
+//               smallest free run that holds all of it (pulls finish it)
+// Metadata is updated after every move, so the image is consistent between
+// calls and a compaction can be spread over many commands. Each move is
+// journaled; moving into blocks vacated earlier in the same call commits
+// the journal first (see journal.h). Files with blocks shared with
+// others (see dedup.h) stay where they are.
+
+typedef struct FileList
+{
+    Inode **items;
+    size_t count;
+} FileList;
+
+static int sharesBlocks(const FileSystem *fs, const Inode *file)
+{
+    for (size_t e = 0; e < file->extent_count; e++)
+    {
+        if (dedupShared(fs, file->extents[e].start, file->extents[e].length))
+            return 1;
+    }
+    return 0;
+}
+
+static int collectFiles(FileSystem *fs, FileList *files)
+{
+    size_t capacity = 16;
+    size_t depth = 0;
+    size_t stack_capacity = 16;
+    Inode **stack = (Inode **)malloc(stack_capacity * sizeof(Inode *));
+    files->items = (Inode **)malloc(capacity * sizeof(Inode *));
+    files->count = 0;
+    if (!stack || !files->items)
+    {
+        free(stack);
+        free(files->items);
+        return -1;
+    }
+
+    stack[depth++] = fs->root;
+    while (depth > 0)
+    {
+        Inode *inode = stack[--depth];
+        if (!inode->is_directory)
+        {
+            if (inode->block_count == 0 || sharesBlocks(fs, inode))
+                continue;
+            if (files->count == capacity)
+            {
+                capacity *= 2;
+                Inode **grown = (Inode **)realloc(files->items, capacity * sizeof(Inode *));
+                if (!grown)
+                    goto fail;
+                files->items = grown;
+            }
+            files->items[files->count++] = inode;
+            continue;
+        }
+        if (depth + inode->directory_item_count > stack_capacity)
+        {
+            while (depth + inode->directory_item_count > stack_capacity)
+                stack_capacity *= 2;
+            Inode **grown = (Inode **)realloc(stack, stack_capacity * sizeof(Inode *));
+            if (!grown)
+                goto fail;
+            stack = grown;
+        }
+        for (size_t i = 0; i < inode->directory_item_count; i++)
+            stack[depth++] = inode->directory_items[i];
+    }
+    free(stack);
+    return 0;
+
+fail:
+    free(stack);
+    free(files->items);
+    files->items = NULL;
+    files->count = 0;
+    return -1;
+}
+
+// Build the extent list of `file` with blocks [offset, offset + count) of
+// extent `e` moved to `dst`, merging pieces that end up adjacent on disk.
+static Extent *remapExtents(const Inode *file, size_t e, size_t offset, size_t count, size_t dst, size_t *new_count)
+{
+    Extent *out = (Extent *)malloc((file->extent_count + 2) * sizeof(Extent));
+    if (!out)
+        return NULL;
+
+    size_t n = 0;
+    for (size_t i = 0; i < file->extent_count; i++)
+    {
+        Extent pieces[3];
+        size_t piece_count = 0;
+        const Extent *ext = &file->extents[i];
+        if (i != e)
+            pieces[piece_count++] = *ext;
+        else
+        {
+            if (offset > 0)
+                pieces[piece_count++] = (Extent){ext->start, offset};
+            pieces[piece_count++] = (Extent){dst, count};
+            if (offset + count < ext->length)
+                pieces[piece_count++] = (Extent){ext->start + offset + count, ext->length - offset - count};
+        }
+
+        for (size_t p = 0; p < piece_count; p++)
+        {
+            if (n > 0 && out[n - 1].start + out[n - 1].length == pieces[p].start)
+                out[n - 1].length += pieces[p].length;
+            else
+                out[n++] = pieces[p];
+        }
+    }
+    *new_count = n;
+    return out;
+}
+
+// move `count` blocks of extent `e` (starting `offset` blocks in) to `dst`
+static int moveFileBlocks(FileSystem *fs, Inode *file, size_t e, size_t offset, size_t count, size_t dst)
+{
+    size_t src = file->extents[e].start + offset;
+    size_t new_count = 0;
+    Extent *remapped = remapExtents(file, e, offset, count, dst, &new_count);
+    if (!remapped)
+        return -1;
+
+    Extent target = {dst, count};
+    journalBeforeReuse(fs, &target, 1);
+    memcpy(fs->data_blocks + dst * BLOCK_SIZE, fs->data_blocks + src * BLOCK_SIZE, count * BLOCK_SIZE);
+    freeIndexTakeRange(fs->free_extents, dst, count);
+    bitmapSetRange(fs->block_bitmap, dst, count);
+    bitmapClearRange(fs->block_bitmap, src, count);
+    freeIndexInsert(fs->free_extents, src, count);
+    journalNoteFree(fs, src, count);
+    dedupMoved(fs, src, dst, count);
+    dirtyMarkData(fs, dst, count);
+    dirtyMarkBitmap(fs, dst, count);
+    dirtyMarkBitmap(fs, src, count);
+    dirtyMarkTree(fs);
+
+    free(file->extents);
+    file->extents = remapped;
+    file->extent_count = new_count;
+    journalLogData(fs, file);
+    return 0;
+}
+
+static size_t minSize(size_t a, size_t b)
+{
+    return a < b ? a : b;
+}
+
+static size_t pullStep(FileSystem *fs, FileList *files, size_t budget)
+{
+    for (size_t i = 0; i < files->count; i++)
+    {
+        Inode *file = files->items[i];
+        if (file->extent_count < 2)
+            continue;
+
+        size_t end = file->extents[0].start + file->extents[0].length;
+        if (end >= fs->block_count || bitmapTest(fs->block_bitmap, end))
+            continue;
+        size_t free_after = bitmapNextSet(fs->block_bitmap, fs->block_count, end) - end;
+        if (free_after < file->block_count - file->extents[0].length)
+            continue;
+
+        size_t count = minSize(budget, minSize(file->extents[1].length, free_after));
+        if (moveFileBlocks(fs, file, 1, 0, count, end) != 0)
+            return 0;
+        return count;
+    }
+    return 0;
+}
+
+static size_t slideStep(FileSystem *fs, FileList *files, size_t budget)
+{
+    size_t pos = 0;
+    size_t gap, gap_length;
+    while (bitmapNextFreeRun(fs->block_bitmap, fs->block_count, pos, &gap, &gap_length))
+    {
+        size_t next = gap + gap_length;
+        if (next >= fs->block_count)
+            return 0;
+
+        for (size_t i = 0; i < files->count; i++)
+        {
+            Inode *file = files->items[i];
+            for (size_t e = 0; e < file->extent_count; e++)
+            {
+                if (file->extents[e].start != next)
+                    continue;
+                size_t count = minSize(budget, minSize(gap_length, file->extents[e].length));
+                if (moveFileBlocks(fs, file, e, 0, count, gap) != 0)
+                    return 0;
+                return count;
+            }
+        }
+        // the blocks after this gap belong to no live file; try the next gap
+        pos = next;
+    }
+    return 0;
+}
+
+static size_t relocateStep(FileSystem *fs, FileList *files, size_t budget)
+{
+    for (size_t i = 0; i < files->count; i++)
+    {
+        Inode *file = files->items[i];
+        if (file->extent_count < 2)
+            continue;
+
+        size_t target, target_length;
+        if (!freeIndexBestFit(fs->free_extents, file->block_count, &target, &target_length))
+            continue;
+
+        size_t count = minSize(budget, file->extents[0].length);
+        if (moveFileBlocks(fs, file, 0, 0, count, target) != 0)
+            return 0;
+        return count;
+    }
+    return 0;
+}
+
+int defragment(FileSystem *fs, size_t max_blocks, size_t *moved)
+{
+    FileList files;
+    *moved = 0;
+    if (collectFiles(fs, &files) != 0)
+        return 0;
+
+    int more = 1;
+    while (*moved < max_blocks)
+    {
+        size_t budget = max_blocks - *moved;
+        size_t step = pullStep(fs, &files, budget);
+        if (step == 0)
+            step = slideStep(fs, &files, budget);
+        if (step == 0)
+            step = relocateStep(fs, &files, budget);
+        if (step == 0)
+        {
+            more = 0;
+            break;
+        }
+        *moved += step;
+    }
+
+    free(files.items);
+    return more;
+}
+
+void defrag(FileSystem *fs)
+{
+    size_t moved = 0;
+    int more = defragment(fs, DEFRAG_BLOCKS_PER_CALL, &moved);
+
+    size_t fragmented = 0;
+    FileList files;
+    if (collectFiles(fs, &files) == 0)
+    {
+        for (size_t i = 0; i < files.count; i++)
+            fragmented += files.items[i]->extent_count > 1;
+        free(files.items);
+    }
+
+    printf("Moved %zu blocks. Free extents: %zu, fragmented files: %zu.\n",
+           moved, freeIndexRunCount(fs->free_extents), fragmented);
+    if (more)
+        printf("Run 'defrag' again to continue.\n");
+    else
+        printf("Defragmentation complete.\n");
+}
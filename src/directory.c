@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include "directory.h"
+
+struct DirIndex
+{
+    size_t capacity; // power of two, kept at least twice the item count
+    size_t count;
+    Inode *slots[];
+};
+
+uint32_t nameHash(const char *name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void indexPut(DirIndex *index, Inode *item)
+{
+    size_t mask = index->capacity - 1;
+    size_t i = item->name_hash & mask;
+    while (index->slots[i])
+        i = (i + 1) & mask;
+    index->slots[i] = item;
+    index->count++;
+}
+
+static DirIndex *buildIndex(Inode *dir, size_t min_items)
+{
+    size_t capacity = 16;
+    while (capacity < min_items * 2)
+        capacity *= 2;
+
+    DirIndex *index = (DirIndex *)calloc(1, sizeof(DirIndex) + capacity * sizeof(Inode *));
+    if (!index)
+        return NULL;
+    index->capacity = capacity;
+    for (size_t i = 0; i < dir->directory_item_count; i++)
+        indexPut(index, dir->directory_items[i]);
+    return index;
+}
+
+static void indexRemove(DirIndex *index, Inode *item)
+{
+    size_t mask = index->capacity - 1;
+    size_t i = item->name_hash & mask;
+    while (index->slots[i] && index->slots[i] != item)
+        i = (i + 1) & mask;
+    if (!index->slots[i])
+        return;
+
+    // backward-shift deletion keeps probe chains intact without tombstones
+    size_t k = i;
+    for (;;)
+    {
+        k = (k + 1) & mask;
+        Inode *next = index->slots[k];
+        if (!next)
+            break;
+        size_t home = next->name_hash & mask;
+        if (((k - home) & mask) >= ((k - i) & mask))
+        {
+            index->slots[i] = next;
+            i = k;
+        }
+    }
+    index->slots[i] = NULL;
+    index->count--;
+}
+
+Inode *dirLookup(Inode *dir, const char *name)
+{
+    if (!dir->index && dir->directory_item_count >= DIR_INDEX_THRESHOLD)
+        dir->index = buildIndex(dir, dir->directory_item_count);
+
+    if (!dir->index)
+    {
+        for (size_t i = 0; i < dir->directory_item_count; i++)
+        {
+            if (strcmp(dir->directory_items[i]->name, name) == 0)
+                return dir->directory_items[i];
+        }
+        return NULL;
+    }
+
+    uint32_t hash = nameHash(name);
+    size_t mask = dir->index->capacity - 1;
+    for (size_t i = hash & mask; dir->index->slots[i]; i = (i + 1) & mask)
+    {
+        Inode *item = dir->index->slots[i];
+        if (item->name_hash == hash && strcmp(item->name, name) == 0)
+            return item;
+    }
+    return NULL;
+}
+
+static int growItems(Inode *dir, size_t needed)
+{
+    if (needed <= dir->directory_item_capacity)
+        return 0;
+    size_t capacity = dir->directory_item_capacity ? dir->directory_item_capacity : 4;
+    while (capacity < needed)
+        capacity *= 2;
+    Inode **items = (Inode **)realloc(dir->directory_items, capacity * sizeof(Inode *));
+    if (!items)
+        return -1;
+    dir->directory_items = items;
+    dir->directory_item_capacity = capacity;
+    return 0;
+}
+
+int dirReserve(Inode *dir, size_t extra)
+{
+    size_t needed = dir->directory_item_count + extra;
+    if (needed <= dir->directory_item_capacity)
+        return 0;
+    // exact size: the caller knows how many items are coming
+    Inode **items = (Inode **)realloc(dir->directory_items, needed * sizeof(Inode *));
+    if (!items)
+        return -1;
+    dir->directory_items = items;
+    dir->directory_item_capacity = needed;
+    return 0;
+}
+
+int dirAddItem(Inode *dir, Inode *item)
+{
+    if (growItems(dir, dir->directory_item_count + 1) != 0)
+        return -1;
+    item->dir_slot = dir->directory_item_count;
+    dir->directory_items[dir->directory_item_count++] = item;
+
+    if (dir->index)
+    {
+        if (dir->index->count + 1 > dir->index->capacity / 2)
+        {
+            // rebuild at double size; drop the index if that fails
+            DirIndex *grown = buildIndex(dir, dir->directory_item_count);
+            free(dir->index);
+            dir->index = grown;
+        }
+        else
+            indexPut(dir->index, item);
+    }
+    return 0;
+}
+
+int dirRemoveItem(Inode *dir, Inode *item)
+{
+    size_t slot = item->dir_slot;
+    if (slot >= dir->directory_item_count || dir->directory_items[slot] != item)
+        return -1;
+
+    Inode *last = dir->directory_items[--dir->directory_item_count];
+    dir->directory_items[slot] = last;
+    last->dir_slot = slot;
+
+    if (dir->index)
+        indexRemove(dir->index, item);
+    return 0;
+}
+
+void dirClearItems(Inode *dir)
+{
+    dirDropIndex(dir);
+    free(dir->directory_items);
+    dir->directory_items = NULL;
+    dir->directory_item_count = 0;
+    dir->directory_item_capacity = 0;
+}
+
+void dirDropIndex(Inode *dir)
+{
+    free(dir->index);
+    dir->index = NULL;
+}
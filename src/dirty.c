@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dirty.h"
+#include "block_bitmap.h"
+
+int dirtyInit(FileSystem *fs)
+{
+    fs->dirty_blocks = bitmapCreate(fs->block_count);
+    fs->dirty_bitmap_words = bitmapCreate(bitmapWordCount(fs->block_count));
+    fs->tree_dirty = 1;
+    return fs->dirty_blocks && fs->dirty_bitmap_words ? 0 : -1;
+}
+
+void dirtyDestroy(FileSystem *fs)
+{
+    free(fs->dirty_blocks);
+    free(fs->dirty_bitmap_words);
+    fs->dirty_blocks = NULL;
+    fs->dirty_bitmap_words = NULL;
+}
+
+void dirtyMarkData(FileSystem *fs, size_t start, size_t count)
+{
+    if (fs->dirty_blocks && count > 0)
+        bitmapSetRange(fs->dirty_blocks, start, count);
+}
+
+void dirtyMarkBitmap(FileSystem *fs, size_t start, size_t count)
+{
+    if (fs->dirty_bitmap_words && count > 0)
+    {
+        size_t first = start / BITMAP_WORD_BITS;
+        size_t last = (start + count - 1) / BITMAP_WORD_BITS;
+        bitmapSetRange(fs->dirty_bitmap_words, first, last - first + 1);
+    }
+}
+
+void dirtyMarkTree(FileSystem *fs)
+{
+    fs->tree_dirty = 1;
+}
+
+size_t dirtyBlockCount(const FileSystem *fs)
+{
+    if (!fs->dirty_blocks)
+        return fs->block_count;
+    return bitmapCountSet(fs->dirty_blocks, fs->block_count);
+}
+
+int dirtyMetaPending(const FileSystem *fs)
+{
+    size_t words = bitmapWordCount(fs->block_count);
+    return fs->tree_dirty || !fs->dirty_bitmap_words || bitmapNextSet(fs->dirty_bitmap_words, words, 0) < words ||
+           !fs->dirty_blocks || bitmapNextSet(fs->dirty_blocks, fs->block_count, 0) < fs->block_count;
+}
+
+void dirtyClearData(FileSystem *fs)
+{
+    if (fs->dirty_blocks)
+        memset(fs->dirty_blocks, 0, bitmapWordCount(fs->block_count) * sizeof(uint64_t));
+}
+
+void dirtyClear(FileSystem *fs)
+{
+    dirtyClearData(fs);
+    if (fs->dirty_bitmap_words)
+        memset(fs->dirty_bitmap_words, 0, bitmapWordCount(bitmapWordCount(fs->block_count)) * sizeof(uint64_t));
+    fs->tree_dirty = 0;
+}
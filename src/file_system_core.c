@@ -1,41 +1,74 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "file_system.h"
+#include "block_alloc.h"
+#include "block_bitmap.h"
+#include "free_extent.h"
+#include "inode_table.h"
+#include "directory.h"
+#include "path.h"
+#include "reclaim.h"
+#include "host_io.h"
+#include "image_format.h"
+#include "dirty.h"
+#include "journal.h"
+#include "image_crypt.h"
+#include "dedup.h"
+#include "snapshot.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0 // only Windows distinguishes text and binary opens
+#endif
 
 FileSystem *createFileSystem(size_t size)
 {
-    FileSystem *fs = (FileSystem *)malloc(sizeof(FileSystem));
+    FileSystem *fs = (FileSystem *)calloc(1, sizeof(FileSystem));
     if (!fs)
         return NULL;
     fs->partition_size = size;
     fs->block_count = size / BLOCK_SIZE;
     fs->block_used = 0;
     fs->data_blocks = (char *)malloc(fs->block_count * BLOCK_SIZE);
-    fs->block_bitmap = (int *)calloc(fs->block_count, sizeof(int));
-    fs->inode_count = size / INODE_PER_PARTITION;
-    fs->inode_used = 1;
-    fs->inodes = (Inode **)calloc(fs->inode_count, sizeof(Inode *));
-
-    // initialize root directory
-    Inode *root = (Inode *)malloc(sizeof(Inode));
-    root->name = strdup("/");
-    root->is_directory = 1;
-    root->file_size = 0;
-    root->start_block = -1;
-    root->block_count = 0;
-    root->parent = NULL;
-    root->directory_items = NULL;
-    root->directory_item_count = 0;
+    fs->block_bitmap = bitmapCreate(fs->block_count);
+    fs->block_crc = (uint32_t *)calloc(fs->block_count ? fs->block_count : 1, sizeof(uint32_t));
+    fs->free_extents = freeIndexCreate();
+    freeIndexBuild(fs->free_extents, fs->block_bitmap, fs->block_count);
+    inodeTableInit(fs, size / INODE_PER_PARTITION);
+    dirtyInit(fs);
+    dedupInit(fs);
+
+    // initialize root directory (inode 0)
+    Inode *root = newInode(fs, "/", 1, NULL);
 
     fs->root = root;
-    fs->inodes[0] = root;
     fs->current_directory = root;
     return fs;
 }
 
+void freeFileSystem(FileSystem *fs)
+{
+    if (!fs)
+        return;
+    journalClose(fs);
+    dcacheDestroy(fs);
+    reclaimDestroy(fs);
+    dirtyDestroy(fs);
+    dedupDestroy(fs);
+    inodeTableDestroy(fs);
+    freeIndexDestroy(fs->free_extents);
+    free(fs->block_bitmap);
+    free(fs->block_crc);
+    cryptDestroy(fs->crypt);
+    imageReleaseData(fs);
+    free(fs);
+}
+
 void printCurrentPath(Inode *current)
 {
     if (current->parent == NULL)
@@ -56,6 +89,54 @@ void status(FileSystem *fs)
     printf("used blocks: %zu \n", fs->block_used);
     printf("block size: %zu \n", BLOCK_SIZE);
     printf("free space: %zu \n", fs->partition_size - fs->block_used * BLOCK_SIZE);
+
+    size_t pending_inodes, pending_blocks;
+    reclaimPending(fs, &pending_inodes, &pending_blocks);
+    if (pending_inodes > 0)
+        printf("pending reclaim: %zu inodes, %zu blocks\n", pending_inodes, pending_blocks);
+
+    // fragmentation of the free space
+    size_t largest_start = 0, largest_length = 0;
+    freeIndexLargest(fs->free_extents, &largest_start, &largest_length);
+    printf("free extents: %zu (largest: %zu blocks)\n", freeIndexRunCount(fs->free_extents), largest_length);
+
+    size_t histogram[FREE_HISTOGRAM_BUCKETS];
+    freeIndexHistogram(fs->free_extents, histogram);
+    for (int i = 0; i < FREE_HISTOGRAM_BUCKETS; i++)
+    {
+        if (histogram[i] == 0)
+            continue;
+        size_t low = (size_t)1 << i;
+        size_t high = (low << 1) - 1;
+        if (low == high)
+            printf("  %zu block: %zu\n", low, histogram[i]);
+        else
+            printf("  %zu-%zu blocks: %zu\n", low, high, histogram[i]);
+    }
+
+    // blocks shared by identical contents
+    size_t shared, prints, print_bytes;
+    dedupStats(fs, &shared, &prints, &print_bytes);
+    printf("dedup ratio: %.2f (%zu block references to %zu blocks)\n",
+           fs->block_used ? (double)(fs->block_used + shared) / fs->block_used : 1.0, fs->block_used + shared, fs->block_used);
+    printf("fingerprint table: %zu entries, %zu bytes\n", prints, print_bytes);
+
+    size_t hits, misses;
+    dcacheStats(fs, &hits, &misses);
+    printf("dentry cache: %zu hits, %zu misses\n", hits, misses);
+
+    if (fs->image_attached)
+    {
+        uint64_t journal_bytes, commits;
+        journalStats(fs, &journal_bytes, &commits);
+        printf("unsaved: %zu blocks%s\n", dirtyBlockCount(fs), fs->tree_dirty ? ", inode tree" : "");
+        printf("journal: %llu bytes since the last checkpoint, %llu commits\n",
+               (unsigned long long)journal_bytes, (unsigned long long)commits);
+    }
+    else
+        printf("unsaved: no image yet\n");
+    if (fs->crypt && !fs->crypt->encrypted)
+        printf("image: plain, the data region is not encrypted%s\n", IMAGE_ENCRYPT ? " (exit encrypts it)" : "");
 }
 
 void ls(FileSystem *fs)
@@ -87,329 +168,317 @@ void ls(FileSystem *fs)
 
 void cd(FileSystem *fs, const char *path)
 {
-    if (strcmp(path, "..") == 0)
+    Inode *target = resolvePath(fs, path);
+    if (target && target->is_directory)
     {
-        if (fs->current_directory->parent)
-            fs->current_directory = fs->current_directory->parent;
+        // ls lists the items of the current directory itself
+        if (snapshotOpen(fs, target) == 0)
+            fs->current_directory = target;
         return;
     }
-    // search for the target directory
-    for (size_t i = 0; i < fs->current_directory->directory_item_count; i++)
-    {
-        if (strcmp(fs->current_directory->directory_items[i]->name, path) == 0 && fs->current_directory->directory_items[i]->is_directory)
-        {
-            fs->current_directory = fs->current_directory->directory_items[i];
-            return;
-        }
-    }
     printf("Directory not found.\n");
 }
 
 void my_mkdir(FileSystem *fs, const char *dirname)
 {
-    for (size_t i = 0; i < fs->current_directory->directory_item_count; ++i)
+    char name[MAX_NAME_LENGTH];
+    Inode *parent = resolveParent(fs, dirname, name);
+    if (!parent)
     {
-        Inode *inode = fs->current_directory->directory_items[i];
-        if (inode->is_directory && strcmp(inode->name, dirname) == 0)
-        {
-            printf("Directory '%s' already exists.\n", dirname);
-            return;
-        }
+        printf("Invalid path '%s'.\n", dirname);
+        return;
     }
-
-    Inode *new_dir = (Inode *)malloc(sizeof(Inode));
-    new_dir->name = strdup(dirname);
-    new_dir->is_directory = 1;
-    new_dir->file_size = 0;
-    new_dir->start_block = -1;
-    new_dir->block_count = 0;
-    new_dir->parent = fs->current_directory;
-    new_dir->directory_items = NULL;
-    new_dir->directory_item_count = 0;
-    
-    fs->inodes[fs->inode_used] = new_dir;
-    fs->inode_used++;
-    fs->block_used++;
-
-    if (fs->current_directory->is_directory)
+    if (inSnapshots(fs, parent, name))
     {
-        fs->current_directory->directory_item_count++;
-        fs->current_directory->directory_items = realloc(fs->current_directory->directory_items, fs->current_directory->directory_item_count * sizeof(Inode *));
-        fs->current_directory->directory_items[fs->current_directory->directory_item_count - 1] = new_dir;
+        printf("Cannot create '%s': snapshots are read-only.\n", dirname);
+        return;
     }
-}
-
 
-void deleteSubInodes(FileSystem *fs, Inode *inode) {
-    if (!inode) return;
-
-    for (size_t i = 0; i < inode->directory_item_count; i++) {
-        Inode *child = inode->directory_items[i];
-        if (!child) continue;
-
-        // 1. 如果是目錄，先遞迴進去刪除子項目
-        if (child->is_directory) {
-            deleteSubInodes(fs, child);
-        } else {
-            // 2. 如果是檔案，回收磁碟區塊 (這部分是 BMC 工程師最看重的)
-            if (child->start_block != -1) {
-                for (size_t j = 0; j < child->block_count; j++) {
-                    int block_index = child->start_block + j; // 修正：應使用 j
-                    if (block_index < (int)fs->block_count) {
-                        fs->block_bitmap[block_index] = 0;
-                    }
-                }
-                fs->block_used -= child->block_count;
-            }
-        }
-
-        // 3. 更新全局 Inode 使用量與清理索引陣列
-        fs->inode_used--;
-        for (size_t k = 0; k < fs->inode_count; k++) {
-            if (fs->inodes[k] == child) {
-                fs->inodes[k] = NULL;
-                break;
-            }
-        }
+    Inode *existing = dirLookup(parent, name);
+    if (existing)
+    {
+        if (existing->is_directory)
+            printf("Directory '%s' already exists.\n", dirname);
+        else
+            printf("File or directory with name '%s' already exists.\n", dirname);
+        return;
+    }
+    if (snapshotUnshare(fs, parent) != 0)
+        return;
 
-        // 4. 釋放 RAM 資源
-        free(child->name);
-        free(child);
+    Inode *new_dir = newInode(fs, name, 1, parent);
+    if (!new_dir)
+    {
+        printf("No available inodes. Directory creation failed.\n");
+        return;
     }
 
-    // 5. 釋放當前目錄的項目指標陣列
-    free(inode->directory_items);
-    inode->directory_items = NULL;
-    inode->directory_item_count = 0;
+    if (dirAddItem(parent, new_dir) != 0)
+    {
+        printf("Failed to expand directory items array.\n");
+        releaseInode(fs, new_dir);
+        return;
+    }
+    journalLogCreate(fs, new_dir);
 }
 
+
 void my_rmdir(FileSystem *fs, const char *dirname)
 {
-    Inode *target = NULL;
-    size_t target_index = 0;
-
-    for (size_t i = 0; i < fs->current_directory->directory_item_count; i++)
+    Inode *target = resolvePath(fs, dirname);
+    if (!target || !target->is_directory)
     {
-        Inode *item = fs->current_directory->directory_items[i];
-        if (strcmp(item->name, dirname) == 0 && item->is_directory)
-        {
-            target = item;
-            target_index = i;
-            break;
-        }
+        printf("Directory '%s' not found.\n", dirname);
+        return;
     }
-    if (!target)
+    // also refuses the root, which is an ancestor of every directory
+    if (isAncestor(target, fs->current_directory))
     {
-        printf("Directory '%s' not found.\n", dirname);
+        printf("Cannot remove '%s': it contains the current directory.\n", dirname);
         return;
     }
-
-    deleteSubInodes(fs, target);
-
-    for (size_t i = target_index; i < fs->current_directory->directory_item_count - 1; i++)
+    // a whole snapshot may go, and /SNAPSHOT_DIR once it is empty, but
+    // nothing inside a snapshot
+    Inode *parent = target->parent;
+    int removable = parent == fs->root ? target->directory_item_count == 0 : parent->parent == fs->root;
+    if (inSnapshots(fs, target, NULL) && !removable)
     {
-        fs->current_directory->directory_items[i] = fs->current_directory->directory_items[i + 1];
+        printf("Cannot remove '%s': snapshots are read-only.\n", dirname);
+        return;
     }
-    fs->current_directory->directory_item_count--;
 
-    fs->inode_used--;
-    for (size_t i = 0; i < fs->inode_count; i++)
+    if (snapshotUnshare(fs, parent) != 0)
+        return;
+
+    // unlink now; the subtree is freed a bounded amount per command
+    journalLogRemove(fs, target);
+    if (reclaimDetach(fs, target) != 0)
     {
-        if (fs->inodes[i] == target)
-        {
-            fs->inodes[i] = NULL;
-            break;
-        }
+        printf("Failed to queue '%s' for removal.\n", dirname);
+        return;
     }
-
-    free(target->name);
-    free(target);
+    dirRemoveItem(parent, target);
+    dirtyMarkTree(fs);
+    dcacheInvalidate(fs);
 
     printf("Directory '%s' and its contents have been removed.\n", dirname);
 }
 
 void touch(FileSystem *fs, const char *fileName)
 {
-    // Check if a file with the same name already exists
-    for (size_t i = 0; i < fs->current_directory->directory_item_count; i++)
+    char name[MAX_NAME_LENGTH];
+    Inode *parent = resolveParent(fs, fileName, name);
+    if (!parent)
     {
-        if (strcmp(fs->current_directory->directory_items[i]->name, fileName) == 0)
-        {
-            printf("File or directory with name '%s' already exists.\n", fileName);
-            return;
-        }
+        printf("Invalid path '%s'.\n", fileName);
+        return;
+    }
+    if (inSnapshots(fs, parent, name))
+    {
+        printf("Cannot create '%s': snapshots are read-only.\n", fileName);
+        return;
     }
 
-    // Check if there are free inodes available
-    if (fs->inode_used >= fs->inode_count)
+    // Check if a file with the same name already exists
+    if (dirLookup(parent, name))
     {
-        printf("No available inodes. File creation failed.\n");
+        printf("File or directory with name '%s' already exists.\n", fileName);
         return;
     }
+    if (snapshotUnshare(fs, parent) != 0)
+        return;
 
-    // Allocate a new inode
-    Inode *newFile = (Inode *)malloc(sizeof(Inode));
+    // Allocate a new inode (empty file, no blocks yet)
+    Inode *newFile = newInode(fs, name, 0, parent);
     if (!newFile)
     {
-        printf("Memory allocation failed for new file.\n");
+        printf("No available inodes. File creation failed.\n");
         return;
     }
 
-    // Initialize the inode properties
-    newFile->name = strdup(fileName); // Duplicate the file name
-    newFile->is_directory = 0;        // It is a file
-    newFile->file_size = 0;           // Initial size is 0
-    newFile->start_block = -1;        // No block allocated yet
-    newFile->block_count = 0;         // No blocks used
-    newFile->directory_item_count = 0;
-    newFile->directory_items = NULL; // Not a directory
-    newFile->parent = fs->current_directory;
-
-    // Add the new file to the current directory's directory_items array
-    size_t newItemCount = fs->current_directory->directory_item_count + 1;
-    fs->current_directory->directory_items = (Inode **)realloc(
-        fs->current_directory->directory_items, newItemCount * sizeof(Inode *));
-    if (!fs->current_directory->directory_items)
+    // Add the new file to the parent directory's directory_items array
+    if (dirAddItem(parent, newFile) != 0)
     {
         printf("Failed to expand directory items array.\n");
-        free(newFile->name);
-        free(newFile);
+        releaseInode(fs, newFile);
         return;
     }
+    journalLogCreate(fs, newFile);
+    journalLogData(fs, newFile);
+
+    printf("File '%s' created successfully.\n", fileName);
+}
 
-    fs->current_directory->directory_items[fs->current_directory->directory_item_count] = newFile;
-    fs->current_directory->directory_item_count = newItemCount;
+// blocks reserved per round for sources of unknown size, doubling up to the max
+#define PUT_STREAM_MIN_BLOCKS 64
+#define PUT_STREAM_MAX_BLOCKS 16384
 
-    // Add the new inode to the global inodes array
-    for (size_t i = 0; i < fs->inode_count; i++)
+// Append blocks to the extent list of `file`, extending the last extent when adjacent.
+static int appendExtent(Inode *file, size_t start, size_t length)
+{
+    if (file->extent_count > 0)
     {
-        if (!fs->inodes[i]) // Find a free slot
+        Extent *last = &file->extents[file->extent_count - 1];
+        if (last->start + last->length == start)
         {
-            fs->inodes[i] = newFile;
-            break;
+            last->length += length;
+            file->block_count += length;
+            return 0;
         }
     }
-
-    // Update filesystem metadata
-    fs->inode_used++;
-
-    printf("File '%s' created successfully.\n", fileName);
+    Extent *grown = (Extent *)realloc(file->extents, (file->extent_count + 1) * sizeof(Extent));
+    if (!grown)
+        return -1;
+    file->extents = grown;
+    file->extents[file->extent_count++] = (Extent){start, length};
+    file->block_count += length;
+    return 0;
 }
 
-void put(FileSystem *fs, const char *filename)
+// Read the host file straight into newly allocated blocks of `file`. With a
+// known size the blocks are reserved up front and each extent is filled by
+// one read(); pipes and other unsized sources reserve growing chunks until
+// end of input and give back what they did not use. Returns -1 when space
+// runs out and -2 on a read error; blocks already attached to `file` stay
+// attached for the caller to free.
+static int readIntoBlocks(FileSystem *fs, int fd, Inode *file, int size_known, size_t size)
 {
-    FILE *file = fopen(filename, "rb");
-    if (!file)
-    {
-        printf("Failed to open file '%s'.\n", filename);
-        return;
-    }
-
-    // determine the number of blocks required
-    fseek(file, 0, SEEK_END);
-    size_t content_size = ftell(file);
-    rewind(file);
+    size_t chunk = size_known ? (size + BLOCK_SIZE - 1) / BLOCK_SIZE : PUT_STREAM_MIN_BLOCKS;
+    int eof = chunk == 0;
+    while (!eof)
+    {
+        Extent *extents = NULL;
+        size_t extent_count = 0;
+        size_t want = chunk;
+        while (allocateBlocks(fs, want, &extents, &extent_count) != 0)
+        {
+            if (size_known || want == 1)
+                return -1;
+            want /= 2;
+        }
 
-    size_t required_blocks = (content_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    int start_block = -1;
-    size_t consecutive_blocks = 0;
-    for (size_t i = 0; i < fs->block_count; i++)
-    {
-        if (fs->block_bitmap[i] == 0)
+        for (size_t e = 0; e < extent_count; e++)
         {
-            if (consecutive_blocks == 0)
+            Extent ext = extents[e];
+            char *dst = fs->data_blocks + ext.start * BLOCK_SIZE;
+            dirtyMarkData(fs, ext.start, ext.length);
+            size_t capacity = ext.length * BLOCK_SIZE;
+            size_t bytes = capacity;
+            if (size_known && bytes > size - file->file_size)
+                bytes = size - file->file_size;
+
+            ssize_t n = eof ? 0 : readFull(fd, dst, bytes);
+            if (n < 0 || (n > 0 && appendExtent(file, ext.start, ((size_t)n + BLOCK_SIZE - 1) / BLOCK_SIZE) != 0))
             {
-                start_block = i;
+                freeExtents(fs, extents + e, extent_count - e);
+                free(extents);
+                return n < 0 ? -2 : -1;
             }
-            consecutive_blocks++;
-        }
-        else
-        {
-            consecutive_blocks = 0;
-            start_block = -1;
-        }
+            file->file_size += (size_t)n;
 
-        if (consecutive_blocks == required_blocks)
-        {
-            break;
+            // zero the slack of the last block and return the unused blocks
+            size_t used = ((size_t)n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if ((size_t)n % BLOCK_SIZE)
+                memset(dst + n, 0, BLOCK_SIZE - (size_t)n % BLOCK_SIZE);
+            if (used < ext.length)
+            {
+                Extent rest = {ext.start + used, ext.length - used};
+                freeExtents(fs, &rest, 1);
+            }
+            if ((size_t)n < capacity)
+                eof = 1;
         }
+        free(extents);
+
+        if (size_known)
+            eof = 1;
+        else if (chunk < PUT_STREAM_MAX_BLOCKS)
+            chunk *= 2;
     }
-    if (consecutive_blocks < required_blocks)
+    return 0;
+}
+
+void put(FileSystem *fs, const char *filename)
+{
+    // the file is stored in the current directory under its base name
+    const char *name = filename;
+    for (const char *p = filename; *p; p++)
     {
-        fclose(file);
-        printf("not enough consecutive blocks\n");
-        return;
+        if (*p == '/' || *p == '\\')
+            name = p + 1;
     }
-
-    // allocate valid inode
-    int inode_index = -1;
-    for (size_t i = 0; i < fs->inode_count; i++)
+    if (!*name || strlen(name) >= MAX_NAME_LENGTH)
     {
-        if (!fs->inodes[i])
-        {
-            inode_index = i;
-            break;
-        }
+        printf("Invalid file name '%s'.\n", filename);
+        return;
     }
-    if (inode_index == -1)
+    if (inSnapshots(fs, fs->current_directory, name))
     {
-        fclose(file);
-        printf("Not enough space to store the file.\n");
+        printf("Cannot store '%s': snapshots are read-only.\n", name);
         return;
     }
 
-    // write file content to data blocks
-    char buffer[BLOCK_SIZE];
-    size_t remaining_size = content_size;
-    for (size_t i = 0; i < required_blocks; i++)
+    if (dirLookup(fs->current_directory, name))
     {
-        size_t block_offset = start_block + i;
-        size_t read_size = (remaining_size > BLOCK_SIZE) ? BLOCK_SIZE : remaining_size;
+        printf("File or directory with name '%s' already exists.\n", name);
+        return;
+    }
+    if (snapshotUnshare(fs, fs->current_directory) != 0)
+        return;
 
-        fread(buffer, 1, read_size, file);
-        memcpy(fs->data_blocks + (block_offset * BLOCK_SIZE), buffer, read_size);
-        remaining_size -= read_size;
-        fs->block_bitmap[block_offset] = 1;
+    int fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+    {
+        printf("Failed to open file '%s'.\n", filename);
+        return;
     }
 
-    fclose(file);
+    // regular files are sized up front; pipes and devices are streamed
+    struct stat st;
+    int size_known = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    size_t content_size = size_known ? (size_t)st.st_size : 0;
 
-    // create new inode and add it to the current directory
-    Inode *new_inode = (Inode *)malloc(sizeof(Inode));
-    new_inode->name = strdup(filename);
-    new_inode->is_directory = 0;
-    new_inode->file_size = content_size;
-    new_inode->start_block = start_block;
-    new_inode->block_count = required_blocks;
-    new_inode->directory_items = NULL;
-    new_inode->directory_item_count = 0;
+    // allocate valid inode
+    Inode *new_inode = newInode(fs, name, 0, fs->current_directory);
+    if (!new_inode)
+    {
+        close(fd);
+        printf("Not enough space to store the file.\n");
+        return;
+    }
 
-    fs->inodes[inode_index] = new_inode;
-    fs->inode_used++;
-    fs->block_used += required_blocks;
+    // blocks may be split over several extents if the partition is fragmented
+    dedupPrepare(fs);
+    int result = readIntoBlocks(fs, fd, new_inode, size_known, content_size);
+    close(fd);
+    if (result != 0)
+    {
+        freeExtents(fs, new_inode->extents, new_inode->extent_count);
+        releaseInode(fs, new_inode);
+        if (result == -2)
+            printf("Failed to read file '%s'.\n", filename);
+        else
+            printf("not enough free blocks\n");
+        return;
+    }
+    // blocks whose contents are stored already are shared instead
+    dedupFile(fs, new_inode, NULL);
 
-    if (fs->current_directory->is_directory)
+    if (dirAddItem(fs->current_directory, new_inode) != 0)
     {
-        fs->current_directory->directory_item_count++;
-        fs->current_directory->directory_items = realloc(
-            fs->current_directory->directory_items,
-            fs->current_directory->directory_item_count * sizeof(Inode *));
-        fs->current_directory->directory_items[fs->current_directory->directory_item_count - 1] = new_inode;
+        printf("Failed to expand directory items array.\n");
+        freeExtents(fs, new_inode->extents, new_inode->extent_count);
+        releaseInode(fs, new_inode);
+        return;
     }
+    journalLogCreate(fs, new_inode);
+    journalLogData(fs, new_inode);
 }
 
 void cat(FileSystem *fs, const char *filename)
 {
     // determine the inode of the file
-    Inode *inode = NULL;
-    for (size_t i = 0; i < fs->current_directory->directory_item_count; i++)
-    {
-        if (strcmp(fs->current_directory->directory_items[i]->name, filename) == 0)
-        {
-            inode = fs->current_directory->directory_items[i];
-            break;
-        }
-    }
+    Inode *inode = resolvePath(fs, filename);
     if (inode == NULL)
     {
         printf("File not found: %s\n", filename);
@@ -423,90 +492,63 @@ void cat(FileSystem *fs, const char *filename)
         return;
     }
 
-    // print the content of the file, read data from data blocks
-    // size_t bytes_read = 0;
-    size_t remaining_size = inode->file_size;
-    size_t block_index = inode->start_block;
-
-    while (remaining_size > 0)
-    {
-        size_t block_size = remaining_size > BLOCK_SIZE ? BLOCK_SIZE : remaining_size;
-        printf("%.*s", (int)block_size, &fs->data_blocks[block_index * BLOCK_SIZE]);
-
-        remaining_size -= block_size;
-        block_index++;
-    }
+    // send the raw bytes to stdout in one writev, behind anything printf buffered
+    fflush(stdout);
+    int result = writeFileData(fs, inode, STDOUT_FILENO);
+    if (result == -2)
+        printf("File '%s' is corrupt: a block failed its checksum.", filename);
+    else if (result != 0)
+        printf("Failed to write '%s' to stdout.", filename);
     printf("\n");
 }
 
 void get(FileSystem *fs, const char *filename)
 {
-    Inode *target_file = NULL;
-    for (size_t i = 0; i < fs->current_directory->directory_item_count; ++i)
+    Inode *target_file = resolvePath(fs, filename);
+    if (!target_file || target_file->is_directory)
     {
-        Inode *inode = fs->current_directory->directory_items[i];
-        if (!inode->is_directory && strcmp(inode->name, filename) == 0)
-        {
-            target_file = inode;
-            break;
-        }
-    }
-    if (!target_file)
-    {
-        printf("File '%s' not found in the current directory.\n", filename);
+        printf("File '%s' not found.\n", filename);
         return;
     }
 
     // 檢查或建立 dump 資料夾
-    struct stat st = {0};
-    if (stat("dump", &st) == -1)
+    if (hostMakeDir("dump") != 0)
     {
-        if (mkdir("dump") != 0)
-        {
-            printf("Failed to create 'dump' directory.\n");
-            return;
-        }
+        printf("Failed to create 'dump' directory.\n");
+        return;
     }
 
     char filepath[MAX_COMMAND_LENGTH];
-    snprintf(filepath, sizeof(filepath), "dump/%s", filename);
+    snprintf(filepath, sizeof(filepath), "dump/%s", target_file->name);
 
-    FILE *file = fopen(filepath, "w");
-    if (!file)
+    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0)
     {
         printf("Failed to create file '%s' in dump folder.\n", filepath);
         return;
     }
 
-    // from data blocks write to file
-    for (size_t i = 0; i < target_file->block_count; ++i)
+    // the extents go out in a single writev
+    int result = writeFileData(fs, target_file, fd);
+    if (result == -2)
+    {
+        close(fd);
+        remove(filepath);
+        printf("File '%s' is corrupt: a block failed its checksum.\n", filename);
+        return;
+    }
+    if (close(fd) != 0 || result != 0)
     {
-        int block_index = target_file->start_block + i;
-        char *block_data = fs->data_blocks + block_index * BLOCK_SIZE;
-        size_t write_size = (i == target_file->block_count - 1)
-                                ? target_file->file_size % BLOCK_SIZE
-                                : BLOCK_SIZE;
-        fwrite(block_data, 1, write_size, file);
+        printf("Failed to write '%s'.\n", filepath);
+        return;
     }
-
-    fclose(file);
-    printf("File '%s' has been saved to 'dump/%s'.\n", filename, filename);
+    printf("File '%s' has been saved to '%s'.\n", filename, filepath);
 }
 
 void rm(FileSystem *fs, const char *filename)
 {
     // check if the file exists
-    Inode *inode_to_delete = NULL;
-    size_t inode_index = -1;
-    for (size_t i = 0; i < fs->current_directory->directory_item_count; i++)
-    {
-        if (strcmp(fs->current_directory->directory_items[i]->name, filename) == 0)
-        {
-            inode_to_delete = fs->current_directory->directory_items[i];
-            inode_index = i;
-            break;
-        }
-    }
+    Inode *inode_to_delete = resolvePath(fs, filename);
     if (inode_to_delete == NULL)
     {
         printf("File not found: %s\n", filename);
@@ -519,26 +561,73 @@ void rm(FileSystem *fs, const char *filename)
         printf("%s is a directory, use rmdir to remove directories.\n", filename);
         return;
     }
-
-    // clear the data blocks(block_bitmap)
-    for (size_t i = 0; i < inode_to_delete->block_count; i++)
+    if (inSnapshots(fs, inode_to_delete, NULL))
     {
-        size_t block_index = inode_to_delete->start_block + i;
-        fs->block_bitmap[block_index] = 0;
+        printf("Cannot remove '%s': snapshots are read-only.\n", filename);
+        return;
     }
+    if (snapshotUnshare(fs, inode_to_delete->parent) != 0)
+        return;
 
-    fs->block_used -= inode_to_delete->block_count;
-    free(inode_to_delete->name);
-    free(inode_to_delete);
-    fs->inodes[inode_index] = NULL;
+    // release the data blocks (shared ones lose a reference)
+    journalLogRemove(fs, inode_to_delete);
+    freeExtents(fs, inode_to_delete->extents, inode_to_delete->extent_count);
+    dirRemoveItem(inode_to_delete->parent, inode_to_delete);
+    releaseInode(fs, inode_to_delete);
 
-    for (size_t i = inode_index; i < fs->current_directory->directory_item_count - 1; i++)
+    printf("File %s has been deleted.\n", filename);
+}
+
+void mv(FileSystem *fs, const char *source, const char *destination)
+{
+    Inode *inode = resolvePath(fs, source);
+    if (!inode)
     {
-        fs->current_directory->directory_items[i] = fs->current_directory->directory_items[i + 1];
+        printf("File or directory '%s' not found.\n", source);
+        return;
+    }
+    if (!inode->parent)
+    {
+        printf("Cannot move the root directory.\n");
+        return;
     }
 
-    fs->current_directory->directory_item_count--;
-    fs->inode_used--;
+    // into an existing directory under the same name, or as the named path
+    char name[MAX_NAME_LENGTH];
+    Inode *parent = resolveDestination(fs, destination, inode->name, name);
+    if (!parent)
+    {
+        printf("Invalid path '%s'.\n", destination);
+        return;
+    }
+    if (parent == inode->parent && strcmp(name, inode->name) == 0)
+        return;
+    if (inSnapshots(fs, inode, NULL) || inSnapshots(fs, parent, name))
+    {
+        printf("Cannot move '%s' to '%s': snapshots are read-only.\n", source, destination);
+        return;
+    }
+    if (dirLookup(parent, name))
+    {
+        printf("File or directory with name '%s' already exists.\n", name);
+        return;
+    }
+    if (isAncestor(inode, parent))
+    {
+        printf("Cannot move '%s' into itself.\n", source);
+        return;
+    }
+    if (snapshotUnshare(fs, inode->parent) != 0 || snapshotUnshare(fs, parent) != 0)
+        return;
 
-    printf("File %s has been deleted.\n", filename);
+    // only the directory entries change; the data blocks stay put
+    if (moveInode(fs, inode, parent, name) != 0)
+    {
+        printf("Failed to expand directory items array.\n");
+        return;
+    }
+    journalLogMove(fs, inode);
+    if (inode->is_directory)
+        dcacheInvalidate(fs);
+    printf("Moved '%s' to '%s'.\n", source, destination);
 }
@@ -1,137 +1,1007 @@
+#ifdef __linux__
+#define _GNU_SOURCE // fallocate()
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "file_system.h"
+#include "block_bitmap.h"
+#include "free_extent.h"
+#include "inode_table.h"
+#include "directory.h"
+#include "path.h"
+#include "reclaim.h"
+#include "image_format.h"
+#include "dirty.h"
+#include "journal.h"
+#include "checksum.h"
+#include "image_crypt.h"
+#include "dedup.h"
+#include "snapshot.h"
+#include "worker_pool.h"
 
-// 內部輔助函數
-static void saveInodeRecursive(FILE *file, Inode *inode) {
-    // Save the basic properties of the inode
-    size_t len = strlen(inode->name) + 1;
-    fwrite(&len, sizeof(size_t), 1, file);          // Save name length
-    fwrite(inode->name, sizeof(char), len, file);   // Save name
-    fwrite(&inode->is_directory, sizeof(int), 1, file);
-    fwrite(&inode->file_size, sizeof(size_t), 1, file);
-    fwrite(&inode->start_block, sizeof(int), 1, file);
-    fwrite(&inode->block_count, sizeof(size_t), 1, file);
-    fwrite(&inode->directory_item_count, sizeof(size_t), 1, file);
+#ifndef O_BINARY
+#define O_BINARY 0 // only Windows distinguishes text and binary opens
+#endif
 
-    // Save directory items if it is a directory
-    if (inode->is_directory && inode->directory_items) {
-        for (size_t i = 0; i < inode->directory_item_count; i++)
-            saveInodeRecursive(file, inode->directory_items[i]);
+// Data region transfers are split into jobs of at most this many blocks
+#ifndef IMAGE_IO_CHUNK_BLOCKS
+#define IMAGE_IO_CHUNK_BLOCKS 8192
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#include <pthread.h>
+#define fsync _commit
+// no pread()/pwrite(): seek and transfer under one lock instead
+static pthread_mutex_t positioned_io = PTHREAD_MUTEX_INITIALIZER;
+static long pread(int fd, void *buffer, size_t length, long long offset)
+{
+    pthread_mutex_lock(&positioned_io);
+    long n = _lseeki64(fd, offset, SEEK_SET) < 0 ? -1 : _read(fd, buffer, (unsigned)length);
+    pthread_mutex_unlock(&positioned_io);
+    return n;
+}
+static long pwrite(int fd, const void *buffer, size_t length, long long offset)
+{
+    pthread_mutex_lock(&positioned_io);
+    long n = _lseeki64(fd, offset, SEEK_SET) < 0 ? -1 : _write(fd, buffer, (unsigned)length);
+    pthread_mutex_unlock(&positioned_io);
+    return n;
+}
+#else
+#define FS_HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+#define FS_HAVE_PUNCH_HOLE
+#endif
+
+// Whole transfers at a fixed offset, whatever pread()/pwrite() do per call.
+static int readAt(int fd, void *buffer, size_t length, uint64_t offset)
+{
+    char *p = (char *)buffer;
+    while (length > 0)
+    {
+        long n = (long)pread(fd, p, length, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        offset += (uint64_t)n;
+        length -= (size_t)n;
     }
+    return 0;
 }
 
-void saveFileSystem(FileSystem *fs, const char *password) {
-    FILE *file = fopen("data/filesystem.dump", "wb"); // 改為 data 目錄
-    if (!file) { perror("Failed to open dump file"); return; }
+static int writeAt(int fd, const void *buffer, size_t length, uint64_t offset)
+{
+    const char *p = (const char *)buffer;
+    while (length > 0)
+    {
+        long n = (long)pwrite(fd, p, length, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        offset += (uint64_t)n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+// Point data_blocks at the image's data region: a shared mapping where
+// mmap() is available and the data is not encrypted, otherwise (or if
+// mapping fails) a zeroed heap copy that transferData() fills.
+static int mapData(FileSystem *fs, int fd)
+{
+    size_t data_length = fs->block_count * BLOCK_SIZE;
+#ifdef FS_HAVE_MMAP
+    if (data_length > 0 && !fs->crypt->encrypted)
+    {
+        void *data = mmap(NULL, data_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IMAGE_DATA_OFFSET);
+        if (data != MAP_FAILED)
+        {
+            fs->data_blocks = (char *)data;
+            fs->data_mapped = 1;
+            return 0;
+        }
+    }
+#else
+    (void)fd;
+#endif
+    fs->data_blocks = (char *)calloc(data_length ? data_length : 1, 1);
+    return fs->data_blocks ? 0 : -1;
+}
+
+// Replace a mapping of the image by a heap copy of its blocks in use, so
+// the image file can be written from scratch. Returns -1, still mapped,
+// if out of memory.
+static int copyMappedData(FileSystem *fs)
+{
+#ifdef FS_HAVE_MMAP
+    if (!fs->data_mapped)
+        return 0;
+    size_t data_length = fs->block_count * BLOCK_SIZE;
+    char *copy = (char *)calloc(data_length ? data_length : 1, 1);
+    if (!copy)
+        return -1;
+    for (size_t b = bitmapNextSet(fs->block_bitmap, fs->block_count, 0); b < fs->block_count;)
+    {
+        size_t end = bitmapNextClear(fs->block_bitmap, fs->block_count, b);
+        memcpy(copy + b * BLOCK_SIZE, fs->data_blocks + b * BLOCK_SIZE, (end - b) * BLOCK_SIZE);
+        b = bitmapNextSet(fs->block_bitmap, fs->block_count, end);
+    }
+    munmap(fs->data_blocks, data_length);
+    fs->data_blocks = copy;
+    fs->data_mapped = 0;
+#else
+    (void)fs;
+#endif
+    return 0;
+}
+
+void imageReleaseData(FileSystem *fs)
+{
+#ifdef FS_HAVE_MMAP
+    if (fs->data_mapped)
+    {
+        munmap(fs->data_blocks, fs->block_count * BLOCK_SIZE);
+        fs->data_blocks = NULL;
+        fs->data_mapped = 0;
+        return;
+    }
+#endif
+    free(fs->data_blocks);
+    fs->data_blocks = NULL;
+}
 
-    // Save the 6-digit password
-    fwrite(password, sizeof(char), 6, file);
+// Flatten the inode tree into the table layout of image_format.h. Records
+// are numbered breadth first, so the record array doubles as the queue.
+static char *serializeTree(const FileSystem *fs, size_t *length)
+{
+    size_t capacity = fs->inode_used + 1;
+    const Inode **order = (const Inode **)malloc(capacity * sizeof(Inode *));
+    uint64_t *parents = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    if (!order || !parents)
+    {
+        free(order);
+        free(parents);
+        return NULL;
+    }
 
-    // Save the FileSystem metadata
-    fwrite(&fs->partition_size, sizeof(size_t), 1, file);
-    fwrite(&fs->block_count, sizeof(size_t), 1, file);
-    fwrite(&fs->block_used, sizeof(size_t), 1, file);
-    fwrite(fs->block_bitmap, sizeof(int), fs->block_count, file);
-    fwrite(&fs->inode_count, sizeof(size_t), 1, file);
-    fwrite(&fs->inode_used, sizeof(size_t), 1, file);
+    size_t count = 1;
+    size_t extent_count = 0;
+    size_t name_bytes = 0;
+    order[0] = fs->root;
+    parents[0] = INODE_RECORD_NO_PARENT;
+    for (size_t i = 0; i < count; i++)
+    {
+        const Inode *inode = order[i];
+        extent_count += inode->extent_count;
+        name_bytes += strlen(inode->name) + 1;
+        if (!inode->is_directory)
+            continue;
+        if (count + inode->directory_item_count > capacity)
+        {
+            // inode_used should cover every linked inode; grow if it does not
+            while (count + inode->directory_item_count > capacity)
+                capacity *= 2;
+            const Inode **grown_order = (const Inode **)realloc(order, capacity * sizeof(Inode *));
+            uint64_t *grown_parents = grown_order ? (uint64_t *)realloc(parents, capacity * sizeof(uint64_t)) : NULL;
+            order = grown_order ? grown_order : order;
+            parents = grown_parents ? grown_parents : parents;
+            if (!grown_order || !grown_parents)
+            {
+                free(order);
+                free(parents);
+                return NULL;
+            }
+        }
+        for (size_t j = 0; j < inode->directory_item_count; j++)
+        {
+            order[count] = inode->directory_items[j];
+            parents[count++] = i;
+        }
+    }
 
-    // Save the inode tree starting from the root
-    saveInodeRecursive(file, fs->root);
+    size_t total = sizeof(InodeTableHeader) + count * sizeof(InodeRecord) + extent_count * 2 * sizeof(uint64_t) + name_bytes;
+    char *table = (char *)malloc(total);
+    if (table)
+    {
+        InodeTableHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, INODE_TABLE_MAGIC, sizeof(INODE_TABLE_MAGIC));
+        header.version = INODE_TABLE_VERSION;
+        header.record_size = sizeof(InodeRecord);
+        header.record_count = count;
+        header.extent_count = extent_count;
+        header.name_bytes = name_bytes;
+        memcpy(table, &header, sizeof(header));
 
-    // Save the data blocks
-    fwrite(fs->data_blocks, BLOCK_SIZE, fs->block_count, file);
+        InodeRecord *records = (InodeRecord *)(table + sizeof(header));
+        uint64_t *extents = (uint64_t *)(records + count);
+        char *names = (char *)(extents + extent_count * 2);
+        size_t extent_pos = 0;
+        size_t name_pos = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const Inode *inode = order[i];
+            size_t name_length = strlen(inode->name);
+            InodeRecord *record = &records[i];
+            memset(record, 0, sizeof(*record));
+            record->ino = inode->ino;
+            record->parent = parents[i];
+            record->file_size = inode->file_size;
+            record->mtime_ns = inode->mtime_ns;
+            record->extent_first = extent_pos;
+            record->extent_count = inode->extent_count;
+            record->item_count = inode->is_directory ? inode->directory_item_count : 0;
+            record->name_offset = name_pos;
+            record->name_length = (uint32_t)name_length;
+            record->flags = inode->is_directory ? INODE_RECORD_DIRECTORY : 0;
+            if (inode->share_source)
+            {
+                record->flags |= INODE_RECORD_SHARED;
+                record->share_source = inode->share_source->ino;
+            }
 
-    fclose(file);
-    printf("File system has been saved to 'data/filesystem.dump'with password.\n");
+            for (size_t e = 0; e < inode->extent_count; e++)
+            {
+                extents[2 * extent_pos] = inode->extents[e].start;
+                extents[2 * extent_pos + 1] = inode->extents[e].length;
+                extent_pos++;
+            }
+            memcpy(names + name_pos, inode->name, name_length + 1);
+            name_pos += name_length + 1;
+        }
+        *length = total;
+    }
+    free(order);
+    free(parents);
+    return table;
 }
 
-static void loadInodeRecursive(FILE *file, Inode **inode, Inode *parent) {
-    // Allocate memory for the inode structure
-    *inode = (Inode *)malloc(sizeof(Inode));
-    if (!*inode) // Check if memory allocation was successful
+// Next run of blocks at or after `pos` that are in use and, given a
+// `dirty` bitmap, dirty; free blocks never need to reach the image.
+static int nextRun(const FileSystem *fs, const uint64_t *dirty, size_t pos, size_t *start, size_t *end)
+{
+    while (pos < fs->block_count)
     {
-        printf("Failed to allocate memory for inode.\n");
-        return;
+        size_t used = bitmapNextSet(fs->block_bitmap, fs->block_count, pos);
+        size_t first = dirty ? bitmapNextSet(dirty, fs->block_count, used) : used;
+        if (first >= fs->block_count)
+            return 0;
+        if (first != used && !bitmapTest(fs->block_bitmap, first))
+        {
+            pos = first;
+            continue;
+        }
+        *start = first;
+        *end = bitmapNextClear(fs->block_bitmap, fs->block_count, first);
+        if (dirty)
+        {
+            size_t clean = bitmapNextClear(dirty, fs->block_count, first);
+            *end = clean < *end ? clean : *end;
+        }
+        return 1;
     }
+    return 0;
+}
+
+typedef struct DataChunk
+{
+    size_t start;
+    size_t count;
+} DataChunk;
 
-    // Read and set the inode's name length from the file
-    size_t name_length;
-    fread(&name_length, sizeof(size_t), 1, file); // Read the length of the name
-    // Allocate memory for the inode's name based on the read length
-    (*inode)->name = (char *)malloc(name_length);
-    // Read the actual name from the file
-    fread((*inode)->name, sizeof(char), name_length, file);
+enum
+{
+    TRANSFER_LOAD,  // image to memory, as stored
+    TRANSFER_STORE, // memory to image, checksummed and encrypted if the image is
+    TRANSFER_OPEN   // decrypt what TRANSFER_LOAD read, in memory
+};
 
-    // Read basic properties of the inode from the file
-    fread(&(*inode)->is_directory, sizeof(int), 1, file);            // Read if it is a directory
-    fread(&(*inode)->file_size, sizeof(size_t), 1, file);            // Read the file size
-    fread(&(*inode)->start_block, sizeof(int), 1, file);             // Read the start block index
-    fread(&(*inode)->block_count, sizeof(size_t), 1, file);          // Read the number of blocks
-    fread(&(*inode)->directory_item_count, sizeof(size_t), 1, file); // Read the number of directory items
+// Moves the data region between data_blocks and the image in chunks on
+// the worker pool, checksumming the blocks it stores. Every chunk has its
+// own offset, so the workers share the descriptor without a file
+// position. `side` runs as one more job, next to the chunks.
+typedef struct DataTransfer
+{
+    FileSystem *fs;
+    int fd;
+    int mode; // TRANSFER_*
+    uint64_t write_id; // of the blocks stored into an encrypted image
+    DataChunk *chunks;
+    size_t chunk_count;
+    int failed;
+    size_t forged; // blocks that failed their seal
+    void (*side)(void *context);
+    void *side_context;
+} DataTransfer;
 
-    // Set the parent inode to establish the directory hierarchy
-    (*inode)->parent = parent;
+static uint64_t sealOffset(const FileSystem *fs);
 
-    // If the inode represents a directory, recursively load its items
-    if ((*inode)->is_directory)
+static void transferJob(void *context, size_t i)
+{
+    DataTransfer *transfer = (DataTransfer *)context;
+    if (transfer->side)
     {
-        // Allocate memory for an array of directory items (child inodes)
-        (*inode)->directory_items = (Inode **)malloc((*inode)->directory_item_count * sizeof(Inode *));
-        for (size_t i = 0; i < (*inode)->directory_item_count; i++)
+        if (i == 0)
         {
-            // Recursively load each child inode
-            loadInodeRecursive(file, &(*inode)->directory_items[i], *inode);
+            transfer->side(transfer->side_context);
+            return;
         }
+        i--;
+    }
+    FileSystem *fs = transfer->fs;
+    DataChunk chunk = transfer->chunks[i];
+    size_t offset = chunk.start * BLOCK_SIZE;
+    size_t length = chunk.count * BLOCK_SIZE;
+    int ok;
+    if (transfer->mode == TRANSFER_OPEN)
+    {
+        size_t forged = cryptOpenBlocks(fs, chunk.start, chunk.count);
+        if (forged > 0)
+            __atomic_fetch_add(&transfer->forged, forged, __ATOMIC_RELAXED);
+        return;
+    }
+    // what reaches the image gets the checksums it is verified against
+    if (transfer->mode == TRANSFER_STORE)
+        checksumUpdate(fs, chunk.start, chunk.count);
+    if (transfer->mode == TRANSFER_STORE && fs->crypt->encrypted)
+    {
+        // memory keeps the plain text; the image gets a sealed copy, and
+        // each block's seal goes out with it
+        char *sealed = (char *)malloc(length);
+        if (sealed)
+            cryptSealBlocks(fs, chunk.start, chunk.count, transfer->write_id, sealed);
+        ok = sealed && writeAt(transfer->fd, sealed, length, IMAGE_DATA_OFFSET + offset) == 0 &&
+             writeAt(transfer->fd, &fs->crypt->seals[chunk.start], chunk.count * sizeof(BlockSeal),
+                     sealOffset(fs) + chunk.start * sizeof(BlockSeal)) == 0;
+        free(sealed);
     }
     else
+#ifdef FS_HAVE_MMAP
+    if (fs->data_mapped)
+    {
+        // the mapping is the image; storing only pushes the pages out
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t aligned = offset / page * page;
+        ok = msync(fs->data_blocks + aligned, offset + length - aligned, MS_SYNC) == 0;
+    }
+    else
+#endif
+    if (transfer->mode == TRANSFER_STORE)
+        ok = writeAt(transfer->fd, fs->data_blocks + offset, length, IMAGE_DATA_OFFSET + offset) == 0;
+    else
+        ok = readAt(transfer->fd, fs->data_blocks + offset, length, IMAGE_DATA_OFFSET + offset) == 0;
+    if (!ok)
+        __atomic_store_n(&transfer->failed, 1, __ATOMIC_RELAXED);
+}
+
+// Store the blocks in use (only the `dirty` ones, if given) into the
+// image, load them from it, or decrypt them once loaded; a mapped region
+// has nothing to load. `side`, if any, runs concurrently. Returns the
+// number of blocks transferred (for TRANSFER_OPEN, the number that failed
+// their seal), or -1.
+static long transferData(FileSystem *fs, int fd, int mode, const uint64_t *dirty,
+                         void (*side)(void *context), void *side_context)
+{
+    DataTransfer transfer = {fs, fd, mode, 0, NULL, 0, 0, 0, side, side_context};
+    if (mode == TRANSFER_STORE && fs->crypt->encrypted)
+        transfer.write_id = cryptNextWrite(fs->crypt);
+    size_t capacity = 0;
+    size_t blocks = 0;
+    size_t start, end;
+    for (size_t pos = 0; (mode != TRANSFER_LOAD || !fs->data_mapped) && nextRun(fs, dirty, pos, &start, &end); pos = end)
+    {
+        blocks += end - start;
+        for (size_t s = start; s < end; s += IMAGE_IO_CHUNK_BLOCKS)
+        {
+            if (transfer.chunk_count == capacity)
+            {
+                size_t grown_capacity = capacity ? capacity * 2 : 16;
+                DataChunk *grown = (DataChunk *)realloc(transfer.chunks, grown_capacity * sizeof(DataChunk));
+                if (!grown)
+                {
+                    free(transfer.chunks);
+                    if (side)
+                        side(side_context);
+                    return -1;
+                }
+                transfer.chunks = grown;
+                capacity = grown_capacity;
+            }
+            size_t count = end - s < IMAGE_IO_CHUNK_BLOCKS ? end - s : IMAGE_IO_CHUNK_BLOCKS;
+            transfer.chunks[transfer.chunk_count++] = (DataChunk){s, count};
+        }
+    }
+
+    runParallel(transfer.chunk_count + (side ? 1 : 0), transferJob, &transfer);
+    free(transfer.chunks);
+    if (transfer.failed)
+        return -1;
+    return mode == TRANSFER_OPEN ? (long)transfer.forged : (long)blocks;
+}
+
+// Hand the disk space of blocks freed since the last checkpoint back to
+// the host, so the image stays sparse. Only called once the new header is
+// on disk: the previous checkpoint may still refer to them. Returns the
+// number of blocks released.
+static size_t punchFreedBlocks(FileSystem *fs, int fd)
+{
+    size_t punched = 0;
+#ifdef FS_HAVE_PUNCH_HOLE
+    size_t words = bitmapWordCount(fs->block_count);
+    size_t w = 0;
+    while (fs->dirty_bitmap_words && (w = bitmapNextSet(fs->dirty_bitmap_words, words, w)) < words)
+    {
+        size_t w_end = bitmapNextClear(fs->dirty_bitmap_words, words, w);
+        size_t limit = w_end * BITMAP_WORD_BITS < fs->block_count ? w_end * BITMAP_WORD_BITS : fs->block_count;
+        size_t start, length;
+        for (size_t pos = w * BITMAP_WORD_BITS; bitmapNextFreeRun(fs->block_bitmap, limit, pos, &start, &length); pos = start + length)
+        {
+            // file systems without hole support keep the blocks; that is harmless
+            if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          (off_t)(IMAGE_DATA_OFFSET + start * BLOCK_SIZE), (off_t)(length * BLOCK_SIZE)) == 0)
+                punched += length;
+        }
+        w = w_end;
+    }
+#else
+    (void)fs;
+    (void)fd;
+#endif
+    return punched;
+}
+
+static uint64_t metaAlign(uint64_t offset)
+{
+    return (offset + IMAGE_META_ALIGN - 1) / IMAGE_META_ALIGN * IMAGE_META_ALIGN;
+}
+
+static uint64_t sealOffset(const FileSystem *fs)
+{
+    return metaAlign(IMAGE_DATA_OFFSET + (uint64_t)fs->block_count * BLOCK_SIZE);
+}
+
+static uint64_t metaOffset(const FileSystem *fs)
+{
+    if (!fs->crypt->encrypted)
+        return sealOffset(fs);
+    return metaAlign(sealOffset(fs) + (uint64_t)fs->block_count * sizeof(BlockSeal));
+}
+
+typedef struct SyncStats
+{
+    long blocks;
+    int metadata;
+    size_t released;
+} SyncStats;
+
+// The metadata half of a checkpoint, run next to the data transfer:
+// serialize the tree and write it with the bitmap where it does not
+// overlap the previous copy, each sealed on its own in an encrypted
+// image. The block checksums between the two are only final once the
+// transfer is done; writeImage() adds them.
+typedef struct MetaWrite
+{
+    FileSystem *fs;
+    int fd;
+    const ImageHeader *previous;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t write_id;
+    uint32_t crc[IMAGE_META_SECTIONS];
+    uint8_t tag[IMAGE_META_SECTIONS][AEAD_TAG_SIZE];
+    int ok;
+} MetaWrite;
+
+static void writeMetaJob(void *context)
+{
+    MetaWrite *meta = (MetaWrite *)context;
+    FileSystem *fs = meta->fs;
+    size_t bitmap_bytes = bitmapWordCount(fs->block_count) * sizeof(uint64_t);
+    size_t crc_bytes = fs->block_count * sizeof(uint32_t);
+    size_t table_length = 0;
+    char *table = serializeTree(fs, &table_length);
+    meta->offset = metaOffset(fs);
+    meta->length = bitmap_bytes + crc_bytes + table_length;
+    if (fs->image_attached && meta->previous->meta_offset < meta->offset + meta->length)
+        meta->offset = metaAlign(meta->previous->meta_offset + meta->previous->meta_length);
+    meta->crc[0] = crc32c(0, fs->block_bitmap, bitmap_bytes);
+    meta->crc[2] = table ? crc32c(0, table, table_length) : 0;
+
+    const void *bitmap = fs->block_bitmap;
+    char *sealed_bitmap = NULL;
+    if (fs->crypt->encrypted)
+    {
+        // the bitmap stays in use; seal a copy
+        sealed_bitmap = (char *)malloc(bitmap_bytes ? bitmap_bytes : 1);
+        if (sealed_bitmap)
+        {
+            memcpy(sealed_bitmap, fs->block_bitmap, bitmap_bytes);
+            cryptSeal(fs->crypt, CRYPT_META_INDEX(0), meta->write_id, sealed_bitmap, bitmap_bytes, meta->tag[0]);
+        }
+        if (table)
+            cryptSeal(fs->crypt, CRYPT_META_INDEX(2), meta->write_id, table, table_length, meta->tag[2]);
+        bitmap = sealed_bitmap;
+    }
+    meta->ok = table && bitmap &&
+               writeAt(meta->fd, bitmap, bitmap_bytes, meta->offset) == 0 &&
+               writeAt(meta->fd, table, table_length, meta->offset + bitmap_bytes + crc_bytes) == 0;
+    free(sealed_bitmap);
+    free(table);
+}
+
+// Sign `header` with the image keys, add its CRC and make it durable.
+static int writeHeader(const FileSystem *fs, int fd, ImageHeader *header)
+{
+    cryptSignHeader(fs->crypt, header);
+    header->header_crc = crc32c(0, header, offsetof(ImageHeader, header_crc));
+    return writeAt(fd, header, sizeof(*header), 0) == 0 && fsync(fd) == 0 ? 0 : -1;
+}
+
+// Bring the image up to date and start a new journal for it. Data blocks
+// are written in place, only the dirty ones once the image is attached,
+// while another worker writes the metadata where it does not overlap the
+// previous copy: right behind the data region, or after that copy. The
+// header, written last, switches over, so a crash at any point leaves the
+// previous checkpoint and its journal intact.
+static int writeImage(FileSystem *fs, SyncStats *stats)
+{
+    // removed subtrees are not part of the tree; free their blocks first
+    reclaimAll(fs);
+
+    int in_place = fs->image_attached;
+    if (!in_place)
+    {
+        // a new image: the log of whatever was there before must not be replayed onto it
+        journalClose(fs);
+        remove(JOURNAL_PATH);
+        // heap data only: everything is written below
+        dirtyDestroy(fs);
+        fs->tree_dirty = 1;
+    }
+    int fd = open(IMAGE_PATH, in_place ? O_RDWR | O_BINARY : O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644); // 改為 data 目錄
+    if (fd < 0) { perror("Failed to open dump file"); return -1; }
+
+    ImageHeader previous;
+    memset(&previous, 0, sizeof(previous));
+    int ok = !in_place || readAt(fd, &previous, sizeof(previous), 0) == 0;
+
+    int metadata = !in_place || dirtyMetaPending(fs);
+    MetaWrite meta = {fs, fd, &previous, previous.meta_offset, previous.meta_length, previous.meta_write_id, {0}, {{0}}, 1};
+    memcpy(meta.crc, previous.meta_crc, sizeof(meta.crc));
+    memcpy(meta.tag, previous.meta_tag, sizeof(meta.tag));
+    if (metadata)
+        meta.write_id = cryptNextWrite(fs->crypt);
+    stats->blocks = ok ? transferData(fs, fd, TRANSFER_STORE, fs->dirty_blocks, metadata ? writeMetaJob : NULL, &meta) : -1;
+    stats->metadata = metadata;
+    ok = stats->blocks >= 0 && meta.ok;
+    if (ok && metadata)
+    {
+        size_t crc_bytes = fs->block_count * sizeof(uint32_t);
+        char *crcs = fs->block_crc ? (char *)malloc(crc_bytes ? crc_bytes : 1) : NULL;
+        ok = crcs != NULL;
+        if (ok)
+        {
+            memcpy(crcs, fs->block_crc, crc_bytes);
+            meta.crc[1] = crc32c(0, crcs, crc_bytes);
+            if (fs->crypt->encrypted)
+                cryptSeal(fs->crypt, CRYPT_META_INDEX(1), meta.write_id, crcs, crc_bytes, meta.tag[1]);
+        }
+        ok = ok && writeAt(fd, crcs, crc_bytes, meta.offset + bitmapWordCount(fs->block_count) * sizeof(uint64_t)) == 0;
+        free(crcs);
+    }
+    // everything the new header points at is on disk before it is written
+    ok = ok && fsync(fd) == 0;
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.partition_size = fs->partition_size;
+    header.block_count = fs->block_count;
+    header.block_used = fs->block_used;
+    header.inode_count = fs->inode_count;
+    header.inode_used = fs->inode_used;
+    header.data_offset = IMAGE_DATA_OFFSET;
+    header.meta_offset = meta.offset;
+    header.meta_length = meta.length;
+    header.generation = previous.generation + 1;
+    header.seal_offset = fs->crypt->encrypted ? sealOffset(fs) : 0;
+    header.meta_write_id = meta.write_id;
+    memcpy(header.meta_crc, meta.crc, sizeof(meta.crc));
+    memcpy(header.meta_tag, meta.tag, sizeof(meta.tag));
+    ok = ok && writeHeader(fs, fd, &header) == 0;
+
+    stats->released = ok ? punchFreedBlocks(fs, fd) : 0;
+
+    // drop the previous copy if it sat behind the new one; harmless if this fails
+    if (ok && metadata && ftruncate(fd, (off_t)(meta.offset + meta.length)) != 0)
+        perror("Failed to trim dump file");
+
+    if (close(fd) != 0 || !ok)
+    {
+        printf("Failed to write '%s'.\n", IMAGE_PATH);
+        return -1;
+    }
+
+    // a fresh image starts tracking from here
+    if (!in_place)
+    {
+        fs->image_attached = 1;
+        dirtyInit(fs);
+    }
+    dirtyClear(fs);
+    journalOpen(fs, header.generation);
+    return 0;
+}
+
+long imageFlushData(FileSystem *fs)
+{
+    int fd = -1;
+    if (!fs->data_mapped && (fd = open(IMAGE_PATH, O_RDWR | O_BINARY)) < 0)
+        return -1;
+    long written = transferData(fs, fd, TRANSFER_STORE, fs->dirty_blocks, NULL, NULL);
+    if (fd >= 0)
+    {
+        if (fsync(fd) != 0)
+            written = -1;
+        close(fd);
+    }
+    if (written >= 0)
+        dirtyClearData(fs);
+    // their checksums go out with the next checkpoint
+    if (written > 0)
+        dirtyMarkTree(fs);
+    return written;
+}
+
+int imageCheckpoint(FileSystem *fs)
+{
+    SyncStats stats;
+    return writeImage(fs, &stats);
+}
+
+void saveFileSystem(FileSystem *fs, const char *password) {
+    // a plain image is sealed the first time it is saved (unless built
+    // with -DFS_PLAIN_IMAGE), which means writing it again from a heap copy
+    // of the data
+    int seal = IMAGE_ENCRYPT && fs->crypt && !fs->crypt->encrypted;
+    if (seal && copyMappedData(fs) != 0)
+    {
+        printf("Not enough memory to encrypt '%s'; it stays unencrypted.\n", IMAGE_PATH);
+        seal = 0;
+    }
+
+    // a new password brings new keys; an encrypted image is written again
+    // under them, a mapped plain one only gets a new header
+    if (!fs->crypt || seal || !cryptMatches(fs->crypt, password))
+    {
+        int encrypt = IMAGE_ENCRYPT || (fs->crypt && fs->crypt->encrypted);
+        ImageCrypt *crypt = cryptCreate(password, fs->block_count, encrypt && !fs->data_mapped);
+        if (!crypt)
+        {
+            printf("Failed to set up the keys for '%s'.\n", IMAGE_PATH);
+            return;
+        }
+        cryptDestroy(fs->crypt);
+        fs->crypt = crypt;
+        if (!fs->data_mapped)
+            fs->image_attached = 0;
+    }
+
+    SyncStats stats;
+    if (writeImage(fs, &stats) == 0)
+        printf("File system has been saved to '%s'with password.\n", IMAGE_PATH);
+}
+
+int syncFileSystem(FileSystem *fs)
+{
+    if (!fs->image_attached)
+        return -1;
+
+    SyncStats stats;
+    if (writeImage(fs, &stats) != 0)
+        return -1;
+    printf("Synced %ld blocks%s", stats.blocks, stats.metadata ? " and the metadata" : "");
+    if (stats.released > 0)
+        printf(", released %zu free blocks", stats.released);
+    printf(".\n");
+    return 0;
+}
+
+// Rebuild the inode tree from a table read whole into memory; every
+// record is checked before use. Returns -1 on a malformed table, leaving
+// the inodes created so far registered in fs->inodes.
+static int loadTree(FileSystem *fs, const char *table, size_t length)
+{
+    InodeTableHeader header;
+    if (length < sizeof(header))
+        return -1;
+    memcpy(&header, table, sizeof(header));
+    size_t space = length - sizeof(header);
+    if (memcmp(header.magic, INODE_TABLE_MAGIC, sizeof(INODE_TABLE_MAGIC)) != 0 || header.version != INODE_TABLE_VERSION ||
+        header.record_size < sizeof(InodeRecord) || header.record_count == 0 ||
+        header.record_count > space / header.record_size)
+        return -1;
+    space -= header.record_count * header.record_size;
+    if (header.extent_count > space / (2 * sizeof(uint64_t)))
+        return -1;
+    space -= header.extent_count * 2 * sizeof(uint64_t);
+    if (header.name_bytes != space)
+        return -1;
+
+    const char *records = table + sizeof(header);
+    const char *extents = records + header.record_count * header.record_size;
+    const char *names = extents + header.extent_count * 2 * sizeof(uint64_t);
+    Inode **by_record = (Inode **)calloc((size_t)header.record_count, sizeof(Inode *));
+    if (!by_record)
+        return -1;
+
+    int result = 0;
+    for (size_t i = 0; i < header.record_count && result == 0; i++)
+    {
+        InodeRecord record;
+        memcpy(&record, records + i * header.record_size, sizeof(record));
+        Inode *parent = NULL;
+        if (i > 0 && record.parent < i && by_record[record.parent]->is_directory)
+            parent = by_record[record.parent];
+        if ((i > 0 && !parent) || (i == 0 && record.parent != INODE_RECORD_NO_PARENT) ||
+            record.ino >= fs->inode_count || fs->inodes[record.ino] ||
+            record.extent_first > header.extent_count || record.extent_count > header.extent_count - record.extent_first ||
+            record.item_count > header.record_count || record.name_offset >= header.name_bytes ||
+            record.name_length >= header.name_bytes - record.name_offset || names[record.name_offset + record.name_length] != '\0')
+        {
+            result = -1;
+            break;
+        }
+
+        Inode *inode = inodeRecordAlloc(fs);
+        if (!inode || !(inode->name = inodeNameDup(fs, names + record.name_offset)))
+        {
+            result = -1;
+            break;
+        }
+        inode->ino = (size_t)record.ino;
+        inode->name_hash = nameHash(inode->name);
+        inode->is_directory = (record.flags & INODE_RECORD_DIRECTORY) != 0;
+        inode->file_size = (size_t)record.file_size;
+        inode->mtime_ns = record.mtime_ns;
+        inode->parent = parent;
+        fs->inodes[inode->ino] = inode;
+        by_record[i] = inode;
+
+        if (record.extent_count > 0)
+        {
+            inode->extents = (Extent *)malloc((size_t)record.extent_count * sizeof(Extent));
+            if (!inode->extents)
+                result = -1;
+            for (size_t e = 0; inode->extents && e < record.extent_count; e++)
+            {
+                uint64_t pair[2];
+                memcpy(pair, extents + (record.extent_first + e) * sizeof(pair), sizeof(pair));
+                inode->extents[e] = (Extent){(size_t)pair[0], (size_t)pair[1]};
+                inode->block_count += inode->extents[e].length;
+            }
+            inode->extent_count = inode->extents ? (size_t)record.extent_count : 0;
+        }
+        // size each item array once; the items follow later in the table
+        if (inode->is_directory && record.item_count > 0 && dirReserve(inode, (size_t)record.item_count) != 0)
+            result = -1;
+        if (parent && dirAddItem(parent, inode) != 0)
+            result = -1;
+    }
+
+    // a shared directory is empty and reads a directory that is not
+    // shared itself, nor one of its parents
+    for (size_t i = 0; i < header.record_count && result == 0; i++)
     {
-        // If it is not a directory, set directory_items to NULL
-        (*inode)->directory_items = NULL;
+        InodeRecord record;
+        memcpy(&record, records + i * header.record_size, sizeof(record));
+        if (!(record.flags & INODE_RECORD_SHARED))
+            continue;
+        Inode *source = record.share_source < fs->inode_count ? fs->inodes[record.share_source] : NULL;
+        if (!by_record[i]->is_directory || record.item_count > 0 || !source || !source->is_directory ||
+            isAncestor(source, by_record[i]))
+            result = -1;
+        else
+            snapshotShare(by_record[i], source);
     }
+    for (size_t i = 0; i < header.record_count && result == 0; i++)
+    {
+        if (by_record[i]->share_source && by_record[i]->share_source->share_source)
+            result = -1;
+    }
+
+    fs->root = by_record[0];
+    free(by_record);
+    return result;
+}
+
+// The tree half of a load, run next to the data transfer.
+typedef struct TreeLoad
+{
+    FileSystem *fs;
+    const char *table;
+    size_t length;
+    int ok;
+} TreeLoad;
+
+static void loadTreeJob(void *context)
+{
+    TreeLoad *tree = (TreeLoad *)context;
+    tree->ok = inodeTableInit(tree->fs, tree->fs->inode_count) == 0 &&
+               loadTree(tree->fs, tree->table, tree->length) == 0;
 }
 
 void loadFileSystem(FileSystem **fs, const char *inputPassword) {
-    FILE *file = fopen("data/filesystem.dump", "rb");
-    if (!file) { printf("Dump not found.\n"); return; }
+    // opened for writing too, so the data region can be mapped shared
+    int fd = open(IMAGE_PATH, O_RDWR | O_BINARY);
+    if (fd < 0) { printf("Dump not found.\n"); return; }
 
-    // Read and verify the password
-    char storedPwd[7] = {0};    // Extra space for null terminator
-    fread(storedPwd, sizeof(char), 6, file);
-    if (strncmp(storedPwd, inputPassword, 6) != 0) {
-        printf("Wrong password.\n"); fclose(file); return;
+    // Read the header, then derive the keys that verify the password and
+    // authenticate the header
+    ImageHeader header;
+    if (readAt(fd, &header, sizeof(header), 0) != 0 || memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+        header.version != IMAGE_VERSION || header.data_offset != IMAGE_DATA_OFFSET) {
+        printf("Unsupported dump format.\n"); close(fd); return;
+    }
+    if (header.header_crc != crc32c(0, &header, offsetof(ImageHeader, header_crc))) {
+        printf("Corrupt header in '%s'.\n", IMAGE_PATH); close(fd); return;
+    }
+    ImageCrypt *crypt = cryptUnlock(&header, inputPassword);
+    if (!crypt) {
+        printf("Wrong password.\n"); close(fd); return;
+    }
+    if (cryptCheckHeader(crypt, &header) != 0) {
+        printf("Corrupt header in '%s'.\n", IMAGE_PATH); cryptDestroy(crypt); close(fd); return;
     }
 
     // Allocate memory for the FileSystem
-    *fs = (FileSystem *)malloc(sizeof(FileSystem));
+    *fs = (FileSystem *)calloc(1, sizeof(FileSystem));
     if (!*fs)
     {
         printf("Failed to allocate memory for file system.\n");
-        fclose(file);
+        cryptDestroy(crypt);
+        close(fd);
         return;
     }
+    (*fs)->crypt = crypt;
+
+    // Load the FileSystem metadata from the tail of the image
+    (*fs)->partition_size = header.partition_size;
+    (*fs)->block_count = header.block_count;
+    (*fs)->block_used = header.block_used;
+    (*fs)->inode_count = header.inode_count;
+    (*fs)->inode_used = header.inode_used;
 
-    // Load the FileSystem metadata
-    fread(&(*fs)->partition_size, sizeof(size_t), 1, file);
-    fread(&(*fs)->block_count, sizeof(size_t), 1, file);
-    fread(&(*fs)->block_used, sizeof(size_t), 1, file);
-    (*fs)->block_bitmap = (int *)malloc((*fs)->block_count * sizeof(int));
-    fread((*fs)->block_bitmap, sizeof(int), (*fs)->block_count, file);
-    fread(&(*fs)->inode_count, sizeof(size_t), 1, file);
-    fread(&(*fs)->inode_used, sizeof(size_t), 1, file);
-
-    // Initialize the inodes array
-    (*fs)->inodes = (Inode **)calloc((*fs)->inode_count, sizeof(Inode *));
-    
-    // Load the inode tree starting from the root
-    loadInodeRecursive(file, &(*fs)->root, NULL);
-    (*fs)->inodes[0] = (*fs)->root;
+    // One read for all of it: the bitmap words, the block checksums, then
+    // the inode table, each opened if sealed and checked against its CRC
+    size_t bitmap_bytes = bitmapWordCount((*fs)->block_count) * sizeof(uint64_t);
+    size_t crc_bytes = (*fs)->block_count * sizeof(uint32_t);
+    size_t table_offset = bitmap_bytes + crc_bytes;
+    char *meta = NULL;
+    if (header.meta_length >= table_offset && header.meta_length <= SIZE_MAX)
+        meta = (char *)malloc((size_t)header.meta_length);
+    int ok = meta && readAt(fd, meta, (size_t)header.meta_length, header.meta_offset) == 0;
+    size_t bounds[IMAGE_META_SECTIONS + 1] = {0, bitmap_bytes, table_offset, (size_t)header.meta_length};
+    for (int i = 0; ok && i < IMAGE_META_SECTIONS; i++)
+    {
+        char *section = meta + bounds[i];
+        size_t length = bounds[i + 1] - bounds[i];
+        ok = (!crypt->encrypted ||
+              cryptOpen(crypt, CRYPT_META_INDEX(i), header.meta_write_id, section, length, header.meta_tag[i]) == 0) &&
+             crc32c(0, section, length) == header.meta_crc[i];
+    }
+    // what opens each data block
+    if (ok && crypt->encrypted)
+        ok = header.seal_offset == sealOffset(*fs) &&
+             readAt(fd, crypt->seals, (*fs)->block_count * sizeof(BlockSeal), header.seal_offset) == 0;
+    (*fs)->block_bitmap = bitmapCreate((*fs)->block_count);
+    (*fs)->block_crc = (uint32_t *)malloc(crc_bytes ? crc_bytes : 1);
+    (*fs)->free_extents = freeIndexCreate();
+    ok = ok && (*fs)->block_bitmap && (*fs)->block_crc && (*fs)->free_extents;
+    if (ok)
+    {
+        memcpy((*fs)->block_bitmap, meta, bitmap_bytes);
+        memcpy((*fs)->block_crc, meta + bitmap_bytes, crc_bytes);
+        freeIndexBuild((*fs)->free_extents, (*fs)->block_bitmap, (*fs)->block_count);
+    }
+
+    // Map the data blocks (or read the ones in use) while the inode tree
+    // is rebuilt from the table
+    TreeLoad tree = {*fs, ok ? meta + table_offset : NULL, ok ? (size_t)header.meta_length - table_offset : 0, 0};
+    int data_ok = ok && mapData(*fs, fd) == 0 && transferData(*fs, fd, TRANSFER_LOAD, NULL, loadTreeJob, &tree) >= 0;
+    free(meta);
+    if (!data_ok || !tree.ok)
+    {
+        if (!ok || (data_ok && !tree.ok))
+            printf("Corrupt metadata in '%s'.\n", IMAGE_PATH);
+        else
+            printf("Failed to load the data blocks.\n");
+        close(fd);
+        freeFileSystem(*fs);
+        *fs = NULL;
+        return;
+    }
+    inodeTableRebuildFreeList(*fs);
     (*fs)->current_directory = (*fs)->root;
 
-    // Load the data blocks
-    (*fs)->data_blocks = (char *)malloc((*fs)->block_count * BLOCK_SIZE);
-    fread((*fs)->data_blocks, BLOCK_SIZE, (*fs)->block_count, file);
-    fclose(file);
-    printf("File system has been loaded from 'data/filesystem.dump'.\n");
-}
\ No newline at end of file
+    // write ids of earlier loads must not come back: claim a new session
+    // before anything is written
+    crypt->session = header.session + 1;
+    if (writeHeader(*fs, fd, &header) != 0)
+    {
+        printf("Failed to write '%s'.\n", IMAGE_PATH);
+        close(fd);
+        freeFileSystem(*fs);
+        *fs = NULL;
+        return;
+    }
+
+    // the image matches memory until something changes
+    (*fs)->image_attached = 1;
+
+    // redo what was committed to the journal after this checkpoint, then
+    // fold it into the image so the log can start over; replayed data
+    // counts as dirty, so the checkpoint checksums it
+    uint64_t *loaded = (*fs)->data_mapped ? NULL : bitmapCreate((*fs)->block_count);
+    if (loaded)
+        memcpy(loaded, (*fs)->block_bitmap, bitmap_bytes);
+    dirtyInit(*fs);
+    dirtyClear(*fs);
+    // which blocks several files share is not stored; the journal may add to it
+    if (dedupInit(*fs) != 0 || dedupCountReferences(*fs) != 0)
+    {
+        printf("Failed to allocate memory for file system.\n");
+        free(loaded);
+        close(fd);
+        freeFileSystem(*fs);
+        *fs = NULL;
+        return;
+    }
+    size_t replayed = journalReplay(*fs, header.generation);
+
+    // a heap copy still lacks the blocks the journal put in use (all of
+    // them again if the old bitmap could not be kept); then decrypt
+    long fresh = 0;
+    if (replayed > 0 && !(*fs)->data_mapped)
+    {
+        for (size_t w = 0; loaded && w < bitmapWordCount((*fs)->block_count); w++)
+            loaded[w] = (*fs)->block_bitmap[w] & ~loaded[w];
+        fresh = transferData(*fs, fd, TRANSFER_LOAD, loaded, NULL, NULL);
+    }
+    free(loaded);
+    long forged = fresh >= 0 && crypt->encrypted ? transferData(*fs, fd, TRANSFER_OPEN, NULL, NULL, NULL) : 0;
+    close(fd);
+    if (fresh < 0 || forged < 0)
+    {
+        printf("Failed to load the data blocks.\n");
+        freeFileSystem(*fs);
+        *fs = NULL;
+        return;
+    }
+    if (forged > 0)
+        printf("%ld blocks in '%s' failed authentication; scrub lists the files they belong to.\n", forged, IMAGE_PATH);
+
+    if (replayed > 0)
+    {
+        dirtyMarkTree(*fs);
+        dirtyMarkBitmap(*fs, 0, (*fs)->block_count);
+        imageCheckpoint(*fs);
+    }
+    else
+        journalOpen(*fs, header.generation);
+    printf("File system has been loaded from '%s'.\n", IMAGE_PATH);
+}
@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include "free_extent.h"
+#include "avl_tree.h"
+#include "block_bitmap.h"
+
+typedef struct FreeRun
+{
+    AvlStartNode by_start;
+    size_t length;
+    AvlNode by_size;  // by (length, start)
+} FreeRun;
+
+struct FreeExtentIndex
+{
+    AvlNode *by_start;
+    AvlNode *by_size;
+    size_t run_count;
+    size_t free_blocks;
+};
+
+#define START_RUN(ptr) AVL_ENTRY(ptr, FreeRun, by_start.node)
+#define SIZE_RUN(node) AVL_ENTRY(node, FreeRun, by_size)
+
+static int compareSize(const AvlNode *a, const AvlNode *b)
+{
+    const FreeRun *x = SIZE_RUN(a);
+    const FreeRun *y = SIZE_RUN(b);
+    if (x->length != y->length)
+        return x->length < y->length ? -1 : 1;
+    return x->by_start.start < y->by_start.start ? -1 : (x->by_start.start > y->by_start.start);
+}
+
+static void linkRun(FreeExtentIndex *index, FreeRun *run)
+{
+    index->by_start = avlInsert(index->by_start, &run->by_start.node, avlCompareStart);
+    index->by_size = avlInsert(index->by_size, &run->by_size, compareSize);
+    index->run_count++;
+    index->free_blocks += run->length;
+}
+
+static void unlinkRun(FreeExtentIndex *index, FreeRun *run)
+{
+    index->by_start = avlRemove(index->by_start, &run->by_start.node, avlCompareStart);
+    index->by_size = avlRemove(index->by_size, &run->by_size, compareSize);
+    index->run_count--;
+    index->free_blocks -= run->length;
+}
+
+static FreeRun *startRun(AvlStartNode *node)
+{
+    return node ? AVL_ENTRY(node, FreeRun, by_start) : NULL;
+}
+
+// last run whose start is <= block
+static FreeRun *findAtOrBefore(const FreeExtentIndex *index, size_t block)
+{
+    return startRun(avlStartFloor(index->by_start, block));
+}
+
+// first run whose start is > block
+static FreeRun *findAfter(const FreeExtentIndex *index, size_t block)
+{
+    return startRun(avlStartCeil(index->by_start, block + 1));
+}
+
+static void freeTree(AvlNode *node)
+{
+    if (!node)
+        return;
+    freeTree(node->left);
+    freeTree(node->right);
+    free(START_RUN(node));
+}
+
+FreeExtentIndex *freeIndexCreate(void)
+{
+    return (FreeExtentIndex *)calloc(1, sizeof(FreeExtentIndex));
+}
+
+void freeIndexDestroy(FreeExtentIndex *index)
+{
+    if (!index)
+        return;
+    freeTree(index->by_start);
+    free(index);
+}
+
+int freeIndexBuild(FreeExtentIndex *index, const uint64_t *bitmap, size_t bits)
+{
+    freeTree(index->by_start);
+    index->by_start = index->by_size = NULL;
+    index->run_count = 0;
+    index->free_blocks = 0;
+
+    size_t pos = 0;
+    size_t start, length;
+    while (bitmapNextFreeRun(bitmap, bits, pos, &start, &length))
+    {
+        FreeRun *run = (FreeRun *)malloc(sizeof(FreeRun));
+        if (!run)
+            return -1;
+        run->by_start.start = start;
+        run->length = length;
+        linkRun(index, run);
+        pos = start + length;
+    }
+    return 0;
+}
+
+int freeIndexInsert(FreeExtentIndex *index, size_t start, size_t length)
+{
+    if (length == 0)
+        return 0;
+
+    FreeRun *before = findAtOrBefore(index, start);
+    FreeRun *after = findAfter(index, start);
+    int joins_before = before && before->by_start.start + before->length == start;
+    int joins_after = after && start + length == after->by_start.start;
+
+    if (joins_before)
+    {
+        unlinkRun(index, before);
+        before->length += length;
+        if (joins_after)
+        {
+            unlinkRun(index, after);
+            before->length += after->length;
+            free(after);
+        }
+        linkRun(index, before);
+        return 0;
+    }
+    if (joins_after)
+    {
+        unlinkRun(index, after);
+        after->by_start.start = start;
+        after->length += length;
+        linkRun(index, after);
+        return 0;
+    }
+
+    FreeRun *run = (FreeRun *)malloc(sizeof(FreeRun));
+    if (!run)
+        return -1;
+    run->by_start.start = start;
+    run->length = length;
+    linkRun(index, run);
+    return 0;
+}
+
+int freeIndexTakeRange(FreeExtentIndex *index, size_t start, size_t length)
+{
+    if (length == 0)
+        return 0;
+
+    FreeRun *run = findAtOrBefore(index, start);
+    if (!run || run->by_start.start + run->length < start + length)
+        return -1;
+
+    size_t run_end = run->by_start.start + run->length;
+    unlinkRun(index, run);
+
+    // keep the part in front of the range in `run`, split off the part behind it
+    if (run_end > start + length)
+    {
+        FreeRun *tail = run;
+        if (run->by_start.start < start)
+        {
+            tail = (FreeRun *)malloc(sizeof(FreeRun));
+            if (!tail)
+            {
+                linkRun(index, run);
+                return -1;
+            }
+        }
+        tail->by_start.start = start + length;
+        tail->length = run_end - tail->by_start.start;
+        linkRun(index, tail);
+        if (tail == run)
+            return 0;
+    }
+    if (run->by_start.start < start)
+    {
+        run->length = start - run->by_start.start;
+        linkRun(index, run);
+    }
+    else
+        free(run);
+    return 0;
+}
+
+static FreeRun *findBestFit(const FreeExtentIndex *index, size_t count)
+{
+    AvlNode *node = index->by_size;
+    FreeRun *best = NULL;
+    while (node)
+    {
+        if (SIZE_RUN(node)->length >= count)
+        {
+            best = SIZE_RUN(node);
+            node = node->left;
+        }
+        else
+            node = node->right;
+    }
+    return best;
+}
+
+int freeIndexBestFit(const FreeExtentIndex *index, size_t count, size_t *start, size_t *length)
+{
+    FreeRun *best = findBestFit(index, count);
+    if (!best)
+        return 0;
+    *start = best->by_start.start;
+    *length = best->length;
+    return 1;
+}
+
+int freeIndexTakeBestFit(FreeExtentIndex *index, size_t count, size_t *start)
+{
+    FreeRun *best = findBestFit(index, count);
+    if (!best)
+        return 0;
+    *start = best->by_start.start;
+    return freeIndexTakeRange(index, best->by_start.start, count) == 0;
+}
+
+int freeIndexLargest(const FreeExtentIndex *index, size_t *start, size_t *length)
+{
+    AvlNode *node = index->by_size;
+    if (!node)
+        return 0;
+    while (node->right)
+        node = node->right;
+    *start = SIZE_RUN(node)->by_start.start;
+    *length = SIZE_RUN(node)->length;
+    return 1;
+}
+
+size_t freeIndexRunCount(const FreeExtentIndex *index)
+{
+    return index->run_count;
+}
+
+size_t freeIndexFreeBlocks(const FreeExtentIndex *index)
+{
+    return index->free_blocks;
+}
+
+static void collectHistogram(const AvlNode *node, size_t *buckets)
+{
+    if (!node)
+        return;
+    collectHistogram(node->left, buckets);
+    int bucket = 63 - __builtin_clzll((unsigned long long)START_RUN(node)->length);
+    if (bucket >= FREE_HISTOGRAM_BUCKETS)
+        bucket = FREE_HISTOGRAM_BUCKETS - 1;
+    buckets[bucket]++;
+    collectHistogram(node->right, buckets);
+}
+
+void freeIndexHistogram(const FreeExtentIndex *index, size_t buckets[FREE_HISTOGRAM_BUCKETS])
+{
+    for (int i = 0; i < FREE_HISTOGRAM_BUCKETS; i++)
+        buckets[i] = 0;
+    collectHistogram(index->by_start, buckets);
+}
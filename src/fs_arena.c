@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fs_arena.h"
+
+#define ARENA_ALIGN 16
+#define NAME_CHUNK_SIZE (64 * 1024)
+#define NAME_CLASS_SIZE 16
+#define NAME_CLASS_COUNT 32 // pooled names up to 512 bytes including the NUL
+
+static size_t alignUp(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+typedef struct Chunk
+{
+    struct Chunk *next;
+} Chunk;
+
+#define CHUNK_HEADER alignUp(sizeof(Chunk))
+
+struct Slab
+{
+    size_t object_size;
+    size_t objects_per_chunk;
+    Chunk *chunks;
+    size_t chunk_count;
+    void *free_list; // free objects store the next pointer in their first bytes
+};
+
+Slab *slabCreate(size_t object_size, size_t objects_per_chunk)
+{
+    Slab *slab = (Slab *)calloc(1, sizeof(Slab));
+    if (!slab)
+        return NULL;
+    slab->object_size = alignUp(object_size < sizeof(void *) ? sizeof(void *) : object_size);
+    slab->objects_per_chunk = objects_per_chunk ? objects_per_chunk : 1;
+    return slab;
+}
+
+static int slabGrow(Slab *slab)
+{
+    Chunk *chunk = (Chunk *)malloc(CHUNK_HEADER + slab->objects_per_chunk * slab->object_size);
+    if (!chunk)
+        return -1;
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    slab->chunk_count++;
+
+    // thread the new objects so they are handed out in address order
+    char *base = (char *)chunk + CHUNK_HEADER;
+    for (size_t i = slab->objects_per_chunk; i-- > 0;)
+    {
+        void *object = base + i * slab->object_size;
+        *(void **)object = slab->free_list;
+        slab->free_list = object;
+    }
+    return 0;
+}
+
+void *slabAlloc(Slab *slab)
+{
+    if (!slab->free_list && slabGrow(slab) != 0)
+        return NULL;
+    void *object = slab->free_list;
+    slab->free_list = *(void **)object;
+    memset(object, 0, slab->object_size);
+    return object;
+}
+
+void slabFree(Slab *slab, void *object)
+{
+    if (!object)
+        return;
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+}
+
+void slabDestroy(Slab *slab)
+{
+    if (!slab)
+        return;
+    while (slab->chunks)
+    {
+        Chunk *next = slab->chunks->next;
+        free(slab->chunks);
+        slab->chunks = next;
+    }
+    free(slab);
+}
+
+size_t slabReservedBytes(const Slab *slab)
+{
+    return slab->chunk_count * (CHUNK_HEADER + slab->objects_per_chunk * slab->object_size);
+}
+
+struct NamePool
+{
+    Chunk *chunks;
+    size_t chunk_count;
+    char *cursor; // bump pointer inside the newest chunk
+    size_t remaining;
+    char *free_lists[NAME_CLASS_COUNT];
+};
+
+NamePool *namePoolCreate(void)
+{
+    return (NamePool *)calloc(1, sizeof(NamePool));
+}
+
+static size_t nameClass(size_t bytes)
+{
+    return (bytes + NAME_CLASS_SIZE - 1) / NAME_CLASS_SIZE - 1;
+}
+
+char *namePoolDup(NamePool *pool, const char *name)
+{
+    size_t bytes = strlen(name) + 1;
+    size_t cls = nameClass(bytes);
+    if (cls >= NAME_CLASS_COUNT)
+        return strdup(name);
+
+    char *slot = pool->free_lists[cls];
+    if (slot)
+        memcpy(&pool->free_lists[cls], slot, sizeof(char *));
+    else
+    {
+        size_t slot_size = (cls + 1) * NAME_CLASS_SIZE;
+        if (pool->remaining < slot_size)
+        {
+            Chunk *chunk = (Chunk *)malloc(CHUNK_HEADER + NAME_CHUNK_SIZE);
+            if (!chunk)
+                return NULL;
+            chunk->next = pool->chunks;
+            pool->chunks = chunk;
+            pool->chunk_count++;
+            pool->cursor = (char *)chunk + CHUNK_HEADER;
+            pool->remaining = NAME_CHUNK_SIZE;
+        }
+        slot = pool->cursor;
+        pool->cursor += slot_size;
+        pool->remaining -= slot_size;
+    }
+    memcpy(slot, name, bytes);
+    return slot;
+}
+
+void namePoolRelease(NamePool *pool, char *name)
+{
+    if (!name)
+        return;
+    size_t cls = nameClass(strlen(name) + 1);
+    if (cls >= NAME_CLASS_COUNT)
+    {
+        free(name);
+        return;
+    }
+    memcpy(name, &pool->free_lists[cls], sizeof(char *));
+    pool->free_lists[cls] = name;
+}
+
+void namePoolDestroy(NamePool *pool)
+{
+    if (!pool)
+        return;
+    while (pool->chunks)
+    {
+        Chunk *next = pool->chunks->next;
+        free(pool->chunks);
+        pool->chunks = next;
+    }
+    free(pool);
+}
+
+size_t namePoolReservedBytes(const NamePool *pool)
+{
+    return pool->chunk_count * (CHUNK_HEADER + NAME_CHUNK_SIZE);
+}
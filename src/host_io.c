@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "host_io.h"
+#include "checksum.h"
+
+// largest single read(); keeps the byte count within ssize_t everywhere
+#define READ_CHUNK_MAX ((size_t)1 << 30)
+
+#ifdef _WIN32
+// no writev(); write the pieces one by one
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+
+static ssize_t writev(int fd, const struct iovec *iov, int count)
+{
+    ssize_t total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        ssize_t n = write(fd, iov[i].iov_base, (unsigned)iov[i].iov_len);
+        if (n < 0)
+            return total > 0 ? total : -1;
+        total += n;
+        if ((size_t)n < iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+#define IOV_MAX 16
+#else
+#include <limits.h>
+#include <sys/uio.h>
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#endif
+
+char *hostPathJoin(const char *dir, const char *name)
+{
+    size_t dir_length = strlen(dir);
+    size_t name_length = strlen(name);
+    char *path = (char *)malloc(dir_length + name_length + 2);
+    if (!path)
+        return NULL;
+    memcpy(path, dir, dir_length);
+    size_t pos = dir_length;
+    if (pos > 0 && path[pos - 1] != '/')
+        path[pos++] = '/';
+    memcpy(path + pos, name, name_length + 1);
+    return path;
+}
+
+int hostMakeDir(const char *path)
+{
+#ifdef _WIN32
+    int result = mkdir(path);
+#else
+    int result = mkdir(path, 0755);
+#endif
+    struct stat st;
+    if (result != 0 && errno == EEXIST && stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        return 0;
+    return result;
+}
+
+ssize_t readFull(int fd, char *dst, size_t bytes)
+{
+    size_t done = 0;
+    while (done < bytes)
+    {
+        size_t want = bytes - done > READ_CHUNK_MAX ? READ_CHUNK_MAX : bytes - done;
+        ssize_t n = read(fd, dst + done, want);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+int readFileData(FileSystem *fs, const Inode *file, int fd)
+{
+    size_t remaining = file->file_size;
+    for (size_t e = 0; e < file->extent_count && remaining > 0; e++)
+    {
+        char *dst = fs->data_blocks + file->extents[e].start * BLOCK_SIZE;
+        size_t bytes = file->extents[e].length * BLOCK_SIZE;
+        if (bytes > remaining)
+        {
+            memset(dst + remaining, 0, bytes - remaining);
+            bytes = remaining;
+        }
+        if (readFull(fd, dst, bytes) != (ssize_t)bytes)
+            return -1;
+        remaining -= bytes;
+    }
+    return 0;
+}
+
+// Write all of iov[0..count), advancing over short writes.
+static int writeAll(int fd, struct iovec *iov, size_t count)
+{
+    while (count > 0)
+    {
+        int batch = count > IOV_MAX ? IOV_MAX : (int)count;
+        ssize_t n = writev(fd, iov, batch);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+
+        size_t done = (size_t)n;
+        while (count > 0 && done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+int writeFileData(const FileSystem *fs, const Inode *file, int fd)
+{
+    if (file->file_size == 0)
+        return 0;
+    if (checksumVerifyFile(fs, file) > 0)
+        return -2;
+
+    struct iovec *iov = (struct iovec *)malloc(file->extent_count * sizeof(struct iovec));
+    if (!iov)
+        return -1;
+
+    // one piece per extent; the last one stops at file_size
+    size_t count = 0;
+    size_t remaining = file->file_size;
+    for (size_t e = 0; e < file->extent_count && remaining > 0; e++)
+    {
+        size_t bytes = file->extents[e].length * BLOCK_SIZE;
+        if (bytes > remaining)
+            bytes = remaining;
+        iov[count].iov_base = fs->data_blocks + file->extents[e].start * BLOCK_SIZE;
+        iov[count].iov_len = bytes;
+        count++;
+        remaining -= bytes;
+    }
+
+    int result = writeAll(fd, iov, count);
+    free(iov);
+    return result;
+}
@@ -0,0 +1,174 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image_crypt.h"
+
+// loading refuses to spend longer than this on a tampered iteration count
+#define KDF_ITERATIONS_LIMIT 100000000u
+
+// Keys follow from the stretched password by purpose, so none of them
+// says anything about another.
+static void deriveKeys(ImageCrypt *crypt, const char *password)
+{
+    uint8_t master[SHA256_SIZE];
+    uint8_t check[SHA256_SIZE];
+    pbkdf2Sha256(password, strlen(password), crypt->salt, sizeof(crypt->salt), crypt->iterations, master, sizeof(master));
+    hmacSha256(master, sizeof(master), "FSIMAGE data", 12, crypt->data_key);
+    hmacSha256(master, sizeof(master), "FSIMAGE auth", 12, crypt->auth_key);
+    hmacSha256(master, sizeof(master), "FSIMAGE check", 13, check);
+    memcpy(crypt->key_check, check, sizeof(crypt->key_check));
+    memset(master, 0, sizeof(master));
+}
+
+// Compare without stopping at the first difference.
+static int sameBytes(const uint8_t *a, const uint8_t *b, size_t length)
+{
+    uint8_t diff = 0;
+    for (size_t i = 0; i < length; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+static ImageCrypt *cryptAlloc(int encrypted, size_t block_count)
+{
+    if (block_count >= CRYPT_MAX_BLOCKS)
+        return NULL;
+    ImageCrypt *crypt = (ImageCrypt *)calloc(1, sizeof(ImageCrypt));
+    if (!crypt)
+        return NULL;
+    crypt->encrypted = encrypted;
+    if (encrypted && !(crypt->seals = (BlockSeal *)calloc(block_count ? block_count : 1, sizeof(BlockSeal))))
+    {
+        free(crypt);
+        return NULL;
+    }
+    return crypt;
+}
+
+ImageCrypt *cryptCreate(const char *password, size_t block_count, int encrypted)
+{
+    ImageCrypt *crypt = cryptAlloc(encrypted, block_count);
+    if (!crypt)
+        return NULL;
+    randomBytes(crypt->salt, sizeof(crypt->salt));
+    crypt->iterations = FS_KDF_ITERATIONS;
+    crypt->session = 1;
+    deriveKeys(crypt, password);
+    return crypt;
+}
+
+ImageCrypt *cryptUnlock(const ImageHeader *header, const char *password)
+{
+    if (header->kdf_iterations == 0 || header->kdf_iterations > KDF_ITERATIONS_LIMIT)
+        return NULL;
+    ImageCrypt *crypt = cryptAlloc((header->flags & IMAGE_FLAG_ENCRYPTED) != 0, (size_t)header->block_count);
+    if (!crypt)
+        return NULL;
+    memcpy(crypt->salt, header->salt, sizeof(crypt->salt));
+    crypt->iterations = header->kdf_iterations;
+    crypt->session = header->session;
+    deriveKeys(crypt, password);
+    if (!sameBytes(crypt->key_check, header->key_check, sizeof(crypt->key_check)))
+    {
+        cryptDestroy(crypt);
+        return NULL;
+    }
+    return crypt;
+}
+
+void cryptDestroy(ImageCrypt *crypt)
+{
+    if (!crypt)
+        return;
+    free(crypt->seals);
+    memset(crypt, 0, sizeof(*crypt));
+    free(crypt);
+}
+
+int cryptMatches(const ImageCrypt *crypt, const char *password)
+{
+    ImageCrypt probe;
+    memcpy(probe.salt, crypt->salt, sizeof(probe.salt));
+    probe.iterations = crypt->iterations;
+    deriveKeys(&probe, password);
+    int same = sameBytes(probe.key_check, crypt->key_check, sizeof(probe.key_check));
+    memset(&probe, 0, sizeof(probe));
+    return same;
+}
+
+uint64_t cryptNextWrite(ImageCrypt *crypt)
+{
+    // 2^32 writes per load; the next load starts a new session
+    return crypt->session << 32 | ++crypt->writes;
+}
+
+static void headerMac(const ImageCrypt *crypt, const ImageHeader *header, uint8_t mac[16])
+{
+    uint8_t full[SHA256_SIZE];
+    hmacSha256(crypt->auth_key, sizeof(crypt->auth_key), header, offsetof(ImageHeader, header_mac), full);
+    memcpy(mac, full, 16);
+}
+
+void cryptSignHeader(const ImageCrypt *crypt, ImageHeader *header)
+{
+    header->flags = crypt->encrypted ? IMAGE_FLAG_ENCRYPTED : 0;
+    header->kdf_iterations = crypt->iterations;
+    header->session = crypt->session;
+    memcpy(header->salt, crypt->salt, sizeof(header->salt));
+    memcpy(header->key_check, crypt->key_check, sizeof(header->key_check));
+    headerMac(crypt, header, header->header_mac);
+}
+
+int cryptCheckHeader(const ImageCrypt *crypt, const ImageHeader *header)
+{
+    uint8_t mac[16];
+    headerMac(crypt, header, mac);
+    return sameBytes(mac, header->header_mac, sizeof(mac)) ? 0 : -1;
+}
+
+// item number, then the write id, little endian
+static void makeNonce(uint32_t index, uint64_t write_id, uint8_t nonce[AEAD_NONCE_SIZE])
+{
+    for (int i = 0; i < 4; i++)
+        nonce[i] = (uint8_t)(index >> (8 * i));
+    for (int i = 0; i < 8; i++)
+        nonce[4 + i] = (uint8_t)(write_id >> (8 * i));
+}
+
+void cryptSeal(const ImageCrypt *crypt, uint32_t index, uint64_t write_id, void *data, size_t length, uint8_t tag[AEAD_TAG_SIZE])
+{
+    uint8_t nonce[AEAD_NONCE_SIZE];
+    makeNonce(index, write_id, nonce);
+    aeadSeal(crypt->data_key, nonce, NULL, 0, data, length, tag);
+}
+
+int cryptOpen(const ImageCrypt *crypt, uint32_t index, uint64_t write_id, void *data, size_t length, const uint8_t tag[AEAD_TAG_SIZE])
+{
+    uint8_t nonce[AEAD_NONCE_SIZE];
+    makeNonce(index, write_id, nonce);
+    return aeadOpen(crypt->data_key, nonce, NULL, 0, data, length, tag);
+}
+
+void cryptSealBlocks(FileSystem *fs, size_t start, size_t count, uint64_t write_id, char *out)
+{
+    ImageCrypt *crypt = fs->crypt;
+    memcpy(out, fs->data_blocks + start * BLOCK_SIZE, count * BLOCK_SIZE);
+    for (size_t i = 0; i < count; i++)
+    {
+        BlockSeal *seal = &crypt->seals[start + i];
+        seal->write_id = write_id;
+        cryptSeal(crypt, (uint32_t)(start + i), write_id, out + i * BLOCK_SIZE, BLOCK_SIZE, seal->tag);
+    }
+}
+
+size_t cryptOpenBlocks(FileSystem *fs, size_t start, size_t count)
+{
+    const ImageCrypt *crypt = fs->crypt;
+    size_t failed = 0;
+    for (size_t b = start; b < start + count; b++)
+    {
+        const BlockSeal *seal = &crypt->seals[b];
+        failed += cryptOpen(crypt, (uint32_t)b, seal->write_id, fs->data_blocks + b * BLOCK_SIZE, BLOCK_SIZE, seal->tag) != 0;
+    }
+    return failed;
+}
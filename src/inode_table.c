@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <time.h>
+#include "inode_table.h"
+#include "fs_arena.h"
+#include "directory.h"
+#include "reclaim.h"
+#include "dirty.h"
+#include "snapshot.h"
+
+#define INODES_PER_SLAB_CHUNK 1024
+
+int inodeTableInit(FileSystem *fs, size_t inode_count)
+{
+    fs->inode_count = inode_count;
+    fs->inode_used = 0;
+    fs->inodes = (Inode **)calloc(inode_count, sizeof(Inode *));
+    fs->free_inodes = (size_t *)malloc(inode_count * sizeof(size_t));
+    fs->inode_slab = slabCreate(sizeof(Inode), inode_count < INODES_PER_SLAB_CHUNK ? inode_count : INODES_PER_SLAB_CHUNK);
+    fs->names = namePoolCreate();
+    if (!fs->inodes || !fs->free_inodes || !fs->inode_slab || !fs->names)
+        return -1;
+    inodeTableRebuildFreeList(fs);
+    return 0;
+}
+
+void inodeTableDestroy(FileSystem *fs)
+{
+    // names and records go away with their chunks; only the per-inode arrays need a walk
+    for (size_t i = 0; fs->inodes && i < fs->inode_count; i++)
+    {
+        if (!fs->inodes[i])
+            continue;
+        dirDropIndex(fs->inodes[i]);
+        free(fs->inodes[i]->directory_items);
+        free(fs->inodes[i]->extents);
+    }
+    slabDestroy(fs->inode_slab);
+    namePoolDestroy(fs->names);
+    free(fs->inodes);
+    free(fs->free_inodes);
+    fs->inode_slab = NULL;
+    fs->names = NULL;
+    fs->inodes = NULL;
+    fs->free_inodes = NULL;
+}
+
+Inode *inodeRecordAlloc(FileSystem *fs)
+{
+    return (Inode *)slabAlloc(fs->inode_slab);
+}
+
+char *inodeNameDup(FileSystem *fs, const char *name)
+{
+    return namePoolDup(fs->names, name);
+}
+
+void inodeTableRebuildFreeList(FileSystem *fs)
+{
+    // push high numbers first so the lowest free number is popped first
+    fs->free_inode_count = 0;
+    fs->inode_used = 0;
+    for (size_t i = fs->inode_count; i-- > 0;)
+    {
+        if (fs->inodes[i])
+            fs->inode_used++;
+        else
+            fs->free_inodes[fs->free_inode_count++] = i;
+    }
+}
+
+Inode *newInode(FileSystem *fs, const char *name, int is_directory, Inode *parent)
+{
+    if (fs->free_inode_count == 0 && fs->reclaim_depth > 0)
+        reclaimAll(fs);
+    if (fs->free_inode_count == 0)
+        return NULL;
+
+    Inode *inode = inodeRecordAlloc(fs);
+    if (!inode)
+        return NULL;
+    inode->name = inodeNameDup(fs, name);
+    if (!inode->name)
+    {
+        slabFree(fs->inode_slab, inode);
+        return NULL;
+    }
+    inode->name_hash = nameHash(inode->name);
+    inode->ino = fs->free_inodes[--fs->free_inode_count];
+    inode->is_directory = is_directory;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    inode->mtime_ns = (int64_t)now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
+    inode->parent = parent;
+
+    fs->inodes[inode->ino] = inode;
+    fs->inode_used++;
+    dirtyMarkTree(fs);
+    return inode;
+}
+
+void releaseInode(FileSystem *fs, Inode *inode)
+{
+    fs->inodes[inode->ino] = NULL;
+    fs->free_inodes[fs->free_inode_count++] = inode->ino;
+    fs->inode_used--;
+    dirtyMarkTree(fs);
+
+    if (inode->share_source)
+        snapshotShare(inode, NULL);
+    dirDropIndex(inode);
+    free(inode->directory_items);
+    free(inode->extents);
+    namePoolRelease(fs->names, inode->name);
+    slabFree(fs->inode_slab, inode);
+}
+
+int moveInode(FileSystem *fs, Inode *inode, Inode *parent, const char *name)
+{
+    char *new_name = inodeNameDup(fs, name);
+    if (!new_name)
+        return -1;
+    Inode *old_parent = inode->parent;
+    char *old_name = inode->name;
+    uint32_t old_hash = inode->name_hash;
+
+    // unlink under the old name: a directory index is keyed by it
+    dirRemoveItem(old_parent, inode);
+    inode->name = new_name;
+    inode->name_hash = nameHash(new_name);
+    inode->parent = parent;
+    if (dirAddItem(parent, inode) != 0)
+    {
+        // the old slot is still allocated, so going back cannot fail
+        inode->name = old_name;
+        inode->name_hash = old_hash;
+        inode->parent = old_parent;
+        dirAddItem(old_parent, inode);
+        namePoolRelease(fs->names, new_name);
+        return -1;
+    }
+    namePoolRelease(fs->names, old_name);
+    dirtyMarkTree(fs);
+    return 0;
+}
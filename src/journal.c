@@ -0,0 +1,682 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "file_system.h"
+#include "journal.h"
+#include "block_alloc.h"
+#include "directory.h"
+#include "dirty.h"
+#include "image_crypt.h"
+#include "image_format.h"
+#include "inode_table.h"
+#include "path.h"
+#include "reclaim.h"
+#include "snapshot.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0 // only Windows distinguishes text and binary opens
+#endif
+
+enum
+{
+    JOURNAL_CREATE = 1,
+    JOURNAL_DATA,
+    JOURNAL_REMOVE,
+    JOURNAL_COMMIT,
+    JOURNAL_SEALED, // the group's other records, encrypted as one
+    JOURNAL_MOVE,
+    JOURNAL_SHARE
+};
+
+typedef struct JournalRecord
+{
+    uint32_t type;
+    uint32_t length; // payload bytes that follow
+} JournalRecord;
+
+typedef struct JournalCreate
+{
+    uint64_t ino;
+    uint64_t parent;
+    int64_t mtime_ns;
+    uint32_t is_directory;
+    uint32_t name_length; // name follows, without the terminator
+} JournalCreate;
+
+typedef struct JournalData
+{
+    uint64_t ino;
+    uint64_t file_size;
+    int64_t mtime_ns;
+    uint64_t extent_count; // (start, length) pairs of uint64_t follow
+} JournalData;
+
+typedef struct JournalRemove
+{
+    uint64_t ino;
+} JournalRemove;
+
+typedef struct JournalMove
+{
+    uint64_t ino;
+    uint64_t parent;
+    uint32_t name_length; // new name follows, without the terminator
+} JournalMove;
+
+#define JOURNAL_NO_SOURCE UINT64_MAX
+
+typedef struct JournalShare
+{
+    uint64_t ino;
+    uint64_t source; // JOURNAL_NO_SOURCE once the directory has items of its own
+} JournalShare;
+
+typedef struct JournalCommit
+{
+    uint64_t sequence; // 1 for the first group after the checkpoint
+    uint64_t checksum; // of the group's records before this one, as written
+    uint64_t write_id; // of the JOURNAL_SEALED record in an encrypted image
+    uint8_t tag[AEAD_TAG_SIZE];
+} JournalCommit;
+
+struct Journal
+{
+    int fd;
+    uint64_t generation;
+    uint64_t sequence;  // groups committed since the checkpoint
+    uint64_t bytes;     // records committed since the checkpoint
+    uint64_t commits;
+    unsigned char *group; // records of the open group
+    size_t group_length;
+    size_t group_capacity;
+    int lost;           // a record could not be kept; the next commit checkpoints instead
+    Extent *freed;      // blocks freed by the open group
+    size_t freed_count;
+    size_t freed_capacity;
+    int freed_unknown;  // the list could not grow; treat every block as freed
+};
+
+#define CHECKSUM_START 14695981039346656037ull
+
+// FNV-1a, continuing from `hash` (CHECKSUM_START for a new one)
+static uint64_t checksum(uint64_t hash, const unsigned char *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static int writeAll(int fd, const void *data, size_t length)
+{
+    const char *p = (const char *)data;
+    while (length > 0)
+    {
+        ssize_t n = write(fd, p, length);
+        if (n <= 0)
+            return -1;
+        p += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+static void clearFreed(Journal *journal)
+{
+    journal->freed_count = 0;
+    journal->freed_unknown = 0;
+}
+
+int journalOpen(FileSystem *fs, uint64_t generation)
+{
+    Journal *journal = fs->journal;
+    if (!journal)
+    {
+        journal = (Journal *)calloc(1, sizeof(Journal));
+        if (!journal)
+            return -1;
+        journal->fd = -1;
+        fs->journal = journal;
+    }
+    if (journal->fd < 0)
+        journal->fd = open(JOURNAL_PATH, O_RDWR | O_CREAT | O_BINARY, 0644);
+
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    header.generation = generation;
+    if (journal->fd < 0 || ftruncate(journal->fd, 0) != 0 || lseek(journal->fd, 0, SEEK_SET) != 0 ||
+        writeAll(journal->fd, &header, sizeof(header)) != 0 || fsync(journal->fd) != 0)
+    {
+        printf("Failed to open '%s'; changes are only kept by sync and exit.\n", JOURNAL_PATH);
+        journalClose(fs);
+        return -1;
+    }
+
+    journal->generation = generation;
+    journal->sequence = 0;
+    journal->bytes = 0;
+    journal->group_length = 0;
+    journal->lost = 0;
+    clearFreed(journal);
+    return 0;
+}
+
+void journalClose(FileSystem *fs)
+{
+    Journal *journal = fs->journal;
+    if (!journal)
+        return;
+    if (journal->fd >= 0)
+        close(journal->fd);
+    free(journal->group);
+    free(journal->freed);
+    free(journal);
+    fs->journal = NULL;
+}
+
+// Room for a record with `length` payload bytes at the end of the open
+// group; NULL (and the group is marked lost) when memory runs out.
+static unsigned char *appendRecord(Journal *journal, uint32_t type, size_t length)
+{
+    if (journal->lost)
+        return NULL;
+    size_t needed = journal->group_length + sizeof(JournalRecord) + length;
+    if (length > UINT32_MAX)
+        needed = 0;
+    if (needed > journal->group_capacity)
+    {
+        size_t capacity = journal->group_capacity ? journal->group_capacity : 4096;
+        while (capacity < needed)
+            capacity *= 2;
+        unsigned char *grown = (unsigned char *)realloc(journal->group, capacity);
+        if (grown)
+        {
+            journal->group = grown;
+            journal->group_capacity = capacity;
+        }
+    }
+    if (needed == 0 || needed > journal->group_capacity)
+    {
+        journal->lost = 1;
+        return NULL;
+    }
+
+    JournalRecord record = {type, (uint32_t)length};
+    memcpy(journal->group + journal->group_length, &record, sizeof(record));
+    unsigned char *payload = journal->group + journal->group_length + sizeof(record);
+    journal->group_length = needed;
+    return payload;
+}
+
+void journalLogCreate(FileSystem *fs, const Inode *inode)
+{
+    if (!fs->journal)
+        return;
+    size_t name_length = strlen(inode->name);
+    unsigned char *payload = appendRecord(fs->journal, JOURNAL_CREATE, sizeof(JournalCreate) + name_length);
+    if (!payload)
+        return;
+    JournalCreate record = {inode->ino, inode->parent->ino, inode->mtime_ns, (uint32_t)inode->is_directory, (uint32_t)name_length};
+    memcpy(payload, &record, sizeof(record));
+    memcpy(payload + sizeof(record), inode->name, name_length);
+}
+
+void journalLogData(FileSystem *fs, const Inode *file)
+{
+    if (!fs->journal)
+        return;
+    unsigned char *payload = appendRecord(fs->journal, JOURNAL_DATA, sizeof(JournalData) + file->extent_count * 2 * sizeof(uint64_t));
+    if (!payload)
+        return;
+    JournalData record = {file->ino, file->file_size, file->mtime_ns, file->extent_count};
+    memcpy(payload, &record, sizeof(record));
+    payload += sizeof(record);
+    for (size_t e = 0; e < file->extent_count; e++)
+    {
+        uint64_t pair[2] = {file->extents[e].start, file->extents[e].length};
+        memcpy(payload, pair, sizeof(pair));
+        payload += sizeof(pair);
+    }
+}
+
+void journalLogRemove(FileSystem *fs, const Inode *inode)
+{
+    if (!fs->journal)
+        return;
+    unsigned char *payload = appendRecord(fs->journal, JOURNAL_REMOVE, sizeof(JournalRemove));
+    if (!payload)
+        return;
+    JournalRemove record = {inode->ino};
+    memcpy(payload, &record, sizeof(record));
+}
+
+void journalLogMove(FileSystem *fs, const Inode *inode)
+{
+    if (!fs->journal)
+        return;
+    size_t name_length = strlen(inode->name);
+    unsigned char *payload = appendRecord(fs->journal, JOURNAL_MOVE, sizeof(JournalMove) + name_length);
+    if (!payload)
+        return;
+    JournalMove record = {inode->ino, inode->parent->ino, (uint32_t)name_length};
+    memcpy(payload, &record, sizeof(record));
+    memcpy(payload + sizeof(record), inode->name, name_length);
+}
+
+void journalLogShare(FileSystem *fs, const Inode *dir)
+{
+    if (!fs->journal)
+        return;
+    unsigned char *payload = appendRecord(fs->journal, JOURNAL_SHARE, sizeof(JournalShare));
+    if (!payload)
+        return;
+    JournalShare record = {dir->ino, dir->share_source ? dir->share_source->ino : JOURNAL_NO_SOURCE};
+    memcpy(payload, &record, sizeof(record));
+}
+
+void journalNoteFree(FileSystem *fs, size_t start, size_t count)
+{
+    Journal *journal = fs->journal;
+    if (!journal || count == 0 || journal->freed_unknown)
+        return;
+    if (journal->freed_count > 0)
+    {
+        Extent *last = &journal->freed[journal->freed_count - 1];
+        if (last->start + last->length == start)
+        {
+            last->length += count;
+            return;
+        }
+    }
+    if (journal->freed_count == journal->freed_capacity)
+    {
+        size_t capacity = journal->freed_capacity ? journal->freed_capacity * 2 : 16;
+        Extent *grown = (Extent *)realloc(journal->freed, capacity * sizeof(Extent));
+        if (!grown)
+        {
+            journal->freed_unknown = 1;
+            return;
+        }
+        journal->freed = grown;
+        journal->freed_capacity = capacity;
+    }
+    journal->freed[journal->freed_count++] = (Extent){start, count};
+}
+
+void journalBeforeReuse(FileSystem *fs, const Extent *extents, size_t extent_count)
+{
+    Journal *journal = fs->journal;
+    if (!journal || (journal->freed_count == 0 && !journal->freed_unknown))
+        return;
+
+    int overlap = journal->freed_unknown;
+    for (size_t i = 0; i < extent_count && !overlap; i++)
+    {
+        for (size_t j = 0; j < journal->freed_count && !overlap; j++)
+        {
+            const Extent *freed = &journal->freed[j];
+            overlap = extents[i].start < freed->start + freed->length && freed->start < extents[i].start + extents[i].length;
+        }
+    }
+    if (overlap)
+        journalCommit(fs);
+}
+
+int journalCommit(FileSystem *fs)
+{
+    Journal *journal = fs->journal;
+    if (!journal)
+        return 0;
+    if (journal->lost)
+        return imageCheckpoint(fs);
+    if (journal->group_length == 0)
+    {
+        clearFreed(journal);
+        return 0;
+    }
+
+    // the records may point at blocks written since the last commit
+    if (imageFlushData(fs) < 0)
+        return imageCheckpoint(fs);
+
+    size_t records = journal->group_length;
+    unsigned char *payload = appendRecord(journal, JOURNAL_COMMIT, sizeof(JournalCommit));
+    if (!payload)
+        return imageCheckpoint(fs);
+    JournalCommit commit;
+    memset(&commit, 0, sizeof(commit));
+    commit.sequence = journal->sequence + 1;
+    commit.checksum = CHECKSUM_START;
+
+    // names and extents are no less private than the data: an encrypted
+    // image gets the records sealed, framed as one record in front
+    ImageCrypt *crypt = fs->crypt && fs->crypt->encrypted ? fs->crypt : NULL;
+    JournalRecord sealed = {JOURNAL_SEALED, (uint32_t)records};
+    if (crypt)
+    {
+        commit.write_id = cryptNextWrite(crypt);
+        cryptSeal(crypt, CRYPT_JOURNAL_INDEX, commit.write_id, journal->group, records, commit.tag);
+        commit.checksum = checksum(commit.checksum, (const unsigned char *)&sealed, sizeof(sealed));
+    }
+    commit.checksum = checksum(commit.checksum, journal->group, records);
+    memcpy(payload, &commit, sizeof(commit));
+
+    off_t end = (off_t)(sizeof(JournalHeader) + journal->bytes);
+    size_t frame = crypt ? sizeof(sealed) : 0;
+    if (lseek(journal->fd, end, SEEK_SET) != end || (crypt && writeAll(journal->fd, &sealed, sizeof(sealed)) != 0) ||
+        writeAll(journal->fd, journal->group, journal->group_length) != 0 || fsync(journal->fd) != 0)
+    {
+        // drop the torn group; a checkpoint covers it instead
+        if (ftruncate(journal->fd, end) != 0)
+            journal->lost = 1;
+        journal->group_length = records;
+        if (crypt)
+            cryptOpen(crypt, CRYPT_JOURNAL_INDEX, commit.write_id, journal->group, records, commit.tag);
+        return imageCheckpoint(fs);
+    }
+
+    journal->sequence++;
+    journal->bytes += frame + journal->group_length;
+    journal->commits++;
+    journal->group_length = 0;
+    clearFreed(journal);
+
+    // checkpoint lazily, once replaying the log would cost more than writing the metadata
+    if (journal->bytes >= JOURNAL_CHECKPOINT_BYTES)
+        return imageCheckpoint(fs);
+    return 0;
+}
+
+void journalStats(const FileSystem *fs, uint64_t *bytes, uint64_t *commits)
+{
+    *bytes = fs->journal ? fs->journal->bytes + fs->journal->group_length : 0;
+    *commits = fs->journal ? fs->journal->commits : 0;
+}
+
+static int applyCreate(FileSystem *fs, const unsigned char *payload, size_t length)
+{
+    JournalCreate record;
+    if (length < sizeof(record))
+        return -1;
+    memcpy(&record, payload, sizeof(record));
+    if (length - sizeof(record) != record.name_length || record.name_length == 0 || record.name_length >= MAX_NAME_LENGTH ||
+        record.ino >= fs->inode_count || record.parent >= fs->inode_count)
+        return -1;
+
+    Inode *parent = fs->inodes[record.parent];
+    if (fs->inodes[record.ino] || !parent || !parent->is_directory)
+        return -1;
+
+    char name[MAX_NAME_LENGTH];
+    memcpy(name, payload + sizeof(record), record.name_length);
+    name[record.name_length] = '\0';
+
+    // numbers are assigned here; the free list is rebuilt after the replay
+    Inode *inode = inodeRecordAlloc(fs);
+    if (!inode || !(inode->name = inodeNameDup(fs, name)))
+        return -1;
+    inode->name_hash = nameHash(name);
+    inode->ino = (size_t)record.ino;
+    inode->is_directory = (int)record.is_directory;
+    inode->mtime_ns = record.mtime_ns;
+    inode->parent = parent;
+    fs->inodes[inode->ino] = inode;
+    if (dirAddItem(parent, inode) != 0)
+    {
+        releaseInode(fs, inode);
+        return -1;
+    }
+    return 0;
+}
+
+static int applyData(FileSystem *fs, const unsigned char *payload, size_t length)
+{
+    JournalData record;
+    if (length < sizeof(record))
+        return -1;
+    memcpy(&record, payload, sizeof(record));
+    if ((length - sizeof(record)) / (2 * sizeof(uint64_t)) != record.extent_count ||
+        (length - sizeof(record)) % (2 * sizeof(uint64_t)) != 0 || record.ino >= fs->inode_count)
+        return -1;
+    Inode *file = fs->inodes[record.ino];
+    if (!file || file->is_directory)
+        return -1;
+
+    Extent *extents = NULL;
+    size_t blocks = 0;
+    if (record.extent_count > 0)
+    {
+        extents = (Extent *)malloc((size_t)record.extent_count * sizeof(Extent));
+        if (!extents)
+            return -1;
+    }
+    for (size_t e = 0; e < record.extent_count; e++)
+    {
+        uint64_t pair[2];
+        memcpy(pair, payload + sizeof(record) + e * sizeof(pair), sizeof(pair));
+        extents[e] = (Extent){(size_t)pair[0], (size_t)pair[1]};
+        blocks += extents[e].length;
+    }
+
+    // the new extents may reuse blocks of the old ones (defrag)
+    freeExtents(fs, file->extents, file->extent_count);
+    if (claimExtents(fs, extents, (size_t)record.extent_count) != 0)
+    {
+        claimExtents(fs, file->extents, file->extent_count);
+        free(extents);
+        return -1;
+    }
+    free(file->extents);
+    file->extents = extents;
+    file->extent_count = (size_t)record.extent_count;
+    // the image has the data but not its checksums yet
+    for (size_t e = 0; e < file->extent_count; e++)
+        dirtyMarkData(fs, extents[e].start, extents[e].length);
+    file->block_count = blocks;
+    file->file_size = (size_t)record.file_size;
+    file->mtime_ns = record.mtime_ns;
+    return 0;
+}
+
+static int applyRemove(FileSystem *fs, const unsigned char *payload, size_t length)
+{
+    JournalRemove record;
+    if (length != sizeof(record))
+        return -1;
+    memcpy(&record, payload, sizeof(record));
+    if (record.ino >= fs->inode_count)
+        return -1;
+    Inode *inode = fs->inodes[record.ino];
+    if (!inode || !inode->parent)
+        return -1;
+
+    // the subtree is freed right away: later records may reuse its blocks
+    dirRemoveItem(inode->parent, inode);
+    if (inode->is_directory)
+    {
+        if (reclaimDetach(fs, inode) != 0)
+            return -1;
+        reclaimAll(fs);
+        return 0;
+    }
+    freeExtents(fs, inode->extents, inode->extent_count);
+    releaseInode(fs, inode);
+    return 0;
+}
+
+static int applyMove(FileSystem *fs, const unsigned char *payload, size_t length)
+{
+    JournalMove record;
+    if (length < sizeof(record))
+        return -1;
+    memcpy(&record, payload, sizeof(record));
+    if (length - sizeof(record) != record.name_length || record.name_length == 0 || record.name_length >= MAX_NAME_LENGTH ||
+        record.ino >= fs->inode_count || record.parent >= fs->inode_count)
+        return -1;
+
+    Inode *inode = fs->inodes[record.ino];
+    Inode *parent = fs->inodes[record.parent];
+    if (!inode || !inode->parent || !parent || !parent->is_directory || isAncestor(inode, parent))
+        return -1;
+
+    char name[MAX_NAME_LENGTH];
+    memcpy(name, payload + sizeof(record), record.name_length);
+    name[record.name_length] = '\0';
+    if (dirLookup(parent, name) || moveInode(fs, inode, parent, name) != 0)
+        return -1;
+    if (inode->is_directory)
+        dcacheInvalidate(fs);
+    return 0;
+}
+
+static int applyShare(FileSystem *fs, const unsigned char *payload, size_t length)
+{
+    JournalShare record;
+    if (length != sizeof(record))
+        return -1;
+    memcpy(&record, payload, sizeof(record));
+    if (record.ino >= fs->inode_count || (record.source != JOURNAL_NO_SOURCE && record.source >= fs->inode_count))
+        return -1;
+    Inode *dir = fs->inodes[record.ino];
+    if (!dir || !dir->is_directory)
+        return -1;
+    if (record.source == JOURNAL_NO_SOURCE)
+    {
+        if (!dir->share_source)
+            return -1;
+        snapshotShare(dir, NULL);
+        return 0;
+    }
+
+    // a shared directory starts out empty and reads a directory that is
+    // not shared itself, nor one of its parents
+    Inode *source = fs->inodes[record.source];
+    if (!source || !source->is_directory || source->share_source || dir->share_source || dir->sharers ||
+        dir->directory_item_count > 0 || isAncestor(source, dir))
+        return -1;
+    snapshotShare(dir, source);
+    return 0;
+}
+
+// Apply the records of one committed group; returns how many failed.
+static size_t applyGroup(FileSystem *fs, const unsigned char *group, size_t length)
+{
+    size_t failed = 0;
+    size_t pos = 0;
+    while (pos < length)
+    {
+        JournalRecord record;
+        memcpy(&record, group + pos, sizeof(record));
+        const unsigned char *payload = group + pos + sizeof(record);
+        int result = -1;
+        if (record.type == JOURNAL_CREATE)
+            result = applyCreate(fs, payload, record.length);
+        else if (record.type == JOURNAL_DATA)
+            result = applyData(fs, payload, record.length);
+        else if (record.type == JOURNAL_REMOVE)
+            result = applyRemove(fs, payload, record.length);
+        else if (record.type == JOURNAL_MOVE)
+            result = applyMove(fs, payload, record.length);
+        else if (record.type == JOURNAL_SHARE)
+            result = applyShare(fs, payload, record.length);
+        failed += result != 0;
+        pos += sizeof(record) + record.length;
+    }
+    return failed;
+}
+
+size_t journalReplay(FileSystem *fs, uint64_t generation)
+{
+    FILE *file = fopen(JOURNAL_PATH, "rb");
+    if (!file)
+        return 0;
+    unsigned char *log = NULL;
+    long length = -1;
+    if (fseek(file, 0, SEEK_END) == 0)
+        length = ftell(file);
+    if (length >= (long)sizeof(JournalHeader) && fseek(file, 0, SEEK_SET) == 0)
+        log = (unsigned char *)malloc((size_t)length);
+    if (log && fread(log, 1, (size_t)length, file) != (size_t)length)
+    {
+        free(log);
+        log = NULL;
+    }
+    fclose(file);
+
+    JournalHeader header;
+    if (!log || (memcpy(&header, log, sizeof(header)), memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) ||
+        header.generation != generation)
+    {
+        // missing, unreadable or left over from an older checkpoint
+        free(log);
+        return 0;
+    }
+
+    // records are applied a whole group at a time, once its commit record
+    // checks out; numbers are taken directly, so the free list starts empty
+    ImageCrypt *crypt = fs->crypt && fs->crypt->encrypted ? fs->crypt : NULL;
+    fs->free_inode_count = 0;
+    size_t size = (size_t)length;
+    size_t pos = sizeof(header);
+    size_t group_start = pos;
+    size_t groups = 0;
+    size_t failed = 0;
+    while (size - pos >= sizeof(JournalRecord))
+    {
+        JournalRecord record;
+        memcpy(&record, log + pos, sizeof(record));
+        if (record.length > size - pos - sizeof(record))
+            break;
+        size_t next = pos + sizeof(record) + record.length;
+        if (record.type == JOURNAL_COMMIT)
+        {
+            JournalCommit commit;
+            if (record.length != sizeof(commit))
+                break;
+            memcpy(&commit, log + pos + sizeof(record), sizeof(commit));
+            if (commit.sequence != groups + 1 || commit.checksum != checksum(CHECKSUM_START, log + group_start, pos - group_start))
+                break;
+            unsigned char *records = log + group_start;
+            size_t records_length = pos - group_start;
+            if (crypt)
+            {
+                // one JOURNAL_SEALED record holds the others
+                JournalRecord sealed;
+                if (records_length < sizeof(sealed))
+                    break;
+                memcpy(&sealed, records, sizeof(sealed));
+                records += sizeof(sealed);
+                records_length -= sizeof(sealed);
+                if (sealed.type != JOURNAL_SEALED || sealed.length != records_length ||
+                    cryptOpen(crypt, CRYPT_JOURNAL_INDEX, commit.write_id, records, records_length, commit.tag) != 0)
+                    break;
+            }
+            failed += applyGroup(fs, records, records_length);
+            groups++;
+            group_start = next;
+        }
+        pos = next;
+    }
+    free(log);
+
+    reclaimAll(fs);
+    inodeTableRebuildFreeList(fs);
+    if (groups > 0)
+    {
+        dcacheInvalidate(fs);
+        printf("Replayed %zu journal groups.\n", groups);
+    }
+    if (failed > 0)
+        printf("%zu journal records could not be applied.\n", failed);
+    return groups;
+}
@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+#include "path.h"
+#include "directory.h"
+#include "snapshot.h"
+
+#define DCACHE_SIZE 1024 // direct-mapped entries
+#define MAX_PATH_COMPONENTS (MAX_PATH_LENGTH / 2 + 1)
+
+typedef struct DentryEntry
+{
+    uint64_t generation; // valid while equal to the cache generation
+    const Inode *base;
+    Inode *target;
+    uint32_t hash;
+    size_t length;
+    char prefix[MAX_PATH_LENGTH];
+} DentryEntry;
+
+struct DentryCache
+{
+    uint64_t generation;
+    size_t hits;
+    size_t misses;
+    DentryEntry entries[DCACHE_SIZE];
+};
+
+static DentryCache *getCache(FileSystem *fs)
+{
+    if (!fs->dcache)
+    {
+        fs->dcache = (DentryCache *)calloc(1, sizeof(DentryCache));
+        if (fs->dcache)
+            fs->dcache->generation = 1; // zeroed entries start out invalid
+    }
+    return fs->dcache;
+}
+
+static uint32_t prefixHash(const Inode *base, const char *prefix, size_t length)
+{
+    uint32_t hash = 2166136261u ^ (uint32_t)base->ino;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)prefix[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static Inode *cacheLookup(DentryCache *cache, const Inode *base, const char *prefix, size_t length)
+{
+    uint32_t hash = prefixHash(base, prefix, length);
+    DentryEntry *entry = &cache->entries[hash % DCACHE_SIZE];
+    if (entry->generation != cache->generation || entry->hash != hash || entry->base != base ||
+        entry->length != length || memcmp(entry->prefix, prefix, length) != 0)
+        return NULL;
+    return entry->target;
+}
+
+static void cacheStore(DentryCache *cache, const Inode *base, const char *prefix, size_t length, Inode *target)
+{
+    if (length >= MAX_PATH_LENGTH)
+        return;
+    uint32_t hash = prefixHash(base, prefix, length);
+    DentryEntry *entry = &cache->entries[hash % DCACHE_SIZE];
+    entry->generation = cache->generation;
+    entry->base = base;
+    entry->target = target;
+    entry->hash = hash;
+    entry->length = length;
+    memcpy(entry->prefix, prefix, length);
+}
+
+// Item `name` of `dir`. A shared directory gets items of its own first
+// (see snapshot.h), so a walk into a snapshot stays in it.
+static Inode *lookup(FileSystem *fs, Inode *dir, const char *name)
+{
+    if (dir->share_source && snapshotOpen(fs, dir) != 0)
+        return NULL;
+    return dirLookup(dir, name);
+}
+
+// Follow the first `length` bytes of `path` from `base`; every component
+// must name a directory. Starts from the longest cached prefix and caches
+// each prefix it resolves.
+static Inode *walkDirectories(FileSystem *fs, Inode *base, const char *path, size_t length)
+{
+    if (length == 0)
+        return base;
+
+    // component end offsets
+    size_t ends[MAX_PATH_COMPONENTS];
+    size_t count = 0;
+    for (size_t pos = 0; pos < length && count < MAX_PATH_COMPONENTS;)
+    {
+        while (pos < length && path[pos] == '/')
+            pos++;
+        if (pos == length)
+            break;
+        while (pos < length && path[pos] != '/')
+            pos++;
+        ends[count++] = pos;
+    }
+    if (count == MAX_PATH_COMPONENTS)
+        return NULL;
+
+    DentryCache *cache = getCache(fs);
+    Inode *dir = base;
+    size_t done = 0; // components already resolved
+    if (cache)
+    {
+        for (size_t c = count; c > 0; c--)
+        {
+            Inode *hit = cacheLookup(cache, base, path, ends[c - 1]);
+            if (hit)
+            {
+                dir = hit;
+                done = c;
+                break;
+            }
+        }
+        if (done == count)
+        {
+            cache->hits++;
+            return dir;
+        }
+        cache->misses++;
+    }
+
+    for (size_t c = done; c < count; c++)
+    {
+        size_t start = c == 0 ? 0 : ends[c - 1];
+        while (path[start] == '/')
+            start++;
+        size_t n = ends[c] - start;
+
+        if (n == 1 && path[start] == '.')
+            ;
+        else if (n == 2 && path[start] == '.' && path[start + 1] == '.')
+        {
+            if (dir->parent)
+                dir = dir->parent;
+        }
+        else
+        {
+            char name[MAX_NAME_LENGTH];
+            if (n >= MAX_NAME_LENGTH)
+                return NULL;
+            memcpy(name, path + start, n);
+            name[n] = '\0';
+            Inode *child = lookup(fs, dir, name);
+            if (!child || !child->is_directory)
+                return NULL;
+            dir = child;
+        }
+        if (cache)
+            cacheStore(cache, base, path, ends[c], dir);
+    }
+    return dir;
+}
+
+// Split `path` into its directory part (walked) and last component.
+static Inode *splitPath(FileSystem *fs, const char *path, const char **leaf, size_t *leaf_length)
+{
+    Inode *base = path[0] == '/' ? fs->root : fs->current_directory;
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/')
+        length--;
+
+    size_t split = length;
+    while (split > 0 && path[split - 1] != '/')
+        split--;
+    size_t prefix_length = split;
+    while (prefix_length > 0 && path[prefix_length - 1] == '/')
+        prefix_length--;
+
+    *leaf = path + split;
+    *leaf_length = length - split;
+    return walkDirectories(fs, base, path, prefix_length);
+}
+
+Inode *resolvePath(FileSystem *fs, const char *path)
+{
+    if (!path || !*path)
+        return NULL;
+
+    const char *leaf;
+    size_t leaf_length;
+    Inode *dir = splitPath(fs, path, &leaf, &leaf_length);
+    if (!dir)
+        return NULL;
+
+    if (leaf_length == 0 || (leaf_length == 1 && leaf[0] == '.'))
+        return dir;
+    if (leaf_length == 2 && leaf[0] == '.' && leaf[1] == '.')
+        return dir->parent ? dir->parent : dir;
+
+    char name[MAX_NAME_LENGTH];
+    if (leaf_length >= MAX_NAME_LENGTH)
+        return NULL;
+    memcpy(name, leaf, leaf_length);
+    name[leaf_length] = '\0';
+    return lookup(fs, dir, name);
+}
+
+Inode *resolveParent(FileSystem *fs, const char *path, char leaf[MAX_NAME_LENGTH])
+{
+    if (!path || !*path)
+        return NULL;
+
+    const char *last;
+    size_t last_length;
+    Inode *dir = splitPath(fs, path, &last, &last_length);
+    if (!dir || last_length == 0 || last_length >= MAX_NAME_LENGTH || last[0] == '/')
+        return NULL;
+    if ((last_length == 1 && last[0] == '.') || (last_length == 2 && last[0] == '.' && last[1] == '.'))
+        return NULL;
+
+    memcpy(leaf, last, last_length);
+    leaf[last_length] = '\0';
+    return dir;
+}
+
+Inode *resolveDestination(FileSystem *fs, const char *path, const char *name, char leaf[MAX_NAME_LENGTH])
+{
+    Inode *dir = resolvePath(fs, path);
+    if (dir && dir->is_directory)
+    {
+        memcpy(leaf, name, strlen(name) + 1);
+        return dir;
+    }
+    return resolveParent(fs, path, leaf);
+}
+
+int inSnapshots(const FileSystem *fs, const Inode *dir, const char *name)
+{
+    // the entry's ancestor right below the root decides
+    for (; dir && dir != fs->root; dir = dir->parent)
+        name = dir->name;
+    return dir && name && strcmp(name, SNAPSHOT_DIR) == 0;
+}
+
+int isAncestor(const Inode *ancestor, const Inode *inode)
+{
+    for (; inode; inode = inode->parent)
+    {
+        if (inode == ancestor)
+            return 1;
+    }
+    return 0;
+}
+
+void dcacheInvalidate(FileSystem *fs)
+{
+    if (fs->dcache)
+        fs->dcache->generation++;
+}
+
+void dcacheDestroy(FileSystem *fs)
+{
+    free(fs->dcache);
+    fs->dcache = NULL;
+}
+
+void dcacheStats(const FileSystem *fs, size_t *hits, size_t *misses)
+{
+    *hits = fs->dcache ? fs->dcache->hits : 0;
+    *misses = fs->dcache ? fs->dcache->misses : 0;
+}
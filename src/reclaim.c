@@ -0,0 +1,165 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "file_system.h"
+#include "reclaim.h"
+#include "block_alloc.h"
+#include "inode_table.h"
+#include "snapshot.h"
+
+#define RECLAIM_BATCH 256 // extents freed together
+
+// The stack holds queued subtree roots and, above each, the chain of
+// directories currently being emptied. A directory is popped and released
+// once its last item has been taken off; files never go on the stack.
+
+static int reserveStack(FileSystem *fs)
+{
+    if (fs->reclaim_depth < fs->reclaim_capacity)
+        return 0;
+    size_t capacity = fs->reclaim_capacity ? fs->reclaim_capacity * 2 : 16;
+    Inode **grown = (Inode **)realloc(fs->reclaim_stack, capacity * sizeof(Inode *));
+    if (!grown)
+        return -1;
+    fs->reclaim_stack = grown;
+    fs->reclaim_capacity = capacity;
+    return 0;
+}
+
+static int compareStart(const void *a, const void *b)
+{
+    const Extent *x = (const Extent *)a;
+    const Extent *y = (const Extent *)b;
+    return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+// free the batched extents as few, sorted ranges
+static void flushBatch(FileSystem *fs, Extent *batch, size_t *count)
+{
+    if (*count == 0)
+        return;
+    qsort(batch, *count, sizeof(Extent), compareStart);
+    size_t n = 0;
+    for (size_t i = 0; i < *count; i++)
+    {
+        if (n > 0 && batch[n - 1].start + batch[n - 1].length == batch[i].start)
+            batch[n - 1].length += batch[i].length;
+        else
+            batch[n++] = batch[i];
+    }
+    freeExtents(fs, batch, n);
+    *count = 0;
+}
+
+static void releaseFile(FileSystem *fs, Inode *file, Extent *batch, size_t *batched)
+{
+    if (file->extent_count > RECLAIM_BATCH)
+        freeExtents(fs, file->extents, file->extent_count);
+    else
+    {
+        if (*batched + file->extent_count > RECLAIM_BATCH)
+            flushBatch(fs, batch, batched);
+        for (size_t e = 0; e < file->extent_count; e++)
+            batch[(*batched)++] = file->extents[e];
+    }
+    releaseInode(fs, file);
+}
+
+int reclaimDetach(FileSystem *fs, Inode *dir)
+{
+    if (reserveStack(fs) != 0)
+        return -1;
+    // snapshots still sharing a directory keep its items
+    snapshotAdopt(fs, dir);
+    dir->parent = NULL;
+    fs->reclaim_stack[fs->reclaim_depth++] = dir;
+    return 0;
+}
+
+int reclaimStep(FileSystem *fs, size_t max_inodes)
+{
+    Extent batch[RECLAIM_BATCH];
+    size_t batched = 0;
+    size_t released = 0;
+
+    while (fs->reclaim_depth > 0 && released < max_inodes)
+    {
+        Inode *dir = fs->reclaim_stack[fs->reclaim_depth - 1];
+        if (dir->directory_item_count == 0)
+        {
+            fs->reclaim_depth--;
+            releaseInode(fs, dir);
+            released++;
+            continue;
+        }
+
+        Inode *item = dir->directory_items[dir->directory_item_count - 1];
+        if (item->is_directory)
+        {
+            if (reserveStack(fs) != 0)
+                break;
+            snapshotAdopt(fs, item);
+            fs->reclaim_stack[fs->reclaim_depth++] = item;
+        }
+        else
+        {
+            releaseFile(fs, item, batch, &batched);
+            released++;
+        }
+        dir->directory_item_count--;
+    }
+
+    flushBatch(fs, batch, &batched);
+    return fs->reclaim_depth > 0;
+}
+
+void reclaimAll(FileSystem *fs)
+{
+    while (reclaimStep(fs, SIZE_MAX))
+        ;
+}
+
+void reclaimPending(const FileSystem *fs, size_t *inodes, size_t *blocks)
+{
+    *inodes = 0;
+    *blocks = 0;
+    if (fs->reclaim_depth == 0)
+        return;
+
+    // stack entries are counted themselves plus whatever items they still hold
+    size_t capacity = fs->reclaim_depth + 16;
+    size_t depth = 0;
+    const Inode **stack = (const Inode **)malloc(capacity * sizeof(Inode *));
+    if (!stack)
+        return;
+    for (size_t i = 0; i < fs->reclaim_depth; i++)
+        stack[depth++] = fs->reclaim_stack[i];
+
+    while (depth > 0)
+    {
+        const Inode *inode = stack[--depth];
+        (*inodes)++;
+        *blocks += inode->block_count;
+        if (!inode->is_directory)
+            continue;
+        if (depth + inode->directory_item_count > capacity)
+        {
+            while (depth + inode->directory_item_count > capacity)
+                capacity *= 2;
+            const Inode **grown = (const Inode **)realloc(stack, capacity * sizeof(Inode *));
+            if (!grown)
+                break;
+            stack = grown;
+        }
+        for (size_t i = 0; i < inode->directory_item_count; i++)
+            stack[depth++] = inode->directory_items[i];
+    }
+    free(stack);
+}
+
+void reclaimDestroy(FileSystem *fs)
+{
+    free(fs->reclaim_stack);
+    fs->reclaim_stack = NULL;
+    fs->reclaim_depth = 0;
+    fs->reclaim_capacity = 0;
+}
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "file_system.h"
+#include "snapshot.h"
+#include "block_alloc.h"
+#include "dedup.h"
+#include "directory.h"
+#include "dirty.h"
+#include "inode_table.h"
+#include "journal.h"
+#include "path.h"
+#include "reclaim.h"
+#include "worker_pool.h"
+
+// Extents for `copy` naming the blocks of `file`, each with one more reference.
+static int shareFile(FileSystem *fs, Inode *copy, const Inode *file)
+{
+    copy->file_size = file->file_size;
+    if (file->extent_count == 0)
+        return 0;
+    Extent *extents = (Extent *)malloc(file->extent_count * sizeof(Extent));
+    if (!extents)
+        return -1;
+    memcpy(extents, file->extents, file->extent_count * sizeof(Extent));
+    for (size_t e = 0; e < file->extent_count; e++)
+    {
+        if (dedupAddReferences(fs, extents[e].start, extents[e].length) != 0)
+        {
+            // the original still holds these, so they only lose the references
+            freeExtents(fs, extents, e);
+            free(extents);
+            return -1;
+        }
+    }
+    copy->extents = extents;
+    copy->extent_count = file->extent_count;
+    copy->block_count = file->block_count;
+    return 0;
+}
+
+// Release the items of `dir` made by copyItems().
+static void dropItems(FileSystem *fs, Inode *dir)
+{
+    for (size_t i = 0; i < dir->directory_item_count; i++)
+    {
+        Inode *item = dir->directory_items[i];
+        freeExtents(fs, item->extents, item->extent_count);
+        releaseInode(fs, item);
+    }
+    dirClearItems(dir);
+}
+
+// Give the empty `dir` a copy of each item of `source` but `skip`: files
+// share their blocks, directories become shared directories. Returns -1,
+// with `dir` still empty, if inodes or memory run out.
+static int copyItems(FileSystem *fs, Inode *dir, const Inode *source, const Inode *skip)
+{
+    size_t count = source->directory_item_count;
+    if (count > fs->free_inode_count && fs->reclaim_depth > 0)
+        reclaimAll(fs);
+    if (count > fs->free_inode_count || dirReserve(dir, count) != 0)
+        return -1;
+    for (size_t i = 0; i < count; i++)
+    {
+        Inode *item = source->directory_items[i];
+        if (item == skip)
+            continue;
+        Inode *copy = newInode(fs, item->name, item->is_directory, dir);
+        if (!copy || (!item->is_directory && shareFile(fs, copy, item) != 0))
+        {
+            if (copy)
+                releaseInode(fs, copy);
+            dropItems(fs, dir);
+            return -1;
+        }
+        copy->mtime_ns = item->mtime_ns;
+        if (item->is_directory)
+            snapshotShare(copy, item->share_source ? item->share_source : item);
+        dirAddItem(dir, copy); // reserved above
+    }
+    dirtyMarkTree(fs);
+    return 0;
+}
+
+// Journal the items copyItems() gave `dir`.
+static void logItems(FileSystem *fs, const Inode *dir)
+{
+    for (size_t i = 0; i < dir->directory_item_count; i++)
+    {
+        const Inode *item = dir->directory_items[i];
+        journalLogCreate(fs, item);
+        if (item->is_directory)
+            journalLogShare(fs, item);
+        else
+            journalLogData(fs, item);
+    }
+}
+
+// Copy the items of its source into the shared directory `dir`. Queued
+// removals must be done: they may hand the source's items to a sharer,
+// which a replay of the journal does right away.
+static int materialize(FileSystem *fs, Inode *dir)
+{
+    if (!dir->share_source)
+        return 0;
+    if (copyItems(fs, dir, dir->share_source, NULL) != 0)
+        return -1;
+    logItems(fs, dir);
+    snapshotShare(dir, NULL);
+    journalLogShare(fs, dir);
+    return 0;
+}
+
+int snapshotUnshare(FileSystem *fs, Inode *dir)
+{
+    for (;;)
+    {
+        // copying the sharers of the topmost shared directory on the way
+        // gives the next one down its sharers
+        Inode *top = NULL;
+        for (Inode *inode = dir; inode; inode = inode->parent)
+        {
+            if (inode->sharers)
+                top = inode;
+        }
+        if (!top)
+            return 0;
+        if (fs->reclaim_depth > 0)
+        {
+            reclaimAll(fs);
+            continue;
+        }
+        while (top->sharers)
+        {
+            if (materialize(fs, top->sharers) != 0)
+            {
+                printf("Not enough inodes or memory to copy '%s' into the snapshots sharing it.\n", top->name);
+                return -1;
+            }
+        }
+    }
+}
+
+int snapshotOpen(FileSystem *fs, Inode *dir)
+{
+    if (!dir->share_source)
+        return 0;
+    if (fs->reclaim_depth > 0)
+        reclaimAll(fs);
+    if (materialize(fs, dir) == 0)
+        return 0;
+    printf("Not enough inodes or memory to open '%s' in its snapshot.\n", dir->name);
+    return -1;
+}
+
+const Inode *snapshotItems(const Inode *dir)
+{
+    return dir->share_source ? dir->share_source : dir;
+}
+
+void snapshotShare(Inode *dir, Inode *source)
+{
+    if (dir->share_source)
+    {
+        Inode **link = &dir->share_source->sharers;
+        while (*link != dir)
+            link = &(*link)->next_sharer;
+        *link = dir->next_sharer;
+        dir->next_sharer = NULL;
+    }
+    dir->share_source = source;
+    if (source)
+    {
+        dir->next_sharer = source->sharers;
+        source->sharers = dir;
+    }
+}
+
+void snapshotAdopt(FileSystem *fs, Inode *dir)
+{
+    if (!dir->sharers)
+        return;
+    // the lowest number, so a replay of the journal picks the same one
+    Inode *heir = dir->sharers;
+    for (Inode *sharer = heir->next_sharer; sharer; sharer = sharer->next_sharer)
+    {
+        if (sharer->ino < heir->ino)
+            heir = sharer;
+    }
+    snapshotShare(heir, NULL);
+
+    dirClearItems(heir);
+    heir->directory_items = dir->directory_items;
+    heir->directory_item_count = dir->directory_item_count;
+    heir->directory_item_capacity = dir->directory_item_capacity;
+    heir->index = dir->index;
+    for (size_t i = 0; i < heir->directory_item_count; i++)
+        heir->directory_items[i]->parent = heir;
+    dir->directory_items = NULL;
+    dir->directory_item_count = 0;
+    dir->directory_item_capacity = 0;
+    dir->index = NULL;
+
+    for (Inode *sharer = dir->sharers; sharer; sharer = sharer->next_sharer)
+        sharer->share_source = heir;
+    heir->sharers = dir->sharers;
+    dir->sharers = NULL;
+    dirtyMarkTree(fs);
+    dcacheInvalidate(fs);
+}
+
+void snapshot(FileSystem *fs, const char *name)
+{
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    if (!*name || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+        strlen(name) >= MAX_NAME_LENGTH)
+    {
+        printf("Invalid snapshot name '%s'.\n", name);
+        return;
+    }
+
+    // snapshots live in /.snapshots, which they leave out themselves
+    Inode *dir = dirLookup(fs->root, SNAPSHOT_DIR);
+    if (dir && !dir->is_directory)
+    {
+        printf("'/%s' is a file; cannot store snapshots.\n", SNAPSHOT_DIR);
+        return;
+    }
+    if (dir && dirLookup(dir, name))
+    {
+        printf("Snapshot '%s' already exists.\n", name);
+        return;
+    }
+    size_t inodes = fs->root->directory_item_count + 1;
+    if (inodes > fs->free_inode_count && fs->reclaim_depth > 0)
+        reclaimAll(fs);
+    if (inodes > fs->free_inode_count)
+    {
+        printf("Not enough inodes for snapshot '%s'.\n", name);
+        return;
+    }
+    if (!dir)
+    {
+        dir = newInode(fs, SNAPSHOT_DIR, 1, fs->root);
+        if (!dir || dirAddItem(fs->root, dir) != 0)
+        {
+            if (dir)
+                releaseInode(fs, dir);
+            printf("Failed to create '/%s'.\n", SNAPSHOT_DIR);
+            return;
+        }
+        journalLogCreate(fs, dir);
+    }
+
+    // the root is copied right away: it changes too often to be shared,
+    // and its copy must leave out /SNAPSHOT_DIR
+    Inode *copy = newInode(fs, name, 1, dir);
+    if (!copy || copyItems(fs, copy, fs->root, dir) != 0 || dirAddItem(dir, copy) != 0)
+    {
+        if (copy)
+        {
+            dropItems(fs, copy);
+            releaseInode(fs, copy);
+        }
+        printf("Not enough memory for snapshot '%s'.\n", name);
+        return;
+    }
+    journalLogCreate(fs, copy);
+    logItems(fs, copy);
+    printf("Snapshot '/%s/%s' taken in %.3f s with %zu inodes; its directories are copied as they change.\n",
+           SNAPSHOT_DIR, name, secondsSince(&started), copy->directory_item_count + 1);
+}
@@ -0,0 +1,229 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "file_system.h"
+#include "host_io.h"
+#include "path.h"
+#include "snapshot.h"
+#include "worker_pool.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0 // only Windows distinguishes text and binary opens
+#endif
+
+// get -r walks the virtual subtree on this thread and creates the host
+// directories, parents before children, then writes the files from a
+// worker pool. data_blocks is only read while the pool runs, so the jobs
+// share nothing but their own output files.
+
+enum
+{
+    EXPORT_WRITTEN,
+    EXPORT_CURRENT, // host copy already up to date
+    EXPORT_CORRUPT, // a block failed its checksum; nothing written
+    EXPORT_FAILED
+};
+
+typedef struct ExportJob
+{
+    char *host_path;
+    const Inode *file;
+    int result;
+} ExportJob;
+
+typedef struct ExportPlan
+{
+    const FileSystem *fs;
+    ExportJob *jobs;
+    size_t job_count;
+    size_t job_capacity;
+    size_t dirs;
+    size_t failed_dirs;
+    int skip_current;
+} ExportPlan;
+
+typedef struct ExportDir
+{
+    const Inode *dir;
+    char *host_path;
+} ExportDir;
+
+static int addJob(ExportPlan *plan, char *host_path, const Inode *file)
+{
+    if (plan->job_count == plan->job_capacity)
+    {
+        size_t capacity = plan->job_capacity ? plan->job_capacity * 2 : 16;
+        ExportJob *grown = (ExportJob *)realloc(plan->jobs, capacity * sizeof(ExportJob));
+        if (!grown)
+            return -1;
+        plan->jobs = grown;
+        plan->job_capacity = capacity;
+    }
+    plan->jobs[plan->job_count++] = (ExportJob){host_path, file, EXPORT_FAILED};
+    return 0;
+}
+
+static void planTree(ExportPlan *plan, const Inode *root, char *host_root)
+{
+    size_t depth = 0;
+    size_t capacity = 16;
+    ExportDir *stack = (ExportDir *)malloc(capacity * sizeof(ExportDir));
+    if (!stack)
+    {
+        free(host_root);
+        return;
+    }
+    stack[depth++] = (ExportDir){root, host_root};
+
+    while (depth > 0)
+    {
+        ExportDir current = stack[--depth];
+        // a directory of a snapshot may still read another's items
+        const Inode *items = snapshotItems(current.dir);
+        for (size_t i = 0; i < items->directory_item_count; i++)
+        {
+            const Inode *item = items->directory_items[i];
+            char *path = hostPathJoin(current.host_path, item->name);
+            if (path && !item->is_directory && addJob(plan, path, item) == 0)
+                continue;
+            if (path && item->is_directory && hostMakeDir(path) == 0)
+            {
+                if (depth == capacity)
+                {
+                    ExportDir *grown = (ExportDir *)realloc(stack, capacity * 2 * sizeof(ExportDir));
+                    if (grown)
+                    {
+                        stack = grown;
+                        capacity *= 2;
+                    }
+                }
+                if (depth < capacity)
+                {
+                    plan->dirs++;
+                    stack[depth++] = (ExportDir){item, path};
+                    continue;
+                }
+            }
+            printf("Failed to export '%s'.\n", path ? path : item->name);
+            plan->failed_dirs += item->is_directory;
+            free(path);
+        }
+        free(current.host_path);
+    }
+    free(stack);
+}
+
+static int hostCopyCurrent(const char *host_path, const Inode *file)
+{
+    struct stat st;
+    return stat(host_path, &st) == 0 && S_ISREG(st.st_mode) &&
+           (size_t)st.st_size == file->file_size &&
+           (int64_t)st.st_mtim.tv_sec * NANOSECONDS_PER_SECOND + st.st_mtim.tv_nsec == file->mtime_ns;
+}
+
+static void exportJob(void *context, size_t i)
+{
+    ExportPlan *plan = (ExportPlan *)context;
+    ExportJob *job = &plan->jobs[i];
+    if (plan->skip_current && hostCopyCurrent(job->host_path, job->file))
+    {
+        job->result = EXPORT_CURRENT;
+        return;
+    }
+
+    int fd = open(job->host_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0)
+        return;
+    int result = writeFileData(plan->fs, job->file, fd);
+    if (result == 0)
+    {
+        // stamp the host copy with the inode's time, to the nanosecond, so
+        // -u can tell it from a file replaced within the same second
+        struct timespec times[2];
+        times[0].tv_sec = (time_t)(job->file->mtime_ns / NANOSECONDS_PER_SECOND);
+        times[0].tv_nsec = (long)(job->file->mtime_ns % NANOSECONDS_PER_SECOND);
+        times[1] = times[0];
+        futimens(fd, times);
+    }
+    if (close(fd) != 0 || result != 0)
+    {
+        if (result == -2)
+        {
+            remove(job->host_path);
+            job->result = EXPORT_CORRUPT;
+        }
+        return;
+    }
+    job->result = EXPORT_WRITTEN;
+}
+
+void getTree(FileSystem *fs, const char *path, const char *hostdir, int skip_current)
+{
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    Inode *target = resolvePath(fs, path);
+    if (!target)
+    {
+        printf("'%s' not found.\n", path);
+        return;
+    }
+    if (hostMakeDir(hostdir) != 0)
+    {
+        printf("Failed to create host directory '%s'.\n", hostdir);
+        return;
+    }
+
+    // a directory's contents land in hostdir; a single file lands inside it
+    ExportPlan plan = {0};
+    plan.fs = fs;
+    plan.skip_current = skip_current;
+    if (target->is_directory)
+    {
+        char *host_root = strdup(hostdir);
+        if (host_root)
+            planTree(&plan, target, host_root);
+    }
+    else
+    {
+        char *host_path = hostPathJoin(hostdir, target->name);
+        if (!host_path || addJob(&plan, host_path, target) != 0)
+            free(host_path);
+    }
+
+    size_t threads = runParallel(plan.job_count, exportJob, &plan);
+
+    size_t written = 0, current = 0, failed = plan.failed_dirs, bytes = 0;
+    for (size_t i = 0; i < plan.job_count; i++)
+    {
+        ExportJob *job = &plan.jobs[i];
+        if (job->result == EXPORT_WRITTEN)
+        {
+            written++;
+            bytes += job->file->file_size;
+        }
+        else if (job->result == EXPORT_CURRENT)
+            current++;
+        else if (job->result == EXPORT_CORRUPT)
+        {
+            printf("Corrupt '%s': a block failed its checksum.\n", job->host_path);
+            failed++;
+        }
+        else
+        {
+            printf("Failed to write '%s'.\n", job->host_path);
+            failed++;
+        }
+        free(job->host_path);
+    }
+    free(plan.jobs);
+
+    double seconds = secondsSince(&started);
+    printf("Exported %zu files and %zu directories to '%s' (%zu up to date, %zu failed) in %.3f s with %zu threads: %.1f files/s, %.1f MB/s\n",
+           written, plan.dirs, hostdir, current, failed, seconds, threads,
+           written / seconds, bytes / seconds / (1024.0 * 1024.0));
+}
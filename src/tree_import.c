@@ -0,0 +1,370 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "file_system.h"
+#include "block_alloc.h"
+#include "directory.h"
+#include "host_io.h"
+#include "inode_table.h"
+#include "dirty.h"
+#include "journal.h"
+#include "path.h"
+#include "snapshot.h"
+#include "worker_pool.h"
+#include "dedup.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0 // only Windows distinguishes text and binary opens
+#endif
+
+// put -r runs in three passes:
+//  1. this thread walks the host tree, creating the virtual directories and,
+//     per host directory, the file inodes with one block reservation shared
+//     by all of its files
+//  2. a worker pool opens the host files, reads them into their blocks and
+//     fingerprints them; each job only writes its own blocks, so nothing
+//     is locked
+//  3. files that could not be read are unlinked and freed again, the
+//     others share the blocks already stored (see dedup.h)
+
+typedef struct ImportJob
+{
+    char *host_path;
+    Inode *file;
+    uint64_t *prints; // of the file's blocks once read, or NULL
+    int failed;
+} ImportJob;
+
+typedef struct ImportPlan
+{
+    FileSystem *fs;
+    ImportJob *jobs;
+    size_t job_count;
+    size_t job_capacity;
+    size_t dirs;
+    size_t skipped;
+} ImportPlan;
+
+typedef struct HostDir
+{
+    char *path;
+    Inode *dir;
+} HostDir;
+
+typedef struct PendingFile
+{
+    char *path;
+    const char *name; // tail of path
+    size_t size;
+} PendingFile;
+
+static int growArray(void **items, size_t *capacity, size_t count, size_t item_size)
+{
+    if (count < *capacity)
+        return 0;
+    size_t grown_capacity = *capacity ? *capacity * 2 : 16;
+    void *grown = realloc(*items, grown_capacity * item_size);
+    if (!grown)
+        return -1;
+    *items = grown;
+    *capacity = grown_capacity;
+    return 0;
+}
+
+// Cut the next `count` blocks off a shared reservation; the cursor only
+// moves on success.
+static int takeReserved(const Extent *pool, size_t pool_count, size_t *cursor, size_t *offset,
+                        size_t count, Extent **extents, size_t *extent_count)
+{
+    *extents = NULL;
+    *extent_count = 0;
+    if (count == 0)
+        return 0;
+    Extent *out = (Extent *)malloc((pool_count - *cursor) * sizeof(Extent));
+    if (!out)
+        return -1;
+
+    size_t n = 0;
+    size_t c = *cursor;
+    size_t o = *offset;
+    while (count > 0)
+    {
+        size_t take = pool[c].length - o;
+        if (take > count)
+            take = count;
+        out[n++] = (Extent){pool[c].start + o, take};
+        count -= take;
+        o += take;
+        if (o == pool[c].length)
+        {
+            c++;
+            o = 0;
+        }
+    }
+    Extent *shrunk = (Extent *)realloc(out, n * sizeof(Extent));
+    *extents = shrunk ? shrunk : out;
+    *extent_count = n;
+    *cursor = c;
+    *offset = o;
+    return 0;
+}
+
+// Create the inodes of one host directory's files and give them blocks,
+// from a single reservation when the space comes in one piece.
+static void reserveFiles(ImportPlan *plan, Inode *dir, PendingFile *files, size_t file_count)
+{
+    FileSystem *fs = plan->fs;
+    size_t total = 0;
+    for (size_t i = 0; i < file_count; i++)
+        total += (files[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    Extent *pool = NULL;
+    size_t pool_count = 0;
+    size_t cursor = 0, offset = 0;
+    int pooled = total > 0 && allocateBlocks(fs, total, &pool, &pool_count) == 0;
+
+    for (size_t i = 0; i < file_count; i++)
+    {
+        size_t blocks = (files[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        Inode *file = NULL;
+        Extent *extents = NULL;
+        size_t extent_count = 0;
+        int reserved = 0;
+
+        if (growArray((void **)&plan->jobs, &plan->job_capacity, plan->job_count, sizeof(ImportJob)) == 0)
+            file = newInode(fs, files[i].name, 0, dir);
+        if (file)
+        {
+            if (pooled)
+                reserved = takeReserved(pool, pool_count, &cursor, &offset, blocks, &extents, &extent_count) == 0;
+            else
+                reserved = allocateBlocks(fs, blocks, &extents, &extent_count) == 0;
+        }
+        if (reserved && dirAddItem(dir, file) != 0)
+        {
+            freeExtents(fs, extents, extent_count);
+            free(extents);
+            reserved = 0;
+        }
+        if (!reserved)
+        {
+            if (file)
+                releaseInode(fs, file);
+            printf("Skipped '%s': not enough inodes or space.\n", files[i].path);
+            free(files[i].path);
+            plan->skipped++;
+            continue;
+        }
+
+        // workers fill these blocks; mark them here, before any thread runs
+        for (size_t e = 0; e < extent_count; e++)
+            dirtyMarkData(fs, extents[e].start, extents[e].length);
+        file->extents = extents;
+        file->extent_count = extent_count;
+        file->block_count = blocks;
+        file->file_size = files[i].size;
+        plan->jobs[plan->job_count++] = (ImportJob){files[i].path, file, NULL, 0};
+    }
+
+    // hand back whatever skipped files left of the reservation
+    if (pooled && cursor < pool_count)
+    {
+        pool[cursor].start += offset;
+        pool[cursor].length -= offset;
+        freeExtents(fs, pool + cursor, pool_count - cursor);
+    }
+    free(pool);
+}
+
+// Subdirectory `name` of `dir`, created if missing; NULL if a file has that
+// name or snapshots sharing the existing one cannot be given copies of it.
+static Inode *importDir(ImportPlan *plan, Inode *dir, const char *name)
+{
+    Inode *sub = dirLookup(dir, name);
+    if (sub)
+        return sub->is_directory && snapshotUnshare(plan->fs, sub) == 0 ? sub : NULL;
+    sub = newInode(plan->fs, name, 1, dir);
+    if (sub && dirAddItem(dir, sub) != 0)
+    {
+        releaseInode(plan->fs, sub);
+        sub = NULL;
+    }
+    if (sub)
+    {
+        plan->dirs++;
+        journalLogCreate(plan->fs, sub);
+    }
+    return sub;
+}
+
+static void planTree(ImportPlan *plan, char *host_root, Inode *root)
+{
+    HostDir *stack = NULL;
+    size_t depth = 0, stack_capacity = 0;
+    if (growArray((void **)&stack, &stack_capacity, depth, sizeof(HostDir)) != 0)
+    {
+        free(host_root);
+        return;
+    }
+    stack[depth++] = (HostDir){host_root, root};
+
+    while (depth > 0)
+    {
+        HostDir current = stack[--depth];
+        DIR *handle = opendir(current.path);
+        if (!handle)
+        {
+            printf("Failed to open host directory '%s'.\n", current.path);
+            free(current.path);
+            plan->skipped++;
+            continue;
+        }
+
+        PendingFile *files = NULL;
+        size_t file_count = 0, file_capacity = 0;
+        struct dirent *entry;
+        while ((entry = readdir(handle)) != NULL)
+        {
+            const char *name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+
+            char *path = hostPathJoin(current.path, name);
+            struct stat st;
+            int ok = path && strlen(name) < MAX_NAME_LENGTH && !inSnapshots(plan->fs, current.dir, name) && stat(path, &st) == 0;
+            if (ok && S_ISDIR(st.st_mode))
+            {
+                Inode *sub = importDir(plan, current.dir, name);
+                ok = sub && growArray((void **)&stack, &stack_capacity, depth, sizeof(HostDir)) == 0;
+                if (ok)
+                    stack[depth++] = (HostDir){path, sub};
+            }
+            else if (ok && S_ISREG(st.st_mode) && !dirLookup(current.dir, name))
+            {
+                ok = growArray((void **)&files, &file_capacity, file_count, sizeof(PendingFile)) == 0;
+                if (ok)
+                    files[file_count++] = (PendingFile){path, path + strlen(path) - strlen(name), (size_t)st.st_size};
+            }
+            else
+                ok = 0;
+
+            if (!ok)
+            {
+                printf("Skipped '%s'.\n", path ? path : name);
+                free(path);
+                plan->skipped++;
+            }
+        }
+        closedir(handle);
+
+        reserveFiles(plan, current.dir, files, file_count);
+        free(files);
+        free(current.path);
+    }
+    free(stack);
+}
+
+static void importJob(void *context, size_t i)
+{
+    ImportPlan *plan = (ImportPlan *)context;
+    ImportJob *job = &plan->jobs[i];
+    int fd = open(job->host_path, O_RDONLY | O_BINARY);
+    job->failed = fd < 0 || readFileData(plan->fs, job->file, fd) != 0;
+    if (fd >= 0)
+        close(fd);
+    if (!job->failed && job->file->block_count > 0 && dedupActive(plan->fs) &&
+        (job->prints = (uint64_t *)malloc(job->file->block_count * sizeof(uint64_t))) != NULL)
+        dedupFingerprintFile(plan->fs, job->file, job->prints);
+}
+
+void putTree(FileSystem *fs, const char *hostdir)
+{
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    struct stat st;
+    if (stat(hostdir, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        printf("Host directory '%s' not found.\n", hostdir);
+        return;
+    }
+
+    // the tree lands in a directory named after the host one, or in the
+    // current directory itself for ".", ".." and "/"
+    size_t length = strlen(hostdir);
+    while (length > 1 && hostdir[length - 1] == '/')
+        length--;
+    size_t base = length;
+    while (base > 0 && hostdir[base - 1] != '/' && hostdir[base - 1] != '\\')
+        base--;
+    char name[MAX_NAME_LENGTH];
+    if (length - base >= MAX_NAME_LENGTH)
+    {
+        printf("Invalid directory name '%s'.\n", hostdir);
+        return;
+    }
+    memcpy(name, hostdir + base, length - base);
+    name[length - base] = '\0';
+    // "." and ".." import into the current directory itself
+    int named = name[0] && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+    if (inSnapshots(fs, fs->current_directory, named ? name : NULL))
+    {
+        printf("Cannot import '%s': snapshots are read-only.\n", hostdir);
+        return;
+    }
+    if (snapshotUnshare(fs, fs->current_directory) != 0)
+        return;
+
+    ImportPlan plan = {0};
+    plan.fs = fs;
+    Inode *root = fs->current_directory;
+    if (named)
+        root = importDir(&plan, fs->current_directory, name);
+    char *host_root = root ? strdup(hostdir) : NULL;
+    if (!host_root)
+    {
+        printf("Cannot import into '%s'.\n", name);
+        return;
+    }
+
+    dedupPrepare(fs);
+    planTree(&plan, host_root, root);
+
+    size_t threads = runParallel(plan.job_count, importJob, &plan);
+
+    size_t files = 0, bytes = 0;
+    for (size_t i = 0; i < plan.job_count; i++)
+    {
+        ImportJob *job = &plan.jobs[i];
+        if (job->failed)
+        {
+            printf("Failed to read '%s'.\n", job->host_path);
+            dirRemoveItem(job->file->parent, job->file);
+            freeExtents(fs, job->file->extents, job->file->extent_count);
+            releaseInode(fs, job->file);
+            plan.skipped++;
+        }
+        else
+        {
+            // logged once its blocks hold the data
+            dedupFile(fs, job->file, job->prints);
+            journalLogCreate(fs, job->file);
+            journalLogData(fs, job->file);
+            files++;
+            bytes += job->file->file_size;
+        }
+        free(job->prints);
+        free(job->host_path);
+    }
+    free(plan.jobs);
+
+    double seconds = secondsSince(&started);
+    printf("Imported %zu files and %zu directories (%zu skipped) in %.3f s with %zu threads: %.1f files/s, %.1f MB/s\n",
+           files, plan.dirs, plan.skipped, seconds, threads,
+           files / seconds, bytes / seconds / (1024.0 * 1024.0));
+}
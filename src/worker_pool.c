@@ -0,0 +1,62 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "worker_pool.h"
+
+typedef struct Pool
+{
+    size_t job_count;
+    size_t next; // next unclaimed job
+    void (*job)(void *context, size_t i);
+    void *context;
+} Pool;
+
+static void *poolWorker(void *arg)
+{
+    Pool *pool = (Pool *)arg;
+    for (;;)
+    {
+        size_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (i >= pool->job_count)
+            break;
+        pool->job(pool->context, i);
+    }
+    return NULL;
+}
+
+static size_t workerCount(size_t job_count)
+{
+    long cpus = 4;
+#ifdef _SC_NPROCESSORS_ONLN
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    size_t workers = cpus > 0 ? (size_t)cpus : 1;
+    if (workers > POOL_MAX_WORKERS)
+        workers = POOL_MAX_WORKERS;
+    if (workers > job_count)
+        workers = job_count;
+    return workers ? workers : 1;
+}
+
+size_t runParallel(size_t job_count, void (*job)(void *context, size_t i), void *context)
+{
+    Pool pool = {job_count, 0, job, context};
+    size_t workers = workerCount(job_count);
+    pthread_t threads[POOL_MAX_WORKERS];
+    size_t started = 0;
+
+    // if a thread cannot be started the others simply take more jobs
+    while (started + 1 < workers && pthread_create(&threads[started], NULL, poolWorker, &pool) == 0)
+        started++;
+    poolWorker(&pool);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    return started + 1;
+}
+
+double secondsSince(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (double)(now.tv_sec - since->tv_sec) + (double)(now.tv_nsec - since->tv_nsec) / 1e9;
+    return seconds > 0 ? seconds : 1e-9;
+}